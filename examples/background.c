@@ -0,0 +1,103 @@
+/*****************************************************************************
+*
+*  Copyright (C) 2015 Exosite LLC
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*    Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+*
+*    Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the
+*    distribution.
+*
+*    Neither the name of Texas Instruments Incorporated nor the names of
+*    its contributors may be used to endorse or promote products derived
+*    from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+*  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+*  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+*  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+*  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+*  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+*  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+*  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+*  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*****************************************************************************/
+
+
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include "exosite.h"
+#include "exosite_background.h"
+#include "exosite_pal.h"
+
+const char VENDOR[] = "patrick";
+const char MODEL[] =  "generic_test";
+const char SERIAL[] = "001";
+
+int main(void)
+{
+    long long unsigned int loopcount = 0;
+    char loop_str[16];
+    exo_op ops[4];
+    exo_context ctx;
+    exopal_posix pal = {0};
+    exo_submission slots[16];
+    exo_completion completions[16], done;
+    exo_background bg;
+    exopal_log_record log_rec;
+    char log_line[128];
+
+    if (exo_init(&ctx, &exopal_posix_ops, &pal, VENDOR, MODEL, SERIAL) != EXO_OK)
+        return 1;
+
+    for (int i = 0; i < 4; i++){
+        exo_op_init(&ops[i]);
+    }
+
+    // from here on the library runs on its own thread, this one only
+    // queues requests and collects the results
+    exo_set_submit_queue(&ctx, slots, 16);
+    if (exo_start_background(&bg, &ctx, ops, 4, completions, 16) != EXO_OK)
+        return 1;
+
+    while (loopcount < 100)
+    {
+        snprintf(loop_str, sizeof(loop_str), "%llu", loopcount);
+        if (exo_background_write(&bg, "uptime", loop_str, 0, NULL) != EXO_OK)
+            printf("[WARNING] queue full, dropped uptime %s\n", loop_str);
+
+        if (loopcount % 10 == 0)
+            exo_background_read(&bg, "command", 1, NULL);
+
+        while (exo_background_take(&bg, &done)) {
+            if (!done.success)
+                printf("[ERROR] on '%s'\n", done.alias);
+            else if (done.type == EXO_READ)
+                printf("[SUCCESS] got '%s' = `%s`\n", done.alias, done.value);
+            else
+                printf("[SUCCESS] set '%s' = `%s`\n", done.alias, done.value);
+        }
+
+        while (exopal_posix_log_read(&pal, &log_rec) == 0) {
+            exopal_posix_log_format(&log_rec, log_line, sizeof(log_line));
+            fprintf(stderr, "%s\n", log_line);
+        }
+
+        nanosleep((struct timespec[]){{0, 500000000}}, NULL);
+        loopcount++;
+    }
+
+    exo_stop_background(&bg);
+
+    return 0;
+}
@@ -36,6 +36,7 @@
 #include <stdio.h>
 #include <time.h>
 #include "exosite.h"
+#include "exosite_pal.h"
 
 const char VENDOR[] = "patrick";
 const char MODEL[] =  "generic_test";
@@ -46,59 +47,96 @@ void command_handler (char *value)
     printf("Got Command: %s\n", value);
 }
 
+// reports how an op went, true if it failed
+static int report(exo_op *op)
+{
+    if (exo_is_op_success(op)) {
+        if (exo_is_op_read(op) || exo_is_op_subscribe(op)) {
+            printf("[SUCCESS] got '%s' = `%s`\n", op->alias, op->value);
+        } else if (exo_is_op_write(op)) {
+            printf("[SUCCESS] set '%s' = `%s`\n", op->alias, op->value);
+        } else {
+            printf("[WARNING] something succeeded, but I don't know what\n");
+        }
+        return 0;
+    }
+
+    printf("[ERROR] on '%s'\n", op->alias);
+    return 1;
+}
+
 int main(void)
 {
     long long unsigned int loopcount = 0, errorcount = 0;
     char read_str[32];
     char loop_str[16];
     char error_str[16];
-    const uint8_t op_count = 4;
-    exo_op ops[op_count];
-
-    exo_init(VENDOR, MODEL, SERIAL);
+    enum { op_count = 4 };
+    char arena[EXO_POOL_ARENA_SIZE(op_count)];
+    exo_pool pool;
+    exo_op *command, *op;
+    exo_op *writes[op_count];
+    int write_count = 0, failed;
+    exo_context ctx;
+    exopal_posix pal = {0};
+    exopal_log_record log_rec;
+    char log_line[128];
 
-    for (int i = 0; i < op_count; i++){
-        exo_op_init(&ops[i]);
-    }
+    exo_init(&ctx, &exopal_posix_ops, &pal, VENDOR, MODEL, SERIAL);
+    exo_pool_init(&pool, arena, sizeof(arena));
 
-    // only need to setup subscribe once
-    exo_subscribe(&ops[1], "command", read_str, 32);
+    // only need to setup subscribe once, it keeps its op
+    command = exo_op_acquire(&pool);
+    exo_subscribe(command, "command", read_str, 32);
     
     while(1)
     {
-        if (loopcount % 100 == 0){
+        if (loopcount % 100 == 0 && (op = exo_op_acquire(&pool)) != NULL){
             // prepare data to write
             snprintf(loop_str, 15, "%llu", loopcount);
 
             // queue write operation
-            exo_write(&ops[2], "uptime", loop_str);
+            exo_write(op, "uptime", loop_str);
+            writes[write_count++] = op;
         }
 
         // perform queued operations until all are done or failed
-        while(exo_operate(ops, op_count) != EXO_IDLE);
+        while(exo_operate_pool(&ctx, &pool) != EXO_IDLE);
+
+        // the PAL doesn't print its errors itself, that would block the loop
+        while (exopal_posix_log_read(&pal, &log_rec) == 0) {
+            exopal_posix_log_format(&log_rec, log_line, sizeof(log_line));
+            fprintf(stderr, "%s\n", log_line);
+        }
 
         // check if ops succeeded or failed
-        for (int i = 1; i < op_count; i++){
-            if (exo_is_op_finished(&ops[i])) {
-                if (exo_is_op_success(&ops[i])) {
-                    if (exo_is_op_read(&ops[i]) || exo_is_op_subscribe(&ops[i])) {
-                        printf("[SUCCESS] got '%s' = `%s`\n", ops[i].alias, ops[i].value);
-                    } else if (exo_is_op_write(&ops[i])) {
-                        printf("[SUCCESS] set '%s' = `%s`\n", ops[i].alias, ops[i].value);
-                    } else {
-                        printf("[WARNING] something succeeded, but I don't know what\n");
-                    }
-                } else {
-                    printf("[ERROR] on '%s'\n", ops[i].alias);
-                    printf("        error count is now %llu\n", errorcount);
-
-                    // queue a write to error count next time
-                    snprintf(error_str, 15, "%llu", errorcount);
-                    exo_write(&ops[3], "errorcount", error_str);
-                }
-
-                exo_op_done(&ops[i]);
+        failed = 0;
+        if (exo_is_op_finished(command)) {
+            failed += report(command);
+            exo_op_done(command);
+        }
+
+        for (int i = 0; i < write_count; ){
+            if (!exo_is_op_finished(writes[i])) {
+                i++;
+                continue;
             }
+
+            failed += report(writes[i]);
+
+            // one-shot ops go back to the pool once they're finished
+            exo_op_release(&pool, writes[i]);
+            writes[i] = writes[--write_count];
+        }
+
+        errorcount += failed;
+        if (failed && (op = exo_op_acquire(&pool)) != NULL) {
+            printf("        error count is now %llu\n", errorcount);
+
+            // queue a write to error count next time
+            snprintf(error_str, 15, "%llu", errorcount);
+            exo_write(op, "errorcount", error_str);
+            writes[write_count++] = op;
         }
 
         nanosleep((struct timespec[]){{0, 500000000}}, NULL);
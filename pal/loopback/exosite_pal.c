@@ -0,0 +1,207 @@
+/*****************************************************************************
+*
+*  exosite_pal.c - In-memory loopback Exosite platform adaptation layer
+*  Copyright (C) 2015 Exosite LLC
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*    Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+*
+*    Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the
+*    distribution.
+*
+*    Neither the name of Texas Instruments Incorporated nor the names of
+*    its contributors may be used to endorse or promote products derived
+*    from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+*  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+*  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+*  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+*  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+*  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+*  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+*  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+*  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*****************************************************************************/
+
+#include <string.h>
+
+#include "exosite_pal.h"
+
+static uint8_t exopal_queue_push(exopal_loopback_queue *q, const uint8_t *buf, size_t len)
+{
+	exopal_loopback_datagram *dg;
+
+	if (len > EXOPAL_LOOPBACK_MTU)
+		return 1;
+
+	if (q->count == EXOPAL_LOOPBACK_QUEUE_LEN)
+		return 2;
+
+	dg = &q->slot[(q->head + q->count) % EXOPAL_LOOPBACK_QUEUE_LEN];
+	memcpy(dg->buf, buf, len);
+	dg->len = len;
+	q->count++;
+
+	return 0;
+}
+
+static uint8_t exopal_queue_pop(exopal_loopback_queue *q, uint8_t *buf, size_t size, size_t *len)
+{
+	exopal_loopback_datagram *dg;
+
+	if (q->count == 0)
+		return 2;
+
+	dg = &q->slot[q->head];
+
+	// Like a real socket, whatever doesn't fit is lost.
+	*len = dg->len < size ? dg->len : size;
+	memcpy(buf, dg->buf, *len);
+
+	q->head = (q->head + 1) % EXOPAL_LOOPBACK_QUEUE_LEN;
+	q->count--;
+
+	return 0;
+}
+
+static uint8_t exopal_init(void *pal)
+{
+	return 0;
+}
+
+/*!
+ * \brief Creates a udp socket
+ *
+ * There is no socket, the queues are always ready. Calls are counted in
+ * `socks`.
+ *
+ * \return 0
+ */
+static uint8_t exopal_udp_sock(void *pal)
+{
+	exopal_loopback *lb = pal;
+
+	lb->socks++;
+	return 0;
+}
+
+/*!
+ * \brief Hands a datagram to the peer
+ *
+ * \return 0 if successful, else error code
+ */
+static uint8_t exopal_udp_send(void *pal, const uint8_t *buf, size_t len)
+{
+	exopal_loopback *lb = pal;
+
+	if (lb->send_error != 0)
+		return lb->send_error;
+
+	if (lb->peer != NULL) {
+		if (len > EXOPAL_LOOPBACK_MTU)
+			return 1;
+
+		lb->peer(lb, buf, len, lb->peer_data);
+		return 0;
+	}
+
+	return exopal_queue_push(&lb->to_peer, buf, len);
+}
+
+/*!
+ * \brief Receives a datagram injected by the peer
+ *
+ * \return 0 if successful, 2 if nothing is waiting
+ */
+static uint8_t exopal_udp_recv(void *pal, uint8_t *buf, size_t size, size_t *rlen)
+{
+	exopal_loopback *lb = pal;
+
+	return exopal_queue_pop(&lb->to_device, buf, size, rlen);
+}
+
+static uint8_t exopal_store_cik(void *pal, const char *cik)
+{
+	exopal_loopback_set_cik(pal, cik);
+
+	return 0;
+}
+
+/*!
+ * \return 0 if successful , 1 if no CIK has been saved
+ */
+static uint8_t exopal_retrieve_cik(void *pal, char *cik)
+{
+	exopal_loopback *lb = pal;
+
+	if (!lb->has_cik)
+		return 1;
+
+	memcpy(cik, lb->cik, CIK_LENGTH);
+
+	return 0;
+}
+
+/*!
+ * \return the loopback's virtual time in microseconds
+ */
+static uint64_t exopal_get_time(void *pal)
+{
+	exopal_loopback *lb = pal;
+
+	return lb->time;
+}
+
+const exo_pal_ops exopal_loopback_ops = {
+	exopal_init,
+	exopal_store_cik,
+	exopal_retrieve_cik,
+	exopal_udp_sock,
+	exopal_udp_send,
+	exopal_udp_recv,
+	exopal_get_time,
+	NULL,                   // nothing to poll, datagrams are injected
+};
+
+/*!
+ * \brief Queues a datagram for the library to receive
+ *
+ * \return 0 if successful, 1 if too large, 2 if the queue is full
+ */
+uint8_t exopal_loopback_inject(exopal_loopback *lb, const uint8_t *buf, size_t len)
+{
+	return exopal_queue_push(&lb->to_device, buf, len);
+}
+
+/*!
+ * \brief Takes the oldest datagram the library sent
+ *
+ * Only used when no peer callback is set.
+ *
+ * \return 0 if successful, 2 if nothing is waiting
+ */
+uint8_t exopal_loopback_take(exopal_loopback *lb, uint8_t *buf, size_t size, size_t *len)
+{
+	return exopal_queue_pop(&lb->to_peer, buf, size, len);
+}
+
+void exopal_loopback_set_cik(exopal_loopback *lb, const char *cik)
+{
+	memcpy(lb->cik, cik, CIK_LENGTH);
+	lb->has_cik = 1;
+}
+
+void exopal_loopback_advance(exopal_loopback *lb, uint64_t us)
+{
+	lb->time += us;
+}
@@ -0,0 +1,103 @@
+/*****************************************************************************
+*
+*  exosite_pal.h - In-memory loopback Exosite platform adaptation layer
+*  Copyright (C) 2015 Exosite LLC
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*    Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+*
+*    Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the
+*    distribution.
+*
+*    Neither the name of Texas Instruments Incorporated nor the names of
+*    its contributors may be used to endorse or promote products derived
+*    from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+*  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+*  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+*  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+*  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+*  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+*  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+*  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+*  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*****************************************************************************/
+
+#ifndef EXOSITE_PAL_LOOPBACK_H
+#define EXOSITE_PAL_LOOPBACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "exosite.h"
+
+// Datagrams larger than this are dropped, matches the library's own buffers.
+#define EXOPAL_LOOPBACK_MTU                     576
+
+// Datagrams each direction can hold, raise it when driving many ops at once.
+#ifndef EXOPAL_LOOPBACK_QUEUE_LEN
+#define EXOPAL_LOOPBACK_QUEUE_LEN               16
+#endif
+
+struct exopal_loopback;
+
+/*!
+ * Called with every datagram the library sends. The peer may answer right
+ * away with `exopal_loopback_inject()`. When no peer is set datagrams are
+ * queued instead and can be collected with `exopal_loopback_take()`.
+ */
+typedef void (*exopal_loopback_peer)(struct exopal_loopback *lb,
+                                     const uint8_t *buf, size_t len,
+                                     void *peer_data);
+
+typedef struct exopal_loopback_datagram
+{
+	size_t len;
+	uint8_t buf[EXOPAL_LOOPBACK_MTU];
+} exopal_loopback_datagram;
+
+typedef struct exopal_loopback_queue
+{
+	exopal_loopback_datagram slot[EXOPAL_LOOPBACK_QUEUE_LEN];
+	uint16_t head;
+	uint16_t count;
+} exopal_loopback_queue;
+
+/*!
+ * Loopback PAL instance data, pass a pointer to one of these to `exo_init()`
+ * along with `exopal_loopback_ops`. Nothing leaves the process: sent datagrams
+ * go to the peer, the clock only moves when the owner moves it and the CIK is
+ * kept in memory. Zero it before use.
+ */
+typedef struct exopal_loopback
+{
+	exopal_loopback_queue to_device;
+	exopal_loopback_queue to_peer;
+	exopal_loopback_peer peer;
+	void *peer_data;
+	uint64_t time;
+	char cik[CIK_LENGTH];
+	uint8_t has_cik;
+	uint8_t send_error;                 // udp_send fails with it when non-zero
+	uint32_t socks;                     // udp_sock calls so far
+} exopal_loopback;
+
+extern const exo_pal_ops exopal_loopback_ops;
+
+uint8_t exopal_loopback_inject(exopal_loopback *lb, const uint8_t *buf, size_t len);
+uint8_t exopal_loopback_take(exopal_loopback *lb, uint8_t *buf, size_t size, size_t *len);
+void exopal_loopback_set_cik(exopal_loopback *lb, const char *cik);
+void exopal_loopback_advance(exopal_loopback *lb, uint64_t us);
+
+#endif
+
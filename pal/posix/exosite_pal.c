@@ -34,64 +34,731 @@
 *****************************************************************************/
 
 #include "exosite_pal.h"
+#include "exosite_trace.h"
 
-#define PAL_CIK_LENGTH 40
+#ifdef __linux__
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
 
-static int exosock;
+#define PAL_CIK_LENGTH 40
 
-static char exosite_pal_host[] = "coap.exosite.com";
-static char exosite_pal_port[] = "5683";
+static const char exosite_pal_host[] = "coap.exosite.com";
+static const char exosite_pal_port[] = "5683";
+static const char exosite_pal_cik_path[] = "cik";
+static const char exosite_pal_state_path[] = "exostate";
+static const char exosite_pal_dns_cache_path[] = "exodns";
 
 int errno;
 
+static uint64_t exopal_clock(void);
+
+static void exopal_log_push(exopal_log *log, uint64_t now, uint8_t level, uint8_t code,
+                            int err, uint16_t id, uint32_t repeats)
+{
+	uint32_t head = __atomic_load_n(&log->head, __ATOMIC_RELAXED);
+	exopal_log_record *rec;
+
+	if (head - __atomic_load_n(&log->tail, __ATOMIC_ACQUIRE) == EXOPAL_LOG_LEN) {
+		__atomic_fetch_add(&log->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	rec = &log->ring[head % EXOPAL_LOG_LEN];
+	rec->time = now;
+	rec->repeats = repeats;
+	rec->err = err;
+	rec->id = id;
+	rec->level = level;
+	rec->code = code;
+	__atomic_store_n(&log->head, head + 1, __ATOMIC_RELEASE);
+}
+
 /*!
- * \brief Creates a udp socket
+ * \brief Queues a log record
  *
- * Ensures that the library has access to a client style UDP socket. This can
- * be done either through an OS, or direct calls to the modem.
+ * Never blocks, so it is safe in the send and receive paths. A record with
+ * the same code and error as the last one of that code, and within
+ * EXOPAL_LOG_INTERVAL_US of it, is only counted. The count goes out with the
+ * next one of that code that is logged.
+ */
+static void exopal_log_write(exopal_posix *posix, exopal_log_level level, exopal_log_code code, int err, uint16_t id)
+{
+	exopal_log *log = &posix->log;
+	exopal_log_limit *limit = &log->limit[code];
+	uint64_t now;
+
+	if (level > log->level)
+		return;
+
+	now = exopal_clock();
+
+	if (limit->time != 0 && limit->err == err) {
+		if (now - limit->time < EXOPAL_LOG_INTERVAL_US) {
+			limit->suppressed++;
+			return;
+		}
+	} else if (limit->suppressed != 0) {
+		// a different error ends a run, say how long it was
+		exopal_log_push(log, now, limit->level, code, limit->err, 0, limit->suppressed);
+		limit->suppressed = 0;
+	}
+
+	exopal_log_push(log, now, level, code, err, id, limit->suppressed);
+
+	limit->time = now;
+	limit->err = err;
+	limit->level = level;
+	limit->suppressed = 0;
+}
+
+/*!
+ * \brief Takes the oldest log record
  *
- * \return 0 if successful, else error code
+ * \param[in]  posix  PAL instance
+ * \param[out] rec    The record
+ *
+ * \return 0 if there was one, 1 if the log is empty
+ */
+uint8_t exopal_posix_log_read(exopal_posix *posix, exopal_log_record *rec)
+{
+	exopal_log *log = &posix->log;
+	uint32_t tail = __atomic_load_n(&log->tail, __ATOMIC_RELAXED);
+
+	if (tail == __atomic_load_n(&log->head, __ATOMIC_ACQUIRE))
+		return 1;
+
+	*rec = log->ring[tail % EXOPAL_LOG_LEN];
+	__atomic_store_n(&log->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/*!
+ * \brief Formats a log record as one line of text, without a newline
+ *
+ * \return What snprintf returned
+ */
+int exopal_posix_log_format(const exopal_log_record *rec, char *buf, size_t size)
+{
+	static const char *levels[] = {"error", "warning", "info", "debug"};
+	static const char *what[] = {"getaddrinfo", "socket", "no usable address", "connect", "send", "recv",
+	                              "addresses resolved", "address selected"};
+	const char *reason = "";
+	char repeats[32] = "", count[16];
+
+	if (rec->code == EXOPAL_LOG_RESOLVE) {
+		reason = gai_strerror(rec->err);
+	} else if (rec->code == EXOPAL_LOG_RESOLVED || rec->code == EXOPAL_LOG_SELECTED) {
+		snprintf(count, sizeof(count), "%d", (int)rec->err);
+		reason = count;
+	} else if (rec->err != 0) {
+		reason = strerror(rec->err);
+	}
+
+	if (rec->repeats != 0)
+		snprintf(repeats, sizeof(repeats), " (%u more)", (unsigned)rec->repeats);
+
+	return snprintf(buf, size, "%llu.%06u %s: %s%s%s mid %u%s",
+	                (unsigned long long)(rec->time / 1000000), (unsigned)(rec->time % 1000000),
+	                levels[rec->level & 3], what[rec->code < EXOPAL_LOG_CODES ? rec->code : 0],
+	                *reason ? ": " : "", reason, rec->id, repeats);
+}
+
+// writes path through path.tmp, fsync and rename, so it is never half done
+static uint8_t exopal_write_file(const char *path, const uint8_t *buf, size_t len)
+{
+	char tmp[256], dir[256];
+	const char *slash;
+	ssize_t n;
+	size_t done;
+	int fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+		return 2;
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return 2;
+
+	for (done = 0; done < len; done += n) {
+		n = write(fd, buf + done, len - done);
+		if (n < 0 && errno == EINTR) {
+			n = 0;
+		} else if (n < 0) {
+			close(fd);
+			unlink(tmp);
+			return 1;
+		}
+	}
+
+	if (fsync(fd) != 0) {
+		close(fd);
+		unlink(tmp);
+		return 1;
+	}
+	close(fd);
+
+	if (rename(tmp, path) != 0) {
+		unlink(tmp);
+		return 1;
+	}
+
+	// make the rename itself stick, best effort
+	slash = strrchr(path, '/');
+	if (slash == NULL)
+		strcpy(dir, ".");
+	else if (snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path + 1), path) >= (int)sizeof(dir))
+		return 0;
+
+	fd = open(dir, O_RDONLY);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+
+	return 0;
+}
+
+// looks up the platform, fills in at most EXOPAL_MAX_ADDRS addresses
+static int exopal_lookup(exopal_posix *posix, int flags, exopal_addr *addr, size_t *count)
+{
+	struct addrinfo hints, *servinfo, *q;
+	int rv;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = flags;
+
+	EXO_TRACE2(pal__resolve__entry, posix->host, posix->port);
+	rv = getaddrinfo(posix->host, posix->port, &hints, &servinfo);
+	EXO_TRACE1(pal__resolve__return, rv);
+
+	if (rv != 0)
+		return rv;
+
+	for (*count = 0, q = servinfo; q != NULL && *count < EXOPAL_MAX_ADDRS; q = q->ai_next) {
+		if (q->ai_addrlen > sizeof(addr[0].addr))
+			continue;
+		memcpy(&addr[*count].addr, q->ai_addr, q->ai_addrlen);
+		addr[*count].len = q->ai_addrlen;
+		(*count)++;
+	}
+	freeaddrinfo(servinfo);
+
+	return *count > 0 ? 0 : EAI_NONAME;
+}
+
+/*!
+ * The DNS cache is text: the host, port and the time of day the answer
+ * expires on the first line, then one address per line.
  */
- uint8_t exopal_udp_sock()
- {
-	// Socket to Exosite
+static void exopal_dns_cache_write(exopal_posix *posix, const exopal_addr *addr, size_t count)
+{
+	char buf[128 + EXOPAL_MAX_ADDRS * (INET6_ADDRSTRLEN + 1)];
+	const void *a;
+	size_t i;
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "%.63s %.15s %lld\n", posix->host, posix->port,
+	               (long long)time(NULL) + EXOPAL_DNS_TTL_S);
+
+	for (i = 0; i < count && len < (int)sizeof(buf); i++) {
+		if (addr[i].addr.ss_family == AF_INET)
+			a = &((const struct sockaddr_in *)&addr[i].addr)->sin_addr;
+		else if (addr[i].addr.ss_family == AF_INET6)
+			a = &((const struct sockaddr_in6 *)&addr[i].addr)->sin6_addr;
+		else
+			continue;
+
+		if (inet_ntop(addr[i].addr.ss_family, a, buf + len, sizeof(buf) - len) == NULL)
+			return;
+		len += strlen(buf + len);
+		if (len < (int)sizeof(buf) - 1)
+			buf[len++] = '\n';
+	}
+
+	if (len < (int)sizeof(buf))
+		exopal_write_file(posix->dns_cache_path, (const uint8_t *)buf, len);
+}
+
+static void exopal_dns_cache_read(exopal_posix *posix)
+{
+	char line[128], host[64], port[16];
+	long long expires;
+	struct sockaddr_in *in;
+	struct sockaddr_in6 *in6;
+	exopal_addr *addr;
+	uint64_t now;
+	FILE *file;
+
+	file = fopen(posix->dns_cache_path, "r");
+	if (file == NULL)
+		return;
+
+	if (fgets(line, sizeof(line), file) == NULL ||
+	    sscanf(line, "%63s %15s %lld", host, port, &expires) != 3 ||
+	    strcmp(host, posix->host) != 0 || strcmp(port, posix->port) != 0) {
+		fclose(file);
+		return;
+	}
+
+	posix->addr_count = 0;
+	while (posix->addr_count < EXOPAL_MAX_ADDRS && fgets(line, sizeof(line), file) != NULL) {
+		line[strcspn(line, "\n")] = 0;
+		addr = &posix->addr[posix->addr_count];
+		memset(addr, 0, sizeof(*addr));
+
+		in = (struct sockaddr_in *)&addr->addr;
+		in6 = (struct sockaddr_in6 *)&addr->addr;
+		if (inet_pton(AF_INET, line, &in->sin_addr) == 1) {
+			in->sin_family = AF_INET;
+			in->sin_port = htons(atoi(port));
+			addr->len = sizeof(*in);
+		} else if (inet_pton(AF_INET6, line, &in6->sin6_addr) == 1) {
+			in6->sin6_family = AF_INET6;
+			in6->sin6_port = htons(atoi(port));
+			addr->len = sizeof(*in6);
+		} else {
+			continue;
+		}
+		posix->addr_count++;
+	}
+	fclose(file);
+
+	// stale addresses are still worth trying while new ones are looked up
+	now = posix->now;
+	expires -= time(NULL);
+	posix->addr_expires = expires > 0 ? now + (uint64_t)expires * 1000000 : now;
+}
+
+static void *exopal_resolve_thread(void *arg)
+{
+	exopal_posix *posix = arg;
+	exopal_resolver *r = &posix->resolver;
+
+	r->err = exopal_lookup(posix, 0, r->addr, &r->count);
+	if (r->err == 0 && *posix->dns_cache_path != 0)
+		exopal_dns_cache_write(posix, r->addr, r->count);
+
+	__atomic_store_n(&r->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void exopal_resolve_start(exopal_posix *posix)
+{
+	exopal_resolver *r = &posix->resolver;
 	int rv;
 
-	struct addrinfo exohints, *servinfo, *q;
+	posix->resolve_after = posix->now + EXOPAL_DNS_RETRY_US;
 
-	memset(&exohints, 0, sizeof exohints);
-	exohints.ai_family = AF_UNSPEC;
-	exohints.ai_socktype = SOCK_DGRAM;
-	exohints.ai_flags = AI_PASSIVE;
+	r->done = 0;
+	rv = pthread_create(&r->thread, NULL, exopal_resolve_thread, posix);
+	if (rv != 0) {
+		exopal_log_write(posix, EXOPAL_LOG_ERROR, EXOPAL_LOG_RESOLVE, EAI_SYSTEM, 0);
+		return;
+	}
+	r->running = 1;
+}
 
-	if ((rv = getaddrinfo(exosite_pal_host, exosite_pal_port, &exohints, &servinfo)) != 0) {
-		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+// opens a socket connected to posix->addr[i]
+static uint8_t exopal_open(exopal_posix *posix, size_t i, int *sock)
+{
+	exopal_addr *addr = &posix->addr[i];
+
+	if ((*sock = socket(addr->addr.ss_family, SOCK_DGRAM, 0)) == -1) {
+		exopal_log_write(posix, EXOPAL_LOG_WARNING, EXOPAL_LOG_SOCKET, errno, 0);
+		return 1;
+	}
+
+	fcntl(*sock, F_SETFL, O_NONBLOCK);
+
+	if (connect(*sock, (struct sockaddr *)&addr->addr, addr->len) == -1) {
+		exopal_log_write(posix, EXOPAL_LOG_WARNING, EXOPAL_LOG_CONNECT, errno, 0);
+		close(*sock);
 		return 1;
 	}
 
-	// loop through all the results and make a socket
-	for(q = servinfo; q != NULL; q = q->ai_next) {
-		if ((exosock = socket(q->ai_family, q->ai_socktype, q->ai_protocol)) == -1) {
-			perror("Socket Call Failed");
+	return 0;
+}
+
+// connects a new socket to the first platform address that takes one
+static uint8_t exopal_connect(exopal_posix *posix)
+{
+	size_t i;
+	int sock;
+
+	if (posix->sock != -1) {
+		close(posix->sock);
+		posix->sock = -1;
+	}
+
+	for (i = 0; i < posix->addr_count; i++) {
+		if (exopal_open(posix, i, &sock) == 0) {
+			posix->sock = sock;
+			posix->addr_current = i;
+			return 0;
+		}
+	}
+
+	exopal_log_write(posix, EXOPAL_LOG_ERROR, EXOPAL_LOG_NO_SOCKET, 0, 0);
+	return 1;
+}
+
+static void exopal_race_stop(exopal_posix *posix)
+{
+	exopal_race *race = &posix->race;
+	size_t i;
+
+	for (i = 0; i < race->launched; i++) {
+		if (race->sock[i] != -1)
+			close(race->sock[i]);
+	}
+	race->start = 0;
+	race->count = 0;
+	race->launched = 0;
+}
+
+static void exopal_race_start(exopal_posix *posix, uint64_t now)
+{
+	exopal_race *race = &posix->race;
+	uint8_t used[EXOPAL_MAX_ADDRS] = {0};
+	sa_family_t want = posix->addr[0].addr.ss_family;
+	size_t i, pick;
+
+	// RFC 8305 Sec 4, alternate families so a broken one costs one delay
+	for (race->count = 0; race->count < posix->addr_count; race->count++) {
+		for (pick = 0; pick < posix->addr_count; pick++) {
+			if (!used[pick] && posix->addr[pick].addr.ss_family == want)
+				break;
+		}
+		for (i = 0; pick == posix->addr_count && i < posix->addr_count; i++) {
+			if (!used[i])
+				pick = i;
+		}
+
+		used[pick] = 1;
+		race->order[race->count] = pick;
+		want = posix->addr[pick].addr.ss_family == AF_INET6 ? AF_INET : AF_INET6;
+	}
+
+	race->start = now;
+	race->next = now;
+	race->launched = 0;
+	race->mid = (uint16_t)(now ^ (now >> 16));
+}
+
+/*!
+ * Hands the winner, if any, the traffic and closes the rest. A socket the
+ * library is already using is never swapped under it, it would lose its
+ * observations and the ACKs in flight: a different winner is kept for
+ * udp_sock and the next send or receive asks the library to reopen.
+ */
+static void exopal_race_end(exopal_posix *posix, int winner, uint64_t now)
+{
+	exopal_race *race = &posix->race;
+	int32_t rtt = -1;
+	size_t i;
+
+	if (winner >= 0) {
+		rtt = now - race->sent[winner];
+	} else if (posix->sock == -1) {
+		// nobody answered, pings may just be dropped, carry on as before
+		for (i = 0; i < race->launched && winner < 0; i++) {
+			if (race->sock[i] != -1)
+				winner = i;
+		}
+	}
+
+	if (winner >= 0 && posix->sock == -1) {
+		posix->sock = race->sock[winner];
+		posix->addr_current = race->order[winner];
+		race->sock[winner] = -1;
+		exopal_log_write(posix, EXOPAL_LOG_INFO, EXOPAL_LOG_SELECTED, rtt, 0);
+	} else if (winner >= 0 && race->order[winner] != posix->addr_current) {
+		posix->addr_next = race->order[winner];
+		posix->moved = 1;
+		exopal_log_write(posix, EXOPAL_LOG_INFO, EXOPAL_LOG_SELECTED, rtt, 0);
+	}
+
+	exopal_race_stop(posix);
+	posix->race_after = now + (rtt >= 0 ? EXOPAL_PROBE_INTERVAL_US : EXOPAL_DNS_RETRY_US);
+}
+
+/*!
+ * Moves the race on: pings the next address when its turn has come, looks
+ * for answers and ends it when one came or it ran out of time. Starts one
+ * when it's time to have another look. Never blocks, and goes by the
+ * library's last clock read rather than reading it again.
+ */
+static void exopal_race_poll(exopal_posix *posix)
+{
+	exopal_race *race = &posix->race;
+	uint64_t now = posix->now;
+	uint8_t buf[16];
+	uint16_t mid;
+	ssize_t n;
+	size_t i;
+	int sock;
+
+	if (race->start == 0) {
+		if (posix->addr_count > 1 && now >= posix->race_after)
+			exopal_race_start(posix, now);
+		else
+			return;
+	}
+
+	// an address that fails straight away doesn't hold up the next one
+	while (race->launched < race->count && now >= race->next) {
+		i = race->launched++;
+		race->sock[i] = -1;
+		if (exopal_open(posix, race->order[i], &sock) != 0)
+			continue;
+
+		// CoAP ping: an empty confirmable message, answered with a RST
+		mid = race->mid + i;
+		buf[0] = 0x40;
+		buf[1] = 0;
+		buf[2] = mid >> 8;
+		buf[3] = mid & 0xFF;
+		if (send(sock, buf, 4, 0) != 4) {
+			exopal_log_write(posix, EXOPAL_LOG_WARNING, EXOPAL_LOG_SEND, errno, mid);
+			close(sock);
 			continue;
 		}
 
-		fcntl(exosock, F_SETFL, O_NONBLOCK);
+		race->sock[i] = sock;
+		race->sent[i] = now;
+		race->next = now + EXOPAL_PROBE_DELAY_US;
+	}
 
-		break;
+	for (i = 0; i < race->launched; i++) {
+		if (race->sock[i] == -1)
+			continue;
+
+		mid = race->mid + i;
+		while ((n = recv(race->sock[i], buf, sizeof(buf), 0)) >= 0) {
+			if (n >= 4 && (buf[0] & 0xF0) == 0x70 && buf[1] == 0 &&
+			    ((buf[2] << 8) | buf[3]) == mid) {
+				exopal_race_end(posix, i, now);
+				return;
+			}
+		}
+
+		// e.g. ICMP unreachable, this one is out, don't wait to try the next
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			close(race->sock[i]);
+			race->sock[i] = -1;
+			race->next = now;
+		}
 	}
 
-	if (q == NULL) {
-		fprintf(stderr, "Failed to Bind Socket\n");
-		return 2;
+	if (now - race->start >= EXOPAL_PROBE_TIMEOUT_US)
+		exopal_race_end(posix, -1, now);
+}
+
+// starts using the addresses, racing them when there is a choice
+static void exopal_select(exopal_posix *posix)
+{
+	exopal_race_stop(posix);
+	posix->race_after = 0;
+
+	if (posix->addr_count > 1)
+		exopal_race_poll(posix);
+	else
+		exopal_connect(posix);
+}
+
+/*!
+ * Picks up a finished resolution, and starts one when the addresses are
+ * stale or the platform stopped answering. Called from the send and receive
+ * paths, so it never blocks.
+ */
+static void exopal_resolve_poll(exopal_posix *posix)
+{
+	exopal_resolver *r = &posix->resolver;
+	uint64_t now;
+
+	if (r->running) {
+		if (!__atomic_load_n(&r->done, __ATOMIC_ACQUIRE))
+			return;
+
+		pthread_join(r->thread, NULL);
+		r->running = 0;
+
+		if (r->err != 0) {
+			exopal_log_write(posix, EXOPAL_LOG_ERROR, EXOPAL_LOG_RESOLVE, r->err, 0);
+		} else {
+			exopal_log_write(posix, EXOPAL_LOG_INFO, EXOPAL_LOG_RESOLVED, r->count, 0);
+			posix->addr_expires = posix->now + (uint64_t)EXOPAL_DNS_TTL_S * 1000000;
+
+			// keep the socket unless the platform moved or stopped answering
+			if (posix->sock == -1 || posix->unanswered >= EXOPAL_DNS_UNANSWERED ||
+			    r->count != posix->addr_count ||
+			    memcmp(r->addr, posix->addr, r->count * sizeof(r->addr[0])) != 0) {
+				exopal_race_stop(posix);
+				memcpy(posix->addr, r->addr, r->count * sizeof(r->addr[0]));
+				posix->addr_count = r->count;
+				posix->addr_next = -1;
+
+				// the library has exchanges and observations on a live
+				// socket, it moves them over itself when it reopens
+				if (posix->sock == -1)
+					exopal_select(posix);
+				else
+					posix->moved = 1;
+			}
+			posix->unanswered = 0;
+		}
+		return;
 	}
 
-	if (connect(exosock, q->ai_addr, q->ai_addrlen) == -1)
-		return 3;
+	if (posix->addr_expires == UINT64_MAX)
+		return; // a literal address, nothing to resolve
+
+	now = posix->now;
+	if (now >= posix->resolve_after &&
+	    (now >= posix->addr_expires || posix->unanswered >= EXOPAL_DNS_UNANSWERED))
+		exopal_resolve_start(posix);
+}
+
+#ifdef __linux__
+// joins the groups that hear about addresses coming and going
+static void exopal_netlink_open(exopal_posix *posix)
+{
+	struct sockaddr_nl nl;
+	int fd;
+
+	if ((fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE)) == -1) {
+		exopal_log_write(posix, EXOPAL_LOG_WARNING, EXOPAL_LOG_SOCKET, errno, 0);
+		return;
+	}
+
+	memset(&nl, 0, sizeof(nl));
+	nl.nl_family = AF_NETLINK;
+	nl.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+	if (bind(fd, (struct sockaddr *)&nl, sizeof(nl)) == -1) {
+		exopal_log_write(posix, EXOPAL_LOG_WARNING, EXOPAL_LOG_SOCKET, errno, 0);
+		close(fd);
+		return;
+	}
+
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	posix->netlink = fd;
+}
+#endif
+
+// non-zero if an address was added or removed since the last call
+static uint8_t exopal_addresses_changed(exopal_posix *posix)
+{
+	uint8_t changed = 0;
+#ifdef __linux__
+	uint8_t buf[4096];
+	struct nlmsghdr *h;
+	ssize_t n;
+
+	if (posix->netlink == -1)
+		return 0;
+
+	while ((n = recv(posix->netlink, buf, sizeof(buf), 0)) > 0) {
+		for (h = (struct nlmsghdr *)buf; NLMSG_OK(h, n); h = NLMSG_NEXT(h, n)) {
+			if (h->nlmsg_type == RTM_NEWADDR || h->nlmsg_type == RTM_DELADDR)
+				changed = 1;
+		}
+	}
+#endif
+	return changed;
+}
+
+/*!
+ * \brief Creates a udp socket
+ *
+ * Ensures that the library has access to a client style UDP socket. This can
+ * be done either through an OS, or direct calls to the modem.
+ *
+ * Never waits for DNS: a literal address is used as is, else the cached
+ * addresses are used while the name is resolved again in the background if
+ * they are stale, or there are none.
+ *
+ * The library calls it again when the socket keeps failing, or when send or
+ * receive said the platform is better reached another way, then a new one
+ * replaces it, connected anew so it picks up the current source address,
+ * to the addresses already known.
+ *
+ * \return 0 if successful, else error code
+ */
+static uint8_t exopal_udp_sock(void *pal)
+{
+	exopal_posix *posix = pal;
+	int sock;
+
+	// rare enough to read the clock itself, the race may start from here
+	posix->now = exopal_clock();
+
+	exopal_race_stop(posix);
+	if (posix->sock != -1) {
+		close(posix->sock);
+		posix->sock = -1;
+	}
+	posix->unanswered = 0;
+	posix->moved = 0;
+
+#ifdef __linux__
+	if (posix->watch_addresses && posix->netlink == -1)
+		exopal_netlink_open(posix);
+#endif
+
+	if (exopal_lookup(posix, AI_NUMERICHOST, posix->addr, &posix->addr_count) == 0) {
+		posix->addr_expires = UINT64_MAX;
+		return exopal_connect(posix) == 0 ? 0 : 3;
+	}
+
+	// straight to the address that just won a race, no need to run it again
+	if (posix->addr_next >= 0 && (size_t)posix->addr_next < posix->addr_count &&
+	    exopal_open(posix, posix->addr_next, &sock) == 0) {
+		posix->sock = sock;
+		posix->addr_current = posix->addr_next;
+		posix->addr_next = -1;
+		return 0;
+	}
+	posix->addr_next = -1;
+
+	if (posix->addr_count == 0 && *posix->dns_cache_path != 0)
+		exopal_dns_cache_read(posix);
+	if (posix->addr_count > 0)
+		exopal_select(posix);
+
+	exopal_resolve_poll(posix);
 
 	return 0;
 }
 
+/*!
+ * \brief Closes the socket and waits for a resolution still running
+ *
+ * Call it before the exopal_posix goes away.
+ */
+void exopal_posix_close(exopal_posix *posix)
+{
+	exopal_race_stop(posix);
+
+	if (posix->resolver.running) {
+		pthread_join(posix->resolver.thread, NULL);
+		posix->resolver.running = 0;
+	}
+
+	if (posix->sock != -1) {
+		close(posix->sock);
+		posix->sock = -1;
+	}
+
+	if (posix->netlink != -1) {
+		close(posix->netlink);
+		posix->netlink = -1;
+	}
+}
+
 
 /*!
  * \brief
@@ -99,11 +766,28 @@ int errno;
  * Any HW or SW initialization should be performed in here
  *
  * This function is meant to perform any one time initialization and/or setup.
- * This will be called every time Exosite_init is called.
+ * This will be called every time exo_init is called.
  *
  */
-uint8_t exopal_init()
+static uint8_t exopal_init(void *pal)
 {
+	exopal_posix *posix = pal;
+
+	if (posix->host == NULL)
+		posix->host = exosite_pal_host;
+	if (posix->port == NULL)
+		posix->port = exosite_pal_port;
+	if (posix->cik_path == NULL)
+		posix->cik_path = exosite_pal_cik_path;
+	if (posix->state_path == NULL)
+		posix->state_path = exosite_pal_state_path;
+	if (posix->dns_cache_path == NULL)
+		posix->dns_cache_path = exosite_pal_dns_cache_path;
+
+	posix->sock = -1;
+	posix->netlink = -1;
+	posix->addr_next = -1;
+
 	return 0;
 }
 
@@ -119,14 +803,34 @@ uint8_t exopal_init()
  *
  * \return 0 if successful, else error code
  */
-uint8_t exopal_udp_send(const uint8_t *buf, size_t len)
+static uint8_t exopal_udp_send(void *pal, const uint8_t *buf, size_t len)
 {
-	size_t bytes_sent;
-	if ((bytes_sent = send(exosock, buf, len, 0)) == -1){
-		fprintf(stderr, "Socket SEND Error: %s\n", strerror(errno));
+	exopal_posix *posix = pal;
+	ssize_t bytes_sent;
+
+	// the platform moved, have the library start over on a new socket
+	exopal_resolve_poll(posix);
+	if (posix->moved) {
+		posix->moved = 0;
+		return 3;
+	}
+
+	exopal_race_poll(posix);
+
+	// no address yet, the library keeps it queued
+	if (posix->sock == -1)
+		return 2;
+
+	EXO_TRACE1(pal__send__entry, len);
+	bytes_sent = send(posix->sock, buf, len, 0);
+	EXO_TRACE1(pal__send__return, bytes_sent);
+
+	if (bytes_sent == -1){
+		exopal_log_write(posix, EXOPAL_LOG_ERROR, EXOPAL_LOG_SEND, errno, len >= 4 ? (buf[2] << 8) | buf[3] : 0);
 		return 1;
 	}
 
+	posix->unanswered++;
 	return 0;
 }
 
@@ -145,13 +849,33 @@ uint8_t exopal_udp_send(const uint8_t *buf, size_t len)
  *
  * \return 0 if successful, else error code
  */
-uint8_t exopal_udp_recv(uint8_t *buf, size_t size, size_t *rlen)
+static uint8_t exopal_udp_recv(void *pal, uint8_t *buf, size_t size, size_t *rlen)
 {
+	exopal_posix *posix = pal;
 	ssize_t bytes_recv;
-	bytes_recv = recv(exosock, buf, size, 0);
+
+	// the source address may be gone, have the library start over
+	if (exopal_addresses_changed(posix))
+		return 3;
+
+	exopal_resolve_poll(posix);
+	if (posix->moved) {
+		posix->moved = 0;
+		return 3;
+	}
+
+	exopal_race_poll(posix);
+
+	if (posix->sock == -1)
+		return 2;
+
+	EXO_TRACE1(pal__recv__entry, size);
+	bytes_recv = recv(posix->sock, buf, size, 0);
+	EXO_TRACE1(pal__recv__return, bytes_recv);
+
 	if (bytes_recv < 0) {
 		if (errno != EAGAIN){
-			fprintf(stderr, "Socket RECV Error: %s\n", strerror(errno));
+			exopal_log_write(posix, EXOPAL_LOG_ERROR, EXOPAL_LOG_RECV, errno, 0);
 			return 1;
 		} else {
 			return 2;
@@ -159,6 +883,7 @@ uint8_t exopal_udp_recv(uint8_t *buf, size_t size, size_t *rlen)
 	}
 
 	*rlen = bytes_recv;
+	posix->unanswered = 0;
 
 	return 0;
 }
@@ -170,23 +895,23 @@ uint8_t exopal_udp_recv(uint8_t *buf, size_t size, size_t *rlen)
  *
  * \return 0 if successful, else error code
  */
-uint8_t exopal_store_cik(const char *cik)
+static uint8_t exopal_store_cik(void *pal, const char *cik)
 {
+	exopal_posix *posix = pal;
 	size_t bytes_written;
 	FILE *file;
-	file = fopen("cik", "w");
+	file = fopen(posix->cik_path, "w");
 
 	if (file == NULL)
 		return 2;
 	
-	bytes_written = fwrite(cik, sizeof(char), 40, file);
+	bytes_written = fwrite(cik, sizeof(char), PAL_CIK_LENGTH, file);
+	fclose(file);
 
-	if (bytes_written != 40)
+	if (bytes_written != PAL_CIK_LENGTH)
 		return 1;
 
 
-	fclose(file);
-
 	return 0;
 }
 
@@ -198,34 +923,127 @@ uint8_t exopal_store_cik(const char *cik)
  *
  * \return 0 if successful , 1 if no CIK has been saved, >1 if fatal error
  */
-uint8_t exopal_retrieve_cik(char *cik)
+static uint8_t exopal_retrieve_cik(void *pal, char *cik)
 {
+	exopal_posix *posix = pal;
 	size_t bytes_read;
 	FILE *file;
-	file = fopen("cik", "r");
+	file = fopen(posix->cik_path, "r");
 
 	if (file == NULL)
 		return 2;
 	
-	bytes_read = fread(cik, sizeof(char), 40, file);
+	bytes_read = fread(cik, sizeof(char), PAL_CIK_LENGTH, file);
+	fclose(file);
 
-	if (bytes_read != 40)
+	if (bytes_read != PAL_CIK_LENGTH)
 		return 1;
 
-	fclose(file);
 
 	return 0;
 }
 
+/*!
+ * \brief Writes state saved by exo_save_state() to state_path
+ *
+ * The state goes to a temporary file next to it first, which is flushed to
+ * disk and then renamed over state_path, so after a crash or power cut the
+ * file holds either the previous state or this one, never a mix. It blocks
+ * until the disk has it, call it from wherever that doesn't hurt.
+ *
+ * \param[in] buf State to write
+ * \param[in] len Length of buf
+ *
+ * \return 0 if successful, else error code
+ */
+uint8_t exopal_posix_save_state(exopal_posix *posix, const uint8_t *buf, size_t len)
+{
+	return exopal_write_file(posix->state_path, buf, len);
+}
 
-uint64_t exopal_get_time()
+/*!
+ * \brief Reads state written by exopal_posix_save_state()
+ *
+ * \param[out] buf  Where to put the state, for exo_restore_state()
+ * \param[in]  size Size of buf
+ * \param[out] len  Bytes read
+ *
+ * \return 0 if successful, 1 if nothing was saved, >1 if it can't be read
+ *         or is larger than buf
+ */
+uint8_t exopal_posix_load_state(exopal_posix *posix, uint8_t *buf, size_t size, size_t *len)
 {
-    struct timeval tv;
-    gettimeofday(&tv,NULL);
-    return tv.tv_sec * (uint64_t)1000000 + tv.tv_usec;
+	uint8_t extra;
+	ssize_t n = 0;
+	int fd;
+
+	fd = open(posix->state_path, O_RDONLY);
+	if (fd < 0)
+		return errno == ENOENT ? 1 : 2;
+
+	for (*len = 0; *len < size; *len += n) {
+		n = read(fd, buf + *len, size - *len);
+		if (n < 0 && errno == EINTR)
+			n = 0;
+		else if (n <= 0)
+			break;
+	}
+
+	// a full buf with more to come means buf was too small
+	if (n < 0 || (*len == size && read(fd, &extra, 1) > 0)) {
+		close(fd);
+		return 2;
+	}
+
+	close(fd);
+	return 0;
+}
+
+// reads EXOPAL_CLOCK in microseconds
+static uint64_t exopal_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(EXOPAL_CLOCK, &ts);
+    return ts.tv_sec * (uint64_t)1000000 + ts.tv_nsec / 1000;
+}
+
+/*!
+ * \brief Returns the current time in microseconds.
+ *
+ * Read from EXOPAL_CLOCK, which unlike the time of day doesn't jump when NTP
+ * or someone sets the clock, so timers neither all fire nor all stall. The
+ * library reads it once per pass, the send and receive paths go by that same
+ * reading for the address race and DNS deadlines.
+ *
+ * \return time in microseconds
+ */
+static uint64_t exopal_get_time(void *pal)
+{
+    exopal_posix *posix = pal;
+
+    posix->now = exopal_clock();
+    return posix->now;
 }
 
-void exopal_set_time(uint64_t timestamp_us)
+/*!
+ * \brief Returns the socket, for waiting on it with poll or epoll
+ *
+ * \return socket descriptor, -1 if there is none yet
+ */
+static int exopal_udp_fd(void *pal)
 {
-	return;
+	exopal_posix *posix = pal;
+
+	return posix->sock;
 }
+
+const exo_pal_ops exopal_posix_ops = {
+	exopal_init,
+	exopal_store_cik,
+	exopal_retrieve_cik,
+	exopal_udp_sock,
+	exopal_udp_send,
+	exopal_udp_recv,
+	exopal_get_time,
+	exopal_udp_fd,
+};
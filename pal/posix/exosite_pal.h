@@ -33,8 +33,8 @@
 *
 *****************************************************************************/
 
-#ifndef EXOSITE_PAL_H
-#define EXOSITE_PAL_H
+#ifndef EXOSITE_PAL_POSIX_H
+#define EXOSITE_PAL_POSIX_H
 
 #include <stdint.h>
 #include <stdio.h>
@@ -44,23 +44,221 @@
 #include <sys/unistd.h>
 #include <sys/fcntl.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <errno.h>
+#include <pthread.h>
 
-uint8_t exopal_init();
-uint8_t exopal_store_cik(const char *cik);
-uint8_t exopal_retrieve_cik(char *cik);
+#include "exosite.h"
 
-uint8_t exopal_udp_sock();
-uint8_t exopal_udp_send(const uint8_t * buffer, size_t len);
-uint8_t exopal_udp_recv(uint8_t * buffer, size_t bufferSize, size_t * responseLength);
+// Clock the library's timers run on. CLOCK_MONOTONIC_COARSE is cheaper to read
+// where there is no vDSO, but only ticks every few milliseconds, which shows
+// in the latency histograms.
+#ifndef EXOPAL_CLOCK
+#define EXOPAL_CLOCK                            CLOCK_MONOTONIC
+#endif
+
+// Log records the PAL can hold until they're read, a power of two.
+#ifndef EXOPAL_LOG_LEN
+#define EXOPAL_LOG_LEN                          64
+#endif
+
+// Addresses of the platform kept, any more getaddrinfo returns are ignored.
+#ifndef EXOPAL_MAX_ADDRS
+#define EXOPAL_MAX_ADDRS                        4
+#endif
+
+// getaddrinfo doesn't pass on the DNS TTL, so answers are kept this long,
+// seconds, before they are resolved again in the background.
+#ifndef EXOPAL_DNS_TTL_S
+#define EXOPAL_DNS_TTL_S                        3600
+#endif
+
+// Least time between two resolutions of the platform's name, microseconds.
+#ifndef EXOPAL_DNS_RETRY_US
+#define EXOPAL_DNS_RETRY_US                     10000000
+#endif
+
+// Datagrams sent without anything received in between after which the name
+// is resolved again, in case the platform moved.
+#ifndef EXOPAL_DNS_UNANSWERED
+#define EXOPAL_DNS_UNANSWERED                   8
+#endif
+
+// With several addresses the platform is pinged on each, RFC 8305 style, and
+// the first to answer is used. A ping goes to the next address after this
+// long without an answer, microseconds.
+#ifndef EXOPAL_PROBE_DELAY_US
+#define EXOPAL_PROBE_DELAY_US                   250000
+#endif
+
+// Longest to wait for any answer before settling for the first address that
+// took a socket, microseconds.
+#ifndef EXOPAL_PROBE_TIMEOUT_US
+#define EXOPAL_PROBE_TIMEOUT_US                 2000000
+#endif
+
+// How often the addresses race again, in case a faster path came up,
+// microseconds.
+#ifndef EXOPAL_PROBE_INTERVAL_US
+#define EXOPAL_PROBE_INTERVAL_US                600000000
+#endif
+
+// Identical records closer together than this are folded into one.
+#define EXOPAL_LOG_INTERVAL_US                  1000000
+
+typedef enum exopal_log_level
+{
+	EXOPAL_LOG_ERROR,
+	EXOPAL_LOG_WARNING,
+	EXOPAL_LOG_INFO,
+	EXOPAL_LOG_DEBUG,
+} exopal_log_level;
+
+typedef enum exopal_log_code
+{
+	EXOPAL_LOG_RESOLVE,         // getaddrinfo failed, err is its return value
+	EXOPAL_LOG_SOCKET,          // socket() failed
+	EXOPAL_LOG_NO_SOCKET,       // no address could be used
+	EXOPAL_LOG_CONNECT,         // connect() failed
+	EXOPAL_LOG_SEND,            // send() failed
+	EXOPAL_LOG_RECV,            // recv() failed
+	EXOPAL_LOG_RESOLVED,        // the platform's name was resolved, err is
+	                            // the number of addresses
+	EXOPAL_LOG_SELECTED,        // an address won the race, err is its round
+	                            // trip in microseconds, -1 if none answered
+	EXOPAL_LOG_CODES,
+} exopal_log_code;
+
+/*!
+ * One log record. `err` is the errno of the failed call unless noted, `id`
+ * is the CoAP message ID of the datagram involved, if any. When `repeats` is
+ * non-zero that many more identical records were dropped by the rate limit
+ * since the last one was logged.
+ */
+typedef struct exopal_log_record
+{
+	uint64_t time;
+	uint32_t repeats;
+	int32_t err;
+	uint16_t id;
+	uint8_t level;
+	uint8_t code;
+} exopal_log_record;
+
+// rate limit state of one exopal_log_code
+typedef struct exopal_log_limit
+{
+	uint64_t time;              // when the last record was logged
+	int32_t err;
+	uint32_t suppressed;
+	uint8_t level;
+} exopal_log_limit;
+
+/*!
+ * Single producer, single consumer ring of log records. The PAL writes to it
+ * from the thread running `exo_operate()`, any one other thread (or the same
+ * one) reads it with `exopal_posix_log_read()`, neither ever blocks. Records
+ * arriving while it is full are counted in `dropped`.
+ */
+typedef struct exopal_log
+{
+	exopal_log_record ring[EXOPAL_LOG_LEN];
+	uint32_t head;
+	uint32_t tail;
+	uint32_t dropped;
+	uint8_t level;              // records less severe than this are discarded,
+	                            // zero keeps only errors
+	exopal_log_limit limit[EXOPAL_LOG_CODES];   // only touched by the producer
+} exopal_log;
+
+typedef struct exopal_addr
+{
+	struct sockaddr_storage addr;
+	socklen_t len;
+} exopal_addr;
+
+/*!
+ * Resolution of the platform's name running on its own thread, so a slow or
+ * unreachable DNS server never holds up `exo_init()` or `exo_operate()`.
+ */
+typedef struct exopal_resolver
+{
+	pthread_t thread;
+	uint8_t running;            // only touched by the thread running exo_operate()
+	uint8_t done;               // set by the resolver thread when it's finished
+	int err;                    // what getaddrinfo returned
+	size_t count;
+	exopal_addr addr[EXOPAL_MAX_ADDRS];
+} exopal_resolver;
+
+/*!
+ * Race of CoAP pings to the platform's addresses. Addresses take turns by
+ * family, IPv6 and IPv4 alternating from whichever getaddrinfo put first,
+ * and the first to answer carries the traffic from then on.
+ */
+typedef struct exopal_race
+{
+	uint64_t start;             // PAL time it started, 0 when none is running
+	uint64_t next;              // PAL time the next address is pinged
+	uint64_t sent[EXOPAL_MAX_ADDRS];    // PAL time each was pinged
+	int sock[EXOPAL_MAX_ADDRS];         // -1 if not pinged or out of the race
+	uint8_t order[EXOPAL_MAX_ADDRS];    // index into exopal_posix.addr
+	uint8_t count;
+	uint8_t launched;           // pinged so far
+	uint16_t mid;               // of the first ping, the others count up
+} exopal_race;
+
+/*!
+ * POSIX PAL instance data, pass a pointer to one of these to `exo_init()`
+ * along with `exopal_posix_ops`. Any NULL member is replaced by its default
+ * (coap.exosite.com, 5683, ./cik, ./exostate and ./exodns respectively) in
+ * `init`, so a zeroed struct talks to the production platform. Until the
+ * platform's address is known, from the DNS cache or a resolution running in
+ * the background, nothing can be sent and the library keeps requests queued.
+ * Keep it alive until `exopal_posix_close()`.
+ */
+typedef struct exopal_posix
+{
+	const char *host;
+	const char *port;
+	const char *cik_path;
+	const char *state_path;     // see exopal_posix_save_state()
+	const char *dns_cache_path; // resolved addresses, "" to not keep them
+	uint8_t watch_addresses;    // start over on a new socket as soon as the
+	                            // host's addresses change (Linux only)
+	int sock;
+	int netlink;                // -1 unless watching addresses
+	uint64_t now;               // PAL time the library last read
+	exopal_addr addr[EXOPAL_MAX_ADDRS];
+	size_t addr_count;
+	size_t addr_current;        // the one sock is connected to
+	int addr_next;              // won a race while sock was in use, udp_sock
+	                            // moves to it, -1 if none
+	uint64_t addr_expires;      // PAL time to resolve the name again
+	uint64_t resolve_after;     // PAL time a resolution may start
+	uint32_t unanswered;        // datagrams sent since one was received
+	uint8_t moved;              // the next send or receive returns 3, so the
+	                            // library reopens and re-registers
+	exopal_resolver resolver;
+	uint64_t race_after;        // PAL time the addresses race again
+	exopal_race race;
+	exopal_log log;
+} exopal_posix;
+
+extern const exo_pal_ops exopal_posix_ops;
+
+uint8_t exopal_posix_log_read(exopal_posix *posix, exopal_log_record *rec);
+int exopal_posix_log_format(const exopal_log_record *rec, char *buf, size_t size);
+
+void exopal_posix_close(exopal_posix *posix);
 
-uint64_t exopal_get_time();
-void exopal_set_time(uint64_t timestamp_us);
+uint8_t exopal_posix_save_state(exopal_posix *posix, const uint8_t *buf, size_t len);
+uint8_t exopal_posix_load_state(exopal_posix *posix, uint8_t *buf, size_t size, size_t *len);
 
 #endif
 
@@ -52,7 +52,7 @@ int errno;
  *
  * \return 0 if successful, else error code
  */
-uint8_t exopal_udp_sock()
+static uint8_t exopal_udp_sock(void *pal)
 {
 	// unimplemented, return error
 	return 1;
@@ -65,10 +65,10 @@ uint8_t exopal_udp_sock()
  * Any HW or SW initialization should be performed in here
  *
  * This function is meant to perform any one time initialization and/or setup.
- * This will be called every time Exosite_init is called.
+ * This will be called every time exo_init is called.
  *
  */
-uint8_t exopal_init()
+static uint8_t exopal_init(void *pal)
 {
 	return 0;
 }
@@ -83,9 +83,11 @@ uint8_t exopal_init()
  *
  * \sa exopal_socketRead
  *
- * \return 0 if successful, else error code
+ * \return 0 if successful, 2 if it can't send yet (e.g. no network), 3 if the
+ *         socket is gone and udp_sock should make a new one, else error code.
+ *         After a few errors in a row the library calls udp_sock again.
  */
-uint8_t exopal_udp_send(const uint8_t *buf, size_t len)
+static uint8_t exopal_udp_send(void *pal, const uint8_t *buf, size_t len)
 {
 	// unimplemented, return error
 	return 1;
@@ -104,9 +106,10 @@ uint8_t exopal_udp_send(const uint8_t *buf, size_t len)
  * \note This function should not block, it should return immediately if there
  *       are no waiting UDP packets.
  *
- * \return 0 if successful, else error code
+ * \return 0 if successful, 2 if nothing is waiting, 3 if the socket is gone
+ *         and udp_sock should make a new one, else error code
  */
-uint8_t exopal_udp_recv(uint8_t *buf, size_t size, size_t *rlen)
+static uint8_t exopal_udp_recv(void *pal, uint8_t *buf, size_t size, size_t *rlen)
 {
 	// unimplemented, return error
 	return 1;
@@ -119,7 +122,7 @@ uint8_t exopal_udp_recv(uint8_t *buf, size_t size, size_t *rlen)
  *
  * \return 0 if successful, else error code
  */
-uint8_t exopal_store_cik(const char *cik)
+static uint8_t exopal_store_cik(void *pal, const char *cik)
 {
 	// unimplemented, return error
 	return 1;
@@ -132,7 +135,7 @@ uint8_t exopal_store_cik(const char *cik)
  *
  * \return 0 if successful , 1 if no CIK has been saved, >1 if fatal error
  */
-uint8_t exopal_retrieve_cik(char *cik)
+static uint8_t exopal_retrieve_cik(void *pal, char *cik)
 {
 	// unimplemented, return error
 	return 1;
@@ -145,20 +148,32 @@ uint8_t exopal_retrieve_cik(char *cik)
  *
  * \note This should just be a timer from 0 at boot.
  */
-uint64_t exopal_get_time()
+static uint64_t exopal_get_time(void *pal)
 {
 	// unimplemented, return error
 	return 1;
 }
 
 /*!
- * \brief Sets the current UTC time in microseconds.
- * 
- * \note Currently Unused.
+ * \brief Returns a descriptor that polls readable when a datagram is waiting.
  *
- * \param[in] Current time in microseconds.
+ * \return descriptor, -1 if there is no such thing on this platform
+ *
+ * \note Only used by `exo_start_background()`, leaving it out of the ops
+ *       table is fine too.
  */
-void exopal_set_time(uint64_t timestamp_us)
+static int exopal_udp_fd(void *pal)
 {
-	return;
+	return -1;
 }
+
+const exo_pal_ops exopal_template_ops = {
+	exopal_init,
+	exopal_store_cik,
+	exopal_retrieve_cik,
+	exopal_udp_sock,
+	exopal_udp_send,
+	exopal_udp_recv,
+	exopal_get_time,
+	exopal_udp_fd,
+};
@@ -33,24 +33,27 @@
 *
 *****************************************************************************/
 
-#ifndef EXOSITE_PAL_H
-#define EXOSITE_PAL_H
+#ifndef EXOSITE_PAL_TEMPLATE_H
+#define EXOSITE_PAL_TEMPLATE_H
 
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-uint8_t exopal_init();
-uint8_t exopal_store_cik(const char *cik);
-uint8_t exopal_retrieve_cik(char *cik);
+#include "exosite.h"
 
-uint8_t exopal_udp_sock();
-uint8_t exopal_udp_send(const uint8_t * buffer, size_t len);
-uint8_t exopal_udp_recv(uint8_t * buffer, size_t bufferSize, size_t * responseLength);
+/*!
+ * Instance data for this PAL, a pointer to one of these is passed to
+ * `exo_init()` along with `exopal_template_ops` and handed back to every PAL
+ * call. Put your socket handle, modem state, etc. in here.
+ */
+typedef struct exopal_template
+{
+	int unused;
+} exopal_template;
 
-uint64_t exopal_get_time();
-void exopal_set_time(uint64_t timestamp_us);
+extern const exo_pal_ops exopal_template_ops;
 
 #endif
 
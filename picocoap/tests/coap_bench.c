@@ -0,0 +1,295 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../src/coap.h"
+
+///
+/// Codec microbenchmarks
+///
+/// Times the hot codec paths over a corpus of messages like the ones the
+/// Exosite library sends and receives. Prints ns/op and bytes/op, optionally
+/// writes them to a baseline file (-o) and compares against an earlier one
+/// (-c), failing if anything got slower than the tolerance (-t, percent).
+///
+
+#define MIN_RUN_NS   200000000ULL
+#define MAX_RESULTS  64
+
+static const char CIK[] = "a32c85ba9dda45823be416246cf8b433baa068d7";
+
+typedef struct bench_msg {
+	const char *name;
+	uint8_t buf[256];
+	size_t len;
+} bench_msg;
+
+typedef struct bench_result {
+	char name[64];
+	double ns_op;
+	double bytes_op;
+} bench_result;
+
+static bench_result results[MAX_RESULTS];
+static int result_count;
+static volatile uint64_t sink;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//
+// Corpus
+//
+
+static void build_header(coap_pdu *pdu, coap_code code)
+{
+	coap_init_pdu(pdu);
+	coap_set_version(pdu, COAP_V1);
+	coap_set_type(pdu, CT_CON);
+	coap_set_code(pdu, code);
+	coap_set_mid(pdu, 0x1234);
+	coap_set_token(pdu, 0xBEEF, 2);
+}
+
+static void add_request_options(coap_pdu *pdu, uint8_t observe)
+{
+	uint8_t obs = 0;
+
+	if (observe)
+		coap_add_option(pdu, CON_OBSERVE, &obs, 1);
+	coap_add_option(pdu, CON_URI_PATH, (uint8_t *)"1a", 2);
+	coap_add_option(pdu, CON_URI_PATH, (uint8_t *)"temperature", 11);
+	coap_add_option(pdu, CON_URI_QUERY, (uint8_t *)CIK, 40);
+}
+
+static void build_request(coap_pdu *pdu, coap_code code, uint8_t observe, const char *payload)
+{
+	build_header(pdu, code);
+	add_request_options(pdu, observe);
+	if (payload != NULL)
+		coap_set_payload(pdu, (uint8_t *)payload, strlen(payload));
+}
+
+static void build_response(coap_pdu *pdu, coap_type type, coap_code code, uint8_t observe, const char *payload)
+{
+	uint8_t seq[3] = {0x01, 0x02, 0x03};
+	uint8_t max_age = 60;
+
+	coap_init_pdu(pdu);
+	coap_set_version(pdu, COAP_V1);
+	coap_set_type(pdu, type);
+	coap_set_code(pdu, code);
+	coap_set_mid(pdu, 0x4321);
+	coap_set_token(pdu, 0xBEEF, 2);
+	if (observe)
+		coap_add_option(pdu, CON_OBSERVE, seq, 3);
+	if (code == CC_CONTENT)
+		coap_add_option(pdu, CON_MAX_AGE, &max_age, 1);
+	if (payload != NULL)
+		coap_set_payload(pdu, (uint8_t *)payload, strlen(payload));
+}
+
+static int build_corpus(bench_msg *corpus)
+{
+	coap_pdu pdu;
+	int n = 0;
+
+	#define CORPUS_ADD(label, build) do { \
+		corpus[n].name = label; \
+		pdu.buf = corpus[n].buf; pdu.len = 0; pdu.max = sizeof(corpus[n].buf); \
+		build; \
+		corpus[n].len = pdu.len; \
+		n++; \
+	} while (0)
+
+	CORPUS_ADD("read", build_request(&pdu, CC_GET, 0, NULL));
+	CORPUS_ADD("write", build_request(&pdu, CC_POST, 0, "23.5"));
+	CORPUS_ADD("observe", build_request(&pdu, CC_GET, 1, NULL));
+	CORPUS_ADD("content", build_response(&pdu, CT_ACK, CC_CONTENT, 0, "23.5"));
+	CORPUS_ADD("notify", build_response(&pdu, CT_CON, CC_CONTENT, 1, "{\"setpoint\":21.0}"));
+	CORPUS_ADD("unauthorized", build_response(&pdu, CT_ACK, CC_UNAUTHORIZED, 0, NULL));
+
+	#undef CORPUS_ADD
+
+	return n;
+}
+
+//
+// Harness
+//
+
+static void record(const char *op, const char *msg, uint64_t iters, uint64_t ns, size_t bytes)
+{
+	bench_result *r;
+
+	if (result_count == MAX_RESULTS)
+		return;
+
+	r = &results[result_count++];
+	snprintf(r->name, sizeof(r->name), "%s/%s", op, msg);
+	r->ns_op = (double)ns / iters;
+	r->bytes_op = bytes;
+
+	printf("%-32s %10.1f ns/op %6zu bytes/op\n", r->name, r->ns_op, bytes);
+}
+
+// Runs `body` in batches until at least MIN_RUN_NS have passed.
+#define BENCH(op, msg, bytes, body) do { \
+	uint64_t iters = 0, batch = 1024, start = now_ns(), elapsed; \
+	do { \
+		for (uint64_t k = 0; k < batch; k++) { body; } \
+		iters += batch; \
+		elapsed = now_ns() - start; \
+	} while (elapsed < MIN_RUN_NS); \
+	record(op, msg, iters, elapsed, bytes); \
+} while (0)
+
+static void bench_decode(bench_msg *m)
+{
+	uint8_t buf[256];
+	coap_pdu pdu = {buf, m->len, sizeof(buf)};
+
+	memcpy(buf, m->buf, m->len);
+
+	BENCH("validate", m->name, m->len, {
+		pdu.len = m->len;
+		sink += coap_validate_pkt(&pdu);
+	});
+
+	BENCH("get_option_by_num", m->name, m->len, {
+		coap_option o = coap_get_option_by_num(&pdu, CON_URI_QUERY, 0);
+		sink += o.len;
+		o = coap_get_option_by_num(&pdu, CON_MAX_AGE, 0);
+		sink += o.len;
+	});
+
+	BENCH("get_payload", m->name, m->len, {
+		coap_payload p = coap_get_payload(&pdu);
+		sink += p.len;
+	});
+}
+
+static void bench_encode(const char *name, coap_code code, uint8_t observe, const char *payload, size_t len)
+{
+	uint8_t buf[256];
+	coap_pdu pdu = {buf, 0, sizeof(buf)};
+	size_t prefix;
+
+	// only the calls named are timed, cutting len back drops what they added
+	build_header(&pdu, code);
+	prefix = pdu.len;
+
+	BENCH("add_option", name, len, {
+		pdu.len = prefix;
+		add_request_options(&pdu, observe);
+		sink += pdu.len;
+	});
+
+	if (payload != NULL) {
+		prefix = pdu.len;
+
+		BENCH("set_payload", name, len, {
+			pdu.len = prefix;
+			coap_set_payload(&pdu, (uint8_t *)payload, strlen(payload));
+			sink += pdu.len;
+		});
+	}
+}
+
+//
+// Baselines
+//
+
+static int write_baseline(const char *path)
+{
+	FILE *f = fopen(path, "w");
+
+	if (f == NULL) {
+		perror(path);
+		return 1;
+	}
+
+	fprintf(f, "# name ns_per_op bytes_per_op\n");
+	for (int i = 0; i < result_count; i++)
+		fprintf(f, "%s %.1f %.0f\n", results[i].name, results[i].ns_op, results[i].bytes_op);
+
+	fclose(f);
+	return 0;
+}
+
+static int compare_baseline(const char *path, double tolerance)
+{
+	FILE *f = fopen(path, "r");
+	char line[256], name[64];
+	double ns, bytes;
+	int regressions = 0;
+
+	if (f == NULL) {
+		perror(path);
+		return 1;
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (line[0] == '#' || sscanf(line, "%63s %lf %lf", name, &ns, &bytes) != 3)
+			continue;
+
+		for (int i = 0; i < result_count; i++) {
+			if (strcmp(results[i].name, name) != 0)
+				continue;
+
+			if (results[i].ns_op > ns * (1.0 + tolerance / 100.0)) {
+				printf("[REGRESSION] %s: %.1f -> %.1f ns/op\n", name, ns, results[i].ns_op);
+				regressions++;
+			}
+		}
+	}
+
+	fclose(f);
+
+	if (regressions == 0)
+		printf("No regressions against %s (tolerance %.0f%%)\n", path, tolerance);
+
+	return regressions != 0;
+}
+
+int main(int argc, char **argv)
+{
+	bench_msg corpus[8];
+	const char *out = NULL, *baseline = NULL;
+	double tolerance = 20.0;
+	int n, opt;
+
+	while ((opt = getopt(argc, argv, "o:c:t:")) != -1) {
+		switch (opt) {
+			case 'o': out = optarg; break;
+			case 'c': baseline = optarg; break;
+			case 't': tolerance = atof(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-o out] [-c baseline] [-t percent]\n", argv[0]);
+				return 2;
+		}
+	}
+
+	n = build_corpus(corpus);
+
+	for (int i = 0; i < n; i++)
+		bench_decode(&corpus[i]);
+
+	bench_encode("read", CC_GET, 0, NULL, corpus[0].len);
+	bench_encode("write", CC_POST, 0, "23.5", corpus[1].len);
+	bench_encode("observe", CC_GET, 1, NULL, corpus[2].len);
+
+	if (out != NULL && write_baseline(out) != 0)
+		return 2;
+
+	if (baseline != NULL)
+		return compare_baseline(baseline, tolerance);
+
+	return 0;
+}
@@ -32,8 +32,8 @@
 *  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 *
 *****************************************************************************/
-#include "exosite_pal.h"
 #include "exosite.h"
+#include "exosite_trace.h"
 #include "coap.h"
 
 #include <stdlib.h>
@@ -41,67 +41,253 @@
 #include <time.h>
 #include <string.h>
 #include <ctype.h>
+#ifdef EXO_ENABLE_PROFILE
+#include <stdio.h>
+#endif
 
 // Internal Functions
 
-static void exo_process_waiting_datagrams(exo_op *op, uint8_t count);
-static void exo_process_active_ops(exo_op *op, uint8_t count);
-exo_error exo_build_msg_activate(coap_pdu *pdu, const char *vendor, const char *model, const char *serial_number);
-exo_error exo_build_msg_read(coap_pdu *pdu, const char *alias);
-exo_error exo_build_msg_observe(coap_pdu *pdu, const char *alias);
-exo_error exo_build_msg_write(coap_pdu *pdu, const char *alias, const char *value);
+// the ops one exo_operate() call works on: activation, then either an
+// array or the live ops of a pool
+typedef struct exo_op_set
+{
+  exo_op *activation;
+  exo_op *array;
+  size_t count;
+  exo_pool *pool;
+} exo_op_set;
+
+// what precedes each value in the arena
+typedef struct exo_arena_value
+{
+  exo_op *owner;                          // only valid while compacting
+  uint32_t gen;
+  uint32_t size;                          // including this header
+} exo_arena_value;
+
+#define EXO_ARENA_ROUND(n) (((n) + 7) & ~(size_t)7)
+
+static exo_state exo_operate_set(exo_context *ctx, const exo_op_set *set);
+static void exo_process_waiting_datagrams(exo_context *ctx, const exo_op_set *set);
+static exo_state exo_process_active_ops(exo_context *ctx, const exo_op_set *set);
+static uint8_t exo_send(exo_context *ctx, coap_pdu *pdu);
+static uint8_t exo_recv(exo_context *ctx, coap_pdu *pdu);
+static void exo_pal_error(exo_context *ctx, uint8_t ret);
+static void exo_reopen(exo_context *ctx, const exo_op_set *set);
+static void exo_record_ack(exo_context *ctx, exo_op *op);
+static void exo_record_pdu(exo_context *ctx, coap_pdu *pdu, exo_record_dir dir);
+static void exo_snapshot_publish(exo_snapshot *snapshot, const uint8_t *val, size_t len, uint32_t obs_seq);
+static uint8_t exo_store_value(exo_context *ctx, const exo_op_set *set, exo_op *op,
+                               const uint8_t *val, size_t len);
+static uint8_t exo_bind_submissions(exo_context *ctx, const exo_op_set *set);
+static void exo_complete_submissions(exo_context *ctx, const exo_op_set *set);
+static void exo_pool_link(exo_pool *pool, exo_op *op);
+static uint32_t exo_rand(exo_context *ctx);
+exo_error exo_build_msg_activate(exo_context *ctx, coap_pdu *pdu, const char *vendor, const char *model, const char *serial_number);
+exo_error exo_build_msg_read(exo_context *ctx, coap_pdu *pdu, const char *alias);
+exo_error exo_build_msg_observe(exo_context *ctx, coap_pdu *pdu, const char *alias);
+exo_error exo_build_msg_write(exo_context *ctx, coap_pdu *pdu, const char *alias, const char *value);
 exo_error exo_build_msg_rst(coap_pdu *pdu, const uint16_t mid, const uint64_t token, const uint8_t tkl);
 exo_error exo_build_msg_ack(coap_pdu *pdu, const uint16_t mid);
 uint8_t exosite_validate_cik(char *cik);
 
-// Local Variables
-static char cik[CIK_LENGTH  + 1];
-static const char *vendor;
-static const char *model;
-static const char *serial;
-static uint16_t message_id_counter;
-static exo_device_state device_state = EXO_STATE_UNINITIALIZED;
+static inline exo_op *exo_next_op(const exo_op_set *set, exo_op *o)
+{
+  if (o == set->activation) {
+    if (set->pool != NULL)
+      return set->pool->live;
+    return set->count > 0 ? set->array : NULL;
+  }
+
+  if (set->pool != NULL)
+    return o->next;
+  return ++o < set->array + set->count ? o : NULL;
+}
+
+// Statistics are written by one thread only, so a relaxed load and store is
+// enough to keep readers on other threads from seeing torn values.
+#if defined(__GNUC__)
+#define EXO_STAT_STORE(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELAXED)
+#define EXO_STAT_LOAD(ptr) __atomic_load_n(ptr, __ATOMIC_RELAXED)
+#else
+#define EXO_STAT_STORE(ptr, val) (*(ptr) = (val))
+#define EXO_STAT_LOAD(ptr) (*(ptr))
+#endif
+#define EXO_STAT_ADD(ptr, n) EXO_STAT_STORE(ptr, EXO_STAT_LOAD(ptr) + (n))
+
+// Ordering for snapshots and the submit queue. Without the GCC builtins they
+// are plain accesses: the library still builds, but then only the thread
+// running exo_operate() may submit or read a snapshot.
+#if defined(__GNUC__)
+#define EXO_LOAD_ACQUIRE(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define EXO_LOAD_RELAXED(ptr) __atomic_load_n(ptr, __ATOMIC_RELAXED)
+#define EXO_STORE_RELAXED(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELAXED)
+#define EXO_STORE_RELEASE(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+#define EXO_FENCE_ACQUIRE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define EXO_FENCE_RELEASE() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define EXO_CAS_RELAXED(ptr, expected, val) \
+  __atomic_compare_exchange_n(ptr, expected, val, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#else
+#define EXO_LOAD_ACQUIRE(ptr) (*(ptr))
+#define EXO_LOAD_RELAXED(ptr) (*(ptr))
+#define EXO_STORE_RELAXED(ptr, val) (*(ptr) = (val))
+#define EXO_STORE_RELEASE(ptr, val) (*(ptr) = (val))
+#define EXO_FENCE_ACQUIRE() ((void)0)
+#define EXO_FENCE_RELEASE() ((void)0)
+#define EXO_CAS_RELAXED(ptr, expected, val) \
+  (*(ptr) == *(expected) ? (*(ptr) = (val), 1) : (*(expected) = *(ptr), 0))
+#endif
+#define EXO_STAT_INC(ctx, name) EXO_STAT_ADD(&(ctx)->stats.name, 1)
+
+// Phase profiler, see exo_profile. EXO_PROFILE_CLOCK() can be defined to
+// read the target's cycle counter, else the TSC or virtual counter is used
+// where there is one and the PAL clock where there isn't.
+#ifdef EXO_ENABLE_PROFILE
+#ifndef EXO_PROFILE_CLOCK
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define EXO_PROFILE_CLOCK(ctx) __builtin_ia32_rdtsc()
+#elif defined(__GNUC__) && defined(__aarch64__)
+static inline uint64_t exo_profile_clock(void)
+{
+  uint64_t t;
+  __asm__ __volatile__ ("mrs %0, cntvct_el0" : "=r" (t));
+  return t;
+}
+#define EXO_PROFILE_CLOCK(ctx) exo_profile_clock()
+#else
+#define EXO_PROFILE_CLOCK(ctx) ((ctx)->pal->get_time((ctx)->pal_data))
+#endif
+#endif
+#define EXO_PROF_DECL(t) uint64_t t = 0
+#define EXO_PROF_START(ctx, t) ((t) = EXO_PROFILE_CLOCK(ctx))
+#define EXO_PROF_LAP(ctx, t, phase, type) exo_profile_lap(ctx, &(t), phase, type)
+
+static void exo_profile_lap(exo_context *ctx, uint64_t *start, exo_phase phase, exo_request_type type)
+{
+  uint64_t now = EXO_PROFILE_CLOCK(ctx);
+
+  ctx->profile.ticks[phase][type] += now - *start;
+  ctx->profile.calls[phase][type]++;
+  *start = now;
+}
+#else
+#define EXO_PROF_DECL(t)
+#define EXO_PROF_START(ctx, t) do {} while (0)
+#define EXO_PROF_LAP(ctx, t, phase, type) do {} while (0)
+#endif
+
+// every op state change goes through here so it can be traced
+#define EXO_OP_SET_STATE(op, new_state) do { \
+    EXO_TRACE4(op__state, (op), (op)->type, (op)->state, (new_state)); \
+    (op)->state = (new_state); \
+  } while (0)
 
 // Internal Constants
 static const int MINIMUM_DATAGRAM_SIZE = 576; // RFC791: all hosts must accept minimum of 576 octets
 
+// Retransmission policy, override to try others (exosim is handy for that).
+// The n-th retransmit waits n * EXO_RETRANSMIT_STEP_US plus up to
+// EXO_RETRANSMIT_JITTER_US after the previous one, 0 for no jitter.
+#ifndef EXO_ACK_TIMEOUT_US
+#define EXO_ACK_TIMEOUT_US 4000000
+#endif
+#ifndef EXO_RETRANSMIT_STEP_US
+#define EXO_RETRANSMIT_STEP_US (COAP_PROBING_RATE * 1000000)
+#endif
+#ifndef EXO_RETRANSMIT_JITTER_US
+#define EXO_RETRANSMIT_JITTER_US 1500000
+#endif
+#ifndef EXO_MAX_RETRANSMIT
+#define EXO_MAX_RETRANSMIT COAP_MAX_RETRANSMIT
+#endif
+
+// PAL errors in a row, sending or receiving, after which the PAL is asked for
+// a new socket, and the least time between two such requests.
+#ifndef EXO_PAL_ERRORS_REOPEN
+#define EXO_PAL_ERRORS_REOPEN 3
+#endif
+#ifndef EXO_REOPEN_INTERVAL_US
+#define EXO_REOPEN_INTERVAL_US 1000000
+#endif
+#define EXO_PAL_REOPEN_NOW 0xFF                 // pal_errors when the PAL asked for it
+
+// Message IDs a restored context skips past the saved counter, more than are
+// likely to be sent between two saves, so requests sent after the last save
+// aren't mistaken for duplicates by the platform.
+#ifndef EXO_STATE_MID_SKIP
+#define EXO_STATE_MID_SKIP 1024
+#endif
+
+// persisted state layout, see exo_save_state()
+static const uint8_t EXO_STATE_MAGIC[3] = {'E', 'X', 'S'};
+#define EXO_STATE_VERSION 1
+#define EXO_STATE_HEADER_LEN 7                  // magic, version, mid, count
+#define EXO_STATE_ENTRY_LEN 16                  // fixed part of each entry
+
 /*!
  * \brief  Initializes the Exosite library
  *
- * This **MUST** be called before any other exosite library calls are called.
+ * This **MUST** be called on a context before any other exosite library calls
+ * are made with it.
  *
- * \param[in] *vendor  Pointer to string containing the vendor name
- * \param[in] *model   Pointer to string containing the model name
- * \param[in] *serial  Pointer to string containing the serial number
+ * \param[out] *ctx     Context to initialize
+ * \param[in] *pal      PAL operations to use for this context
+ * \param[in] *pal_data PAL instance data, passed to every PAL call
+ * \param[in] *vendor   Pointer to string containing the vendor name
+ * \param[in] *model    Pointer to string containing the model name
+ * \param[in] *serial   Pointer to string containing the serial number
  *
  * \return EXO_ERROR, EXO_OK on success, else error code
  */
-exo_error exo_init(const char *vendor_in, const char *model_in, const char *serial_in)
+exo_error exo_init(exo_context *ctx, const exo_pal_ops *pal, void *pal_data,
+                   const char *vendor_in, const char *model_in, const char *serial_in)
 {
-  device_state = EXO_STATE_UNINITIALIZED;
-
-  if (exopal_init() != 0) {
+  ctx->device_state = EXO_STATE_UNINITIALIZED;
+  ctx->pal = pal;
+  ctx->pal_data = pal_data;
+  ctx->pal_errors = 0;
+  ctx->reopen_at = 0;
+  memset(&ctx->stats, 0, sizeof(ctx->stats));
+  memset(ctx->hist, 0, sizeof(ctx->hist));
+  exo_set_recorder(ctx, NULL, 0);
+#ifdef EXO_ENABLE_PROFILE
+  exo_reset_profile(ctx);
+#endif
+
+  if (ctx->pal->init(ctx->pal_data) != 0) {
     return EXO_FATAL_ERROR_PAL;
   }
 
-  srand(time(NULL));
-  message_id_counter = rand();
+  // only needs to differ between devices and boots, not be unpredictable
+  ctx->rng = (uint32_t)time(NULL) ^ (uint32_t)ctx->pal->get_time(ctx->pal_data)
+             ^ (uint32_t)(uintptr_t)ctx;
+  if (ctx->rng == 0)
+    ctx->rng = 1;
+  ctx->now = ctx->pal->get_time(ctx->pal_data);
+  ctx->message_id_counter = exo_rand(ctx);
 
-  serial = serial_in;
-  vendor = vendor_in;
-  model = model_in;
+  exo_set_submit_queue(ctx, NULL, 0);
+  exo_set_submit_wake(ctx, NULL, NULL);
+  exo_set_value_arena(ctx, NULL, 0);
+  exo_op_init(&ctx->activation);
 
-  if (exopal_retrieve_cik(cik) > 1){
+  ctx->serial = serial_in;
+  ctx->vendor = vendor_in;
+  ctx->model = model_in;
+
+  memset(ctx->cik, 0, sizeof(ctx->cik));
+
+  if (ctx->pal->retrieve_cik(ctx->pal_data, ctx->cik) > 1){
     return EXO_FATAL_ERROR_PAL;
   } else {
-    cik[40] = 0;
+    ctx->cik[CIK_LENGTH] = 0;
   }
 
-  if (exopal_udp_sock() != 0) {
+  if (ctx->pal->udp_sock(ctx->pal_data) != 0) {
     return EXO_FATAL_ERROR_PAL;
   }
 
-  device_state = EXO_STATE_INITIALIZED;
+  ctx->device_state = EXO_STATE_INITIALIZED;
 
   return EXO_OK;
 }
@@ -122,7 +308,7 @@ exo_error exo_init(const char *vendor_in, const char *model_in, const char *seri
 void exo_write(exo_op *op, const char * alias, const char * value)
 {
   op->type = EXO_WRITE;
-  op->state = EXO_REQUEST_NEW;
+  EXO_OP_SET_STATE(op, EXO_REQUEST_NEW);
   op->alias = alias;
   op->value = (char *)value; // this is kinda dirty, I know
   op->value_max = 0;
@@ -136,6 +322,9 @@ void exo_write(exo_op *op, const char * alias, const char * value)
  * provided callback will be called with a single parameter, a pointer to the
  * result as a C string.
  *
+ * Pass a NULL value and a value_max of 0 to have the value stored in the
+ * context's arena, see `exo_set_value_arena()`.
+ *
  * \param[in] *alias    Alias of dataport to read from, pointer must remain
  *                      valid until the request has been sent.
  * \param[in] callback  Function pointer to call on success
@@ -146,7 +335,7 @@ void exo_write(exo_op *op, const char * alias, const char * value)
 void exo_read(exo_op *op, const char * alias, char * value, const size_t value_max)
 {
   op->type = EXO_READ;
-  op->state = EXO_REQUEST_NEW;
+  EXO_OP_SET_STATE(op, EXO_REQUEST_NEW);
   op->alias = alias;
   op->value = value;
   op->value_max = value_max;
@@ -168,11 +357,12 @@ void exo_read(exo_op *op, const char * alias, char * value, const size_t value_m
 void exo_subscribe(exo_op *op, const char * alias, char * value, const size_t value_max)
 {
   op->type = EXO_SUBSCRIBE;
-  op->state = EXO_REQUEST_NEW;
+  EXO_OP_SET_STATE(op, EXO_REQUEST_NEW);
   op->alias = alias;
   op->value = value;
   op->value_max = value_max;
   op->mid = 0;
+  op->tkl = 0; // new token, re-registering keeps it
 }
 
 /*!
@@ -184,7 +374,7 @@ void exo_subscribe(exo_op *op, const char * alias, char * value, const size_t va
 void exo_activate(exo_op *op)
 {
   op->type = EXO_ACTIVATE;
-  op->state = EXO_REQUEST_NEW;
+  EXO_OP_SET_STATE(op, EXO_REQUEST_NEW);
   op->alias = NULL;
   op->value = NULL;
   op->value_max = 0;
@@ -194,22 +384,89 @@ void exo_activate(exo_op *op)
 void exo_op_init(exo_op *op)
 {
   op->type = EXO_NULL;
-  op->state = EXO_REQUEST_NULL;
+  EXO_OP_SET_STATE(op, EXO_REQUEST_NULL);
   op->alias = NULL;
   op->value = NULL;
   op->value_max = 0;
+  op->value_gen = 0;
   op->mid = 0;
   op->obs_seq = 0;
   op->tkl = 0;
   op->token = 0;
   op->timeout = 0;
+  op->sent_at = 0;
   op->retries = 0;
+  op->sub = NULL;
+  op->snapshot = NULL;
+}
+
+/*!
+ * \brief Publishes a subscription's values for other threads
+ *
+ * Every value the subscribe op receives from now on is also copied into the
+ * snapshot, see `exo_snapshot_read()`. Such a subscription doesn't wait for
+ * `exo_op_done()` either, it goes straight back to listening, so whoever
+ * runs `exo_operate()` needn't look at it at all. Call it after
+ * `exo_op_init()`, the snapshot is cleared.
+ *
+ * \param[in] op        Subscribe op
+ * \param[in] snapshot  Where to publish, NULL to stop
+ */
+void exo_op_set_snapshot(exo_op *op, exo_snapshot *snapshot)
+{
+  if (snapshot != NULL)
+    memset(snapshot, 0, sizeof(*snapshot));
+  op->snapshot = snapshot;
+}
+
+/*!
+ * \brief Reads the latest value of a subscription, from any thread
+ *
+ * Never blocks and never waits for the thread running `exo_operate()`.
+ *
+ * \param[in]  snapshot  Snapshot set with `exo_op_set_snapshot()`
+ * \param[out] value     The value, NUL terminated, cut short to fit
+ * \param[in]  size      Size of value, nothing is written if it is 0
+ * \param[out] obs_seq   Observe sequence number of the value, may be NULL
+ *
+ * \return Values published so far, 0 if none yet. Compare it to the last
+ *         call's to see whether anything changed.
+ */
+uint32_t exo_snapshot_read(const exo_snapshot *snapshot, char *value, size_t size, uint32_t *obs_seq)
+{
+  uint32_t version, seq, obs;
+  size_t len;
+
+  do {
+    version = EXO_LOAD_ACQUIRE(&snapshot->version);
+    if (version == 0)
+      return 0;
+
+    seq = EXO_LOAD_ACQUIRE(&snapshot->buf[version & 1].seq);
+    if (seq & 1)
+      continue;
+
+    len = snapshot->buf[version & 1].len;
+    if (len >= size)
+      len = size > 0 ? size - 1 : 0;
+    memcpy(value, snapshot->buf[version & 1].value, len);
+    obs = snapshot->buf[version & 1].obs_seq;
+
+    EXO_FENCE_ACQUIRE();
+  } while ((seq & 1) || EXO_LOAD_RELAXED(&snapshot->buf[version & 1].seq) != seq);
+
+  if (size > 0)
+    value[len] = 0;
+  if (obs_seq != NULL)
+    *obs_seq = obs;
+
+  return version;
 }
 
 void exo_op_done(exo_op *op)
 {
   if (exo_is_op_subscribe(op)) {
-    op->state = EXO_REQUEST_SUBSCRIBED;
+    EXO_OP_SET_STATE(op, EXO_REQUEST_SUBSCRIBED);
   } else {
     exo_op_init(op);
   }
@@ -259,59 +516,1249 @@ uint8_t exo_is_op_write(exo_op *op)
  * \return EXO_STATE, EXO_OK on success or error code
  *
  */
-exo_state exo_operate(exo_op *op, uint8_t count)
+exo_state exo_operate(exo_context *ctx, exo_op *op, size_t count)
 {
-  int i;
+  exo_op_set set = {&ctx->activation, op, count, NULL};
 
-  switch (device_state){
+  return exo_operate_set(ctx, &set);
+}
+
+/*!
+ * \brief Carves an op pool out of a caller provided arena
+ *
+ * Nothing is allocated, the ops live in arena for as long as the pool is
+ * used. `EXO_POOL_ARENA_SIZE(n)` bytes always hold n ops.
+ *
+ * \param[out] pool   Pool to set up
+ * \param[in]  arena  Memory for the ops, any alignment
+ * \param[in]  size   Size of arena in bytes
+ *
+ * \return Number of ops the pool holds
+ */
+size_t exo_pool_init(exo_pool *pool, void *arena, size_t size)
+{
+  uintptr_t addr = (uintptr_t)arena;
+  size_t pad = (sizeof(uint64_t) - addr % sizeof(uint64_t)) % sizeof(uint64_t);
+  exo_op *ops = (exo_op *)(addr + pad);
+  size_t i, n;
+
+  memset(pool, 0, sizeof(*pool));
+  if (arena == NULL || size < pad)
+    return 0;
+
+  n = (size - pad) / sizeof(exo_op);
+  for (i = n; i-- > 0;) {
+    exo_op_init(&ops[i]);
+    ops[i].prev = NULL;
+    ops[i].next = pool->free;
+    pool->free = &ops[i];
+  }
+  pool->capacity = n;
+
+  return n;
+}
+
+/*!
+ * \brief Takes an op from the pool
+ *
+ * The op is initialized, set it up with `exo_write()`, `exo_read()` or
+ * `exo_subscribe()`. It stays yours, through `exo_op_done()` and reuse,
+ * until `exo_op_release()`.
+ *
+ * \param[in] pool  Pool to take from
+ *
+ * \return The op, NULL if all are in use
+ */
+exo_op *exo_op_acquire(exo_pool *pool)
+{
+  exo_op *op = pool->free;
+
+  if (op == NULL)
+    return NULL;
+
+  pool->free = op->next;
+  exo_op_init(op);
+  exo_pool_link(pool, op);
+
+  return op;
+}
+
+/*!
+ * \brief Gives an op back to its pool
+ *
+ * Whatever the op was doing is dropped, a subscription is not cancelled on
+ * the platform, it just stops being answered.
+ *
+ * \param[in] pool  Pool the op came from
+ * \param[in] op    Op from `exo_op_acquire()`
+ */
+void exo_op_release(exo_pool *pool, exo_op *op)
+{
+  if (op->prev != NULL)
+    op->prev->next = op->next;
+  else
+    pool->live = op->next;
+  if (op->next != NULL)
+    op->next->prev = op->prev;
+  pool->live_count--;
+
+  exo_op_init(op);
+  op->prev = NULL;
+  op->next = pool->free;
+  pool->free = op;
+}
+
+/*!
+ * \brief Performs the operations of a pool
+ *
+ * Same as `exo_operate()`, but only visits the ops acquired from the pool.
+ * Submissions are bound into free ops of the pool and released when done.
+ *
+ * \param[in] ctx   Context
+ * \param[in] pool  Pool holding the ops
+ *
+ * \return as `exo_operate()`
+ */
+exo_state exo_operate_pool(exo_context *ctx, exo_pool *pool)
+{
+  exo_op_set set = {&ctx->activation, NULL, 0, pool};
+
+  return exo_operate_set(ctx, &set);
+}
+
+static exo_state exo_operate_set(exo_context *ctx, const exo_op_set *set)
+{
+  exo_state state;
+  EXO_PROF_DECL(prof);
+
+  EXO_TRACE2(operate__entry, ctx, set->pool != NULL ? set->pool->live_count : set->count);
+  EXO_PROF_START(ctx, prof);
+#ifdef EXO_ENABLE_PROFILE
+  ctx->profile.operate_calls++;
+#endif
+
+  // one clock read per pass, every deadline below is measured against it
+  ctx->now = ctx->pal->get_time(ctx->pal_data);
+
+  switch (ctx->device_state){
     case EXO_STATE_UNINITIALIZED:
+      EXO_TRACE2(operate__return, ctx, EXO_ERROR);
       return EXO_ERROR;
     case EXO_STATE_INITIALIZED:
     case EXO_STATE_BAD_CIK:
-      if (op[0].state == EXO_REQUEST_NULL || op[0].timeout < exopal_get_time())
-        exo_activate(&op[0]);
+      if (ctx->activation.state == EXO_REQUEST_NULL || ctx->activation.timeout < ctx->now)
+        exo_activate(&ctx->activation);
     case EXO_STATE_GOOD:
       break;
   }
 
-  exo_process_waiting_datagrams(op, count);
-  exo_process_active_ops(op, count);
+  if (ctx->pal_errors >= EXO_PAL_ERRORS_REOPEN && ctx->now >= ctx->reopen_at)
+    exo_reopen(ctx, set);
+
+  if (ctx->subs != NULL)
+    exo_bind_submissions(ctx, set);
+
+  EXO_PROF_LAP(ctx, prof, EXO_PHASE_ACTIVATION, EXO_NULL);
+  exo_process_waiting_datagrams(ctx, set);
+  EXO_PROF_LAP(ctx, prof, EXO_PHASE_RECV, EXO_NULL);
+  state = exo_process_active_ops(ctx, set);
+  EXO_PROF_LAP(ctx, prof, EXO_PHASE_ACTIVE, EXO_NULL);
+
+  // ops freed by finished submissions can take waiting ones right away
+  if (ctx->subs != NULL) {
+    exo_complete_submissions(ctx, set);
+    if (exo_bind_submissions(ctx, set))
+      state = EXO_BUSY;
+  }
+
+  EXO_PROF_LAP(ctx, prof, EXO_PHASE_SCAN, EXO_NULL);
+  EXO_TRACE2(operate__return, ctx, state);
+
+  return state;
+}
+
+/*!
+ * \brief Takes a snapshot of the context's statistics
+ *
+ * Safe to call from any thread while another is running `exo_operate()`.
+ * Each counter is read atomically, but the set as a whole is not.
+ *
+ * \param[in]  ctx    Context to read
+ * \param[out] stats  Copy of the counters
+ */
+void exo_get_stats(exo_context *ctx, exo_stats *stats)
+{
+  const uint32_t *src = (const uint32_t *)&ctx->stats;
+  uint32_t *dst = (uint32_t *)stats;
+  size_t i;
+
+  // exo_stats is nothing but uint32_t counters
+  for (i = 0; i < sizeof(exo_stats) / sizeof(uint32_t); i++)
+    dst[i] = EXO_STAT_LOAD(&src[i]);
+}
+
+/*!
+ * \brief Takes a snapshot of one of the context's histograms
+ *
+ * Safe to call from any thread while another is running `exo_operate()`,
+ * though a snapshot taken mid-update may be off by the sample in flight.
+ *
+ * \param[in]  ctx   Context to read
+ * \param[in]  id    Which histogram
+ * \param[out] hist  Copy of the histogram
+ */
+void exo_get_hist(exo_context *ctx, exo_hist_id id, exo_hist *hist)
+{
+  const exo_hist *src = &ctx->hist[id];
+  size_t i;
+
+  hist->count = EXO_STAT_LOAD(&src->count);
+  hist->min = EXO_STAT_LOAD(&src->min);
+  hist->max = EXO_STAT_LOAD(&src->max);
+  hist->sum = src->sum;
+
+  for (i = 0; i < EXO_HIST_BUCKETS; i++)
+    hist->buckets[i] = EXO_STAT_LOAD(&src->buckets[i]);
+}
+
+/*!
+ * \brief Clears one of the context's histograms
+ *
+ * Must not be called while another thread is in `exo_operate()` on the same
+ * context.
+ *
+ * \param[in] ctx  Context to clear
+ * \param[in] id   Which histogram
+ */
+void exo_reset_hist(exo_context *ctx, exo_hist_id id)
+{
+  memset(&ctx->hist[id], 0, sizeof(ctx->hist[id]));
+}
+
+static uint32_t exo_hist_bucket(uint32_t value)
+{
+  uint32_t msb;
+
+  if (value < 2 * EXO_HIST_SUB_COUNT)
+    return value;
+
+#if defined(__GNUC__)
+  msb = 31 - __builtin_clz(value);
+#else
+  for (msb = 31; !(value & (1UL << msb)); msb--);
+#endif
+
+  msb -= EXO_HIST_SUB_BITS;
+  return (msb + 1) * EXO_HIST_SUB_COUNT + ((value >> msb) & (EXO_HIST_SUB_COUNT - 1));
+}
+
+// largest value that lands in bucket i
+static uint32_t exo_hist_bucket_max(uint32_t i)
+{
+  uint32_t shift = i / EXO_HIST_SUB_COUNT - 1;
+  uint64_t mantissa = EXO_HIST_SUB_COUNT + i % EXO_HIST_SUB_COUNT;
+
+  if (i < 2 * EXO_HIST_SUB_COUNT)
+    return i;
+
+  return ((mantissa + 1) << shift) - 1;
+}
+
+/*!
+ * \brief Adds a value to a histogram
+ *
+ * \param[in] hist   Histogram to add to
+ * \param[in] value  Value to record
+ */
+void exo_hist_record(exo_hist *hist, uint32_t value)
+{
+  uint32_t count = EXO_STAT_LOAD(&hist->count);
+
+  if (count == 0 || value < EXO_STAT_LOAD(&hist->min))
+    EXO_STAT_STORE(&hist->min, value);
+  if (count == 0 || value > EXO_STAT_LOAD(&hist->max))
+    EXO_STAT_STORE(&hist->max, value);
+
+  hist->sum += value;
+  EXO_STAT_ADD(&hist->buckets[exo_hist_bucket(value)], 1);
+  EXO_STAT_STORE(&hist->count, count + 1);
+}
+
+/*!
+ * \brief Finds a percentile of a histogram
+ *
+ * \param[in] hist        Histogram to query
+ * \param[in] percentile  0 to 100, e.g. 99.9, anything outside is clamped
+ *
+ * \return Largest value that could have been recorded in the bucket holding
+ *         the percentile, clamped to the recorded min and max. 0 if the
+ *         histogram is empty.
+ */
+uint32_t exo_hist_percentile(const exo_hist *hist, double percentile)
+{
+  uint64_t target, seen = 0;
+  uint32_t i, value;
+
+  if (hist->count == 0)
+    return 0;
+
+  // !(>= 0) also catches NaN, which would make the rank below undefined
+  if (!(percentile >= 0))
+    percentile = 0;
+  else if (percentile > 100)
+    percentile = 100;
+
+  target = (uint64_t)(hist->count * percentile / 100 + 0.5);
+  if (target == 0)
+    target = 1;
+
+  for (i = 0; i < EXO_HIST_BUCKETS - 1; i++) {
+    seen += hist->buckets[i];
+    if (seen >= target)
+      break;
+  }
+
+  value = exo_hist_bucket_max(i);
+  if (value > hist->max)
+    value = hist->max;
+  if (value < hist->min)
+    value = hist->min;
+
+  return value;
+}
+
+/*!
+ * \brief Starts or stops the flight recorder
+ *
+ * Once set, the last `count` datagrams sent and received are kept in
+ * `records`, which must stay valid until the recorder is stopped by passing
+ * NULL. Each datagram costs a copy of up to EXO_RECORD_SNAPLEN bytes. Set it
+ * after `exo_init()`, which stops it.
+ *
+ * \param[in] ctx      Context to record
+ * \param[in] records  Storage for the recorder, NULL to stop it
+ * \param[in] count    Number of entries in `records`
+ */
+void exo_set_recorder(exo_context *ctx, exo_record *records, size_t count)
+{
+  ctx->records = count > 0 ? records : NULL;
+  ctx->record_count = count;
+  ctx->record_head = 0;
+  ctx->record_used = 0;
+}
+
+static void exo_put_u16be(uint8_t *p, uint16_t v)
+{
+  p[0] = v >> 8;
+  p[1] = v & 0xFF;
+}
+
+/*!
+ * \brief Writes the flight recorder out as a pcap capture
+ *
+ * Datagrams are written oldest first with made up IPv4 and UDP headers,
+ * the device as 10.0.0.2:56830 and the platform as 10.0.0.1:5683, so
+ * Wireshark and friends decode them as CoAP. Must not be called while
+ * another thread is in `exo_operate()` on the same context.
+ *
+ * Records carry the PAL's monotonic time, which is turned into the time of
+ * day by how far apart the two clocks are when the dump starts. A clock set
+ * since then shifts the whole capture, not the gaps between datagrams. The
+ * time is read once per `exo_operate()`, so every datagram handled in one
+ * call gets the same timestamp.
+ *
+ * \param[in] ctx    Context to dump
+ * \param[in] write  Called with each piece of the capture
+ * \param[in] arg    Passed through to `write`
+ *
+ * \return EXO_OK, EXO_GENERAL_ERROR if `write` failed
+ */
+exo_error exo_dump_pcap(exo_context *ctx, exo_pcap_write write, void *arg)
+{
+  static const uint8_t device_addr[4] = {10, 0, 0, 2};
+  static const uint8_t platform_addr[4] = {10, 0, 0, 1};
+  uint32_t file_hdr[6] = {0xa1b2c3d4, 0x00040002, 0, 0, 0, 101}; // LINKTYPE_RAW
+  uint32_t pkt_hdr[4];
+  uint8_t hdr[28];
+  uint32_t sum;
+  uint64_t epoch, when;
+  size_t i, j, caplen;
+  exo_record *rec;
+
+  // microseconds from the PAL's clock to the time of day
+  epoch = (uint64_t)time(NULL) * 1000000 - ctx->pal->get_time(ctx->pal_data);
+
+  file_hdr[4] = sizeof(hdr) + EXO_RECORD_SNAPLEN;
+
+  if (write(arg, file_hdr, sizeof(file_hdr)) != 0)
+    return EXO_GENERAL_ERROR;
+
+  for (i = 0; i < ctx->record_used; i++) {
+    rec = &ctx->records[(ctx->record_head + ctx->record_count - ctx->record_used + i) % ctx->record_count];
+    caplen = rec->len < EXO_RECORD_SNAPLEN ? rec->len : EXO_RECORD_SNAPLEN;
+
+    when = rec->time + epoch;
+    pkt_hdr[0] = when / 1000000;
+    pkt_hdr[1] = when % 1000000;
+    pkt_hdr[2] = sizeof(hdr) + caplen;
+    pkt_hdr[3] = sizeof(hdr) + rec->len;
+
+    // IPv4, no options, UDP
+    memset(hdr, 0, sizeof(hdr));
+    hdr[0] = 0x45;
+    exo_put_u16be(&hdr[2], sizeof(hdr) + rec->len);
+    hdr[8] = 64;
+    hdr[9] = 17;
+    memcpy(&hdr[12], rec->dir == EXO_RECORD_SENT ? device_addr : platform_addr, 4);
+    memcpy(&hdr[16], rec->dir == EXO_RECORD_SENT ? platform_addr : device_addr, 4);
+
+    for (sum = 0, j = 0; j < 20; j += 2)
+      sum += (hdr[j] << 8) | hdr[j + 1];
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    exo_put_u16be(&hdr[10], ~(sum + (sum >> 16)));
+
+    // UDP, checksum is optional over IPv4
+    exo_put_u16be(&hdr[20], rec->dir == EXO_RECORD_SENT ? 56830 : 5683);
+    exo_put_u16be(&hdr[22], rec->dir == EXO_RECORD_SENT ? 5683 : 56830);
+    exo_put_u16be(&hdr[24], 8 + rec->len);
+
+    if (write(arg, pkt_hdr, sizeof(pkt_hdr)) != 0 ||
+        write(arg, hdr, sizeof(hdr)) != 0 ||
+        write(arg, rec->buf, caplen) != 0)
+      return EXO_GENERAL_ERROR;
+  }
+
+  return EXO_OK;
+}
+
+/*!
+ * \brief Gives a context memory for values of unknown size
+ *
+ * Reads and subscribes queued with a NULL value and a value_max of 0 then get
+ * their values allocated from `buf` at exactly the size received, instead of
+ * failing when the value is larger than a fixed buffer. `op->value` points at
+ * the latest one. When the arena is full, values that were replaced or whose
+ * op isn't in the set passed to that `exo_operate()` call are dropped and the
+ * remaining ones move, so only rely on `op->value` between `exo_operate()`
+ * calls and copy out what you want to keep.
+ *
+ * \param[in] ctx   Context to set the arena on
+ * \param[in] buf   Storage for values, NULL to remove it
+ * \param[in] size  Size of `buf` in bytes
+ *
+ * \return EXO_OK, EXO_GENERAL_ERROR if `buf` can't hold even an empty value
+ */
+exo_error exo_set_value_arena(exo_context *ctx, void *buf, size_t size)
+{
+  uintptr_t skip = (8 - ((uintptr_t)buf & 7)) & 7;
+
+  ctx->arena.buf = NULL;
+  ctx->arena.size = 0;
+  ctx->arena.used = 0;
+  ctx->arena.gen = 0;
+
+  if (buf == NULL)
+    return EXO_OK;
+
+  if (size < skip + EXO_ARENA_ROUND(sizeof(exo_arena_value) + 1))
+    return EXO_GENERAL_ERROR;
+
+  ctx->arena.buf = (uint8_t *)buf + skip;
+  ctx->arena.size = (size - skip) & ~(size_t)7;
+  return EXO_OK;
+}
+
+static void exo_state_put(uint8_t *p, uint64_t v, size_t n)
+{
+  while (n-- > 0) {
+    p[n] = v & 0xFF;
+    v >>= 8;
+  }
+}
+
+static uint64_t exo_state_get(const uint8_t *p, size_t n)
+{
+  uint64_t v = 0;
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+// one saved subscription, points into the buffer it was parsed from
+typedef struct exo_state_entry
+{
+  const uint8_t *alias;
+  size_t alias_len;
+  uint8_t tkl;
+  uint64_t token;
+  uint32_t obs_seq;
+  const uint8_t *value;
+  size_t value_len;
+} exo_state_entry;
+
+// parses the entry at *pos, non-zero if it runs past len or makes no sense
+static uint8_t exo_state_next(const uint8_t *buf, size_t len, size_t *pos, exo_state_entry *e)
+{
+  const uint8_t *p = buf + *pos;
+
+  if (len - *pos < EXO_STATE_ENTRY_LEN)
+    return 1;
+
+  e->alias_len = p[0];
+  e->tkl = p[1];
+  e->token = exo_state_get(&p[2], 8);
+  e->obs_seq = exo_state_get(&p[10], 4);
+  e->value_len = exo_state_get(&p[14], 2);
+  e->alias = p + EXO_STATE_ENTRY_LEN;
+  e->value = e->alias + e->alias_len;
+
+  if (e->alias_len == 0 || e->tkl == 0 || e->tkl > 8 ||
+      len - *pos - EXO_STATE_ENTRY_LEN < e->alias_len + e->value_len)
+    return 1;
+
+  *pos += EXO_STATE_ENTRY_LEN + e->alias_len + e->value_len;
+  return 0;
+}
+
+// walks the set like exo_operate() does, so pooled ops are saved too
+static exo_error exo_save_state_set(exo_context *ctx, const exo_op_set *set,
+                                    uint8_t *buf, size_t size, size_t *len)
+{
+  size_t pos = EXO_STATE_HEADER_LEN, alias_len, value_len;
+  uint8_t saved = 0;
+  exo_op *o;
+
+  if (size < EXO_STATE_HEADER_LEN)
+    return EXO_OUT_OF_SPACE;
+
+  for (o = exo_next_op(set, set->activation); o != NULL; o = exo_next_op(set, o)) {
+    if (o->type != EXO_SUBSCRIBE || o->tkl == 0 || o->value == NULL || o->alias == NULL)
+      continue;
+    if (o->state != EXO_REQUEST_SUBSCRIBED && o->state != EXO_REQUEST_SUB_ACK &&
+        o->state != EXO_REQUEST_SUB_ACK_NEW && o->state != EXO_REQUEST_SUCCESS)
+      continue;
+
+    alias_len = strlen(o->alias);
+    value_len = strlen(o->value);
+    // see exo_save_state() for what is left out
+    if (alias_len == 0 || alias_len > 0xFF || value_len > 0xFFFF || saved == 0xFF)
+      continue;
+    if (size - pos < EXO_STATE_ENTRY_LEN + alias_len + value_len)
+      return EXO_OUT_OF_SPACE;
+
+    buf[pos] = alias_len;
+    buf[pos + 1] = o->tkl;
+    exo_state_put(&buf[pos + 2], o->token, 8);
+    exo_state_put(&buf[pos + 10], o->obs_seq, 4);
+    exo_state_put(&buf[pos + 14], value_len, 2);
+    pos += EXO_STATE_ENTRY_LEN;
+    memcpy(&buf[pos], o->alias, alias_len);
+    pos += alias_len;
+    memcpy(&buf[pos], o->value, value_len);
+    pos += value_len;
+    saved++;
+  }
+
+  memcpy(buf, EXO_STATE_MAGIC, sizeof(EXO_STATE_MAGIC));
+  buf[3] = EXO_STATE_VERSION;
+  exo_state_put(&buf[4], ctx->message_id_counter, 2);
+  buf[6] = saved;
+
+  *len = pos;
+  return EXO_OK;
+}
+
+/*!
+ * \brief Saves what a warm restart needs to pick up where this left off
+ *
+ * Writes the message ID counter and, for every subscription in `ops` that
+ * has a value, its alias, token, observe sequence number and that value into
+ * `buf`. Nothing is sent or received, it only copies, so call it whenever
+ * convenient, from the thread running `exo_operate()`, and write the result
+ * out from there or hand it to another thread. Store it atomically, with the
+ * POSIX PAL `exopal_posix_save_state()` does that. Values are written as
+ * they are, so a subscription whose value is longer than 65535 bytes or
+ * whose alias is longer than 255 is left out. The count is a single byte,
+ * past 255 subscriptions the rest are left out too and come back through a
+ * fresh registration after a restore. For ops from an `exo_pool` use
+ * `exo_save_state_pool()`.
+ *
+ * \param[in]  ctx    Context to save
+ * \param[in]  ops    Ops as passed to `exo_operate()`
+ * \param[in]  count  Number of ops
+ * \param[out] buf    Where to write the state
+ * \param[in]  size   Size of buf
+ * \param[out] len    Bytes written
+ *
+ * \return EXO_OK, EXO_OUT_OF_SPACE if it doesn't fit in buf
+ */
+exo_error exo_save_state(exo_context *ctx, exo_op *ops, size_t count,
+                         uint8_t *buf, size_t size, size_t *len)
+{
+  exo_op_set set = {&ctx->activation, ops, count, NULL};
+
+  return exo_save_state_set(ctx, &set, buf, size, len);
+}
+
+/*!
+ * \brief Saves the acquired ops of a pool, see `exo_save_state()`
+ */
+exo_error exo_save_state_pool(exo_context *ctx, exo_pool *pool,
+                              uint8_t *buf, size_t size, size_t *len)
+{
+  exo_op_set set = {&ctx->activation, NULL, 0, pool};
+
+  return exo_save_state_set(ctx, &set, buf, size, len);
+}
+
+static exo_error exo_restore_state_set(exo_context *ctx, const exo_op_set *set,
+                                       const uint8_t *buf, size_t len)
+{
+  exo_state_entry e;
+  size_t pos;
+  uint8_t n, saved;
+  exo_op *o;
+
+  if (len < EXO_STATE_HEADER_LEN || memcmp(buf, EXO_STATE_MAGIC, sizeof(EXO_STATE_MAGIC)) != 0 ||
+      buf[3] != EXO_STATE_VERSION)
+    return EXO_GENERAL_ERROR;
+
+  // check all of it before changing anything
+  saved = buf[6];
+  for (n = 0, pos = EXO_STATE_HEADER_LEN; n < saved; n++) {
+    if (exo_state_next(buf, len, &pos, &e) != 0)
+      return EXO_GENERAL_ERROR;
+  }
+  if (pos != len)
+    return EXO_GENERAL_ERROR;
+
+  ctx->message_id_counter = exo_state_get(&buf[4], 2) + EXO_STATE_MID_SKIP;
+
+  for (n = 0, pos = EXO_STATE_HEADER_LEN; n < saved; n++) {
+    exo_state_next(buf, len, &pos, &e);
 
-  for (i = 0; i < count; i++) {
-    if (op[i].state == EXO_REQUEST_NEW)
-      return EXO_BUSY;
+    for (o = exo_next_op(set, set->activation); o != NULL; o = exo_next_op(set, o)) {
+      if (o->type == EXO_SUBSCRIBE && o->state == EXO_REQUEST_NEW && o->tkl == 0 &&
+          o->alias != NULL && strlen(o->alias) == e.alias_len &&
+          memcmp(o->alias, e.alias, e.alias_len) == 0)
+        break;
+    }
+    if (o == NULL || exo_store_value(ctx, set, o, e.value, e.value_len) != 0)
+      continue;
+
+    o->token = e.token;
+    o->tkl = e.tkl;
+    o->obs_seq = e.obs_seq;
+    if (o->snapshot != NULL)
+      exo_snapshot_publish(o->snapshot, e.value, e.value_len, o->obs_seq);
+
+    // Max-Age already ran out as far as we know, re-register once it listens
+    o->timeout = ctx->now;
+    EXO_OP_SET_STATE(o, o->snapshot != NULL ? EXO_REQUEST_SUBSCRIBED
+                                                    : EXO_REQUEST_SUCCESS);
   }
 
-  for (i = 0; i < count; i++) {
-    if (op[i].state == EXO_REQUEST_PENDING)
-      return EXO_WAITING;
+  return EXO_OK;
+}
+
+/*!
+ * \brief Restores state saved by `exo_save_state()` after a restart
+ *
+ * Call it after `exo_init()` and after queuing the subscriptions again with
+ * `exo_subscribe()`. Message IDs continue from where the saved ones left
+ * off. Each queued subscription whose alias was saved gets its saved value
+ * back right away, so it is finished (or, with a snapshot, published and
+ * listening) before anything was sent. It keeps its token, so notifications
+ * the platform sends for the old observation are accepted, and re-registers
+ * with that token in a single round trip as soon as it goes back to
+ * listening. Saved subscriptions that weren't queued are ignored. For ops
+ * from an `exo_pool` use `exo_restore_state_pool()`.
+ *
+ * \param[in] ctx    Context to restore, just initialized
+ * \param[in] ops    Ops as passed to `exo_operate()`
+ * \param[in] count  Number of ops
+ * \param[in] buf    Saved state
+ * \param[in] len    Length of buf
+ *
+ * \return EXO_OK, EXO_GENERAL_ERROR if buf isn't valid saved state, then
+ *         nothing was restored
+ */
+exo_error exo_restore_state(exo_context *ctx, exo_op *ops, size_t count,
+                            const uint8_t *buf, size_t len)
+{
+  exo_op_set set = {&ctx->activation, ops, count, NULL};
+
+  return exo_restore_state_set(ctx, &set, buf, len);
+}
+
+/*!
+ * \brief Restores state into the acquired ops of a pool, see
+ *        `exo_restore_state()`
+ */
+exo_error exo_restore_state_pool(exo_context *ctx, exo_pool *pool,
+                                 const uint8_t *buf, size_t len)
+{
+  exo_op_set set = {&ctx->activation, NULL, 0, pool};
+
+  return exo_restore_state_set(ctx, &set, buf, len);
+}
+
+/*!
+ * \brief Gives a context a queue for requests from other threads
+ *
+ * Once set, any thread may call `exo_submit_write()` and `exo_submit_read()`
+ * without locking while one thread runs `exo_operate()`. That thread moves
+ * submissions into the free ops (type EXO_NULL) of the array it passes,
+ * or of its pool, highest priority first, and calls their `done` callback
+ * when they finish. Each slot stays in use until its request finishes and
+ * the slots ahead of it are free again, so a request that takes long holds
+ * the ones behind it. Set it after `exo_init()` and before other threads
+ * start submitting.
+ *
+ * \param[in] ctx    Context to set the queue on
+ * \param[in] slots  Storage for the queue, NULL to remove it
+ * \param[in] count  Number of slots, a power of two
+ *
+ * \return EXO_OK, EXO_GENERAL_ERROR if count isn't a power of two
+ */
+exo_error exo_set_submit_queue(exo_context *ctx, exo_submission *slots, size_t count)
+{
+  size_t i;
+
+  if (slots != NULL && (count == 0 || (count & (count - 1)) != 0 || count > 0x80000000UL))
+    return EXO_GENERAL_ERROR;
+
+  for (i = 0; slots != NULL && i < count; i++)
+    slots[i].seq = i;
+
+  ctx->subs = slots;
+  ctx->sub_mask = slots != NULL ? count - 1 : 0;
+  ctx->sub_enqueue = 0;
+  ctx->sub_dequeue = 0;
+  ctx->sub_release = 0;
+
+  return EXO_OK;
+}
+
+// consumer side state of a slot between dequeue and release
+enum { EXO_SUB_WAITING = 1, EXO_SUB_BOUND, EXO_SUB_DONE };
+
+static exo_error exo_submit(exo_context *ctx, exo_request_type type, const char *alias, const char *value,
+                            uint8_t priority, exo_submit_done done, void *arg)
+{
+  exo_submission *slot;
+  uint32_t pos, seq;
+  size_t value_len = value != NULL ? strlen(value) : 0;
+
+  if (ctx->subs == NULL || strlen(alias) >= EXO_SUBMIT_ALIAS_MAX || value_len >= EXO_SUBMIT_VALUE_MAX)
+    return EXO_GENERAL_ERROR;
+
+  // bounded MPMC queue after Dmitry Vyukov, with a single consumer
+  pos = EXO_LOAD_RELAXED(&ctx->sub_enqueue);
+  for (;;) {
+    slot = &ctx->subs[pos & ctx->sub_mask];
+    seq = EXO_LOAD_ACQUIRE(&slot->seq);
+
+    if (seq == pos) {
+      if (EXO_CAS_RELAXED(&ctx->sub_enqueue, &pos, pos + 1))
+        break;
+    } else if ((int32_t)(seq - pos) < 0) {
+      return EXO_OUT_OF_SPACE;
+    } else {
+      pos = EXO_LOAD_RELAXED(&ctx->sub_enqueue);
+    }
   }
 
-  return EXO_IDLE;
+  slot->type = type;
+  slot->priority = priority;
+  strcpy(slot->alias, alias);
+  memcpy(slot->value, value != NULL ? value : "", value_len + 1);
+  slot->done = done;
+  slot->arg = arg;
+
+  EXO_STORE_RELEASE(&slot->seq, pos + 1);
+
+  if (ctx->sub_wake != NULL)
+    ctx->sub_wake(ctx, ctx->sub_wake_arg);
+
+  return EXO_OK;
+}
+
+/*!
+ * \brief Queues a write from any thread
+ *
+ * \param[in] ctx       Context with a submit queue
+ * \param[in] alias     Alias of dataport to write to, copied
+ * \param[in] value     Value to write, copied
+ * \param[in] priority  Higher priority submissions get free ops first
+ * \param[in] done      Called when the write finished, may be NULL
+ * \param[in] arg       Passed to done
+ *
+ * \return EXO_OK, EXO_OUT_OF_SPACE if the queue is full, EXO_GENERAL_ERROR
+ *         if there is no queue or alias or value don't fit
+ */
+exo_error exo_submit_write(exo_context *ctx, const char *alias, const char *value,
+                           uint8_t priority, exo_submit_done done, void *arg)
+{
+  return exo_submit(ctx, EXO_WRITE, alias, value, priority, done, arg);
+}
+
+/*!
+ * \brief Queues a read from any thread
+ *
+ * Same as `exo_submit_write()`, the value read is handed to `done` in
+ * `sub->value`.
+ */
+exo_error exo_submit_read(exo_context *ctx, const char *alias,
+                          uint8_t priority, exo_submit_done done, void *arg)
+{
+  return exo_submit(ctx, EXO_READ, alias, NULL, priority, done, arg);
+}
+
+/*!
+ * \brief Sets a callback run after each submission
+ *
+ * Lets whatever drives `exo_operate()` sleep until there is work, see
+ * `exo_start_background()`. Set it before other threads start submitting.
+ *
+ * \param[in] ctx   Context with a submit queue
+ * \param[in] wake  Called on the submitting thread, NULL for none
+ * \param[in] arg   Passed to wake
+ */
+void exo_set_submit_wake(exo_context *ctx, exo_submit_wake wake, void *arg)
+{
+  ctx->sub_wake = wake;
+  ctx->sub_wake_arg = arg;
+}
+
+#ifdef EXO_ENABLE_PROFILE
+/*!
+ * \brief Takes a copy of the context's phase profile
+ *
+ * Only with EXO_ENABLE_PROFILE. Not synchronized, call it from the thread
+ * running `exo_operate()`.
+ *
+ * \param[in]  ctx      Context to read
+ * \param[out] profile  Copy of the profile
+ */
+void exo_get_profile(exo_context *ctx, exo_profile *profile)
+{
+  *profile = ctx->profile;
+}
+
+/*!
+ * \brief Clears the context's phase profile
+ *
+ * \param[in] ctx  Context to clear
+ */
+void exo_reset_profile(exo_context *ctx)
+{
+  memset(&ctx->profile, 0, sizeof(ctx->profile));
 }
 
+/*!
+ * \brief Formats a phase profile as a text table
+ *
+ * One line per phase and op type that was seen, with calls, total ticks and
+ * ticks per call.
+ *
+ * \param[in]  profile  Profile to format
+ * \param[out] buf      Where to put the text, always NUL terminated
+ * \param[in]  size     Size of buf
+ *
+ * \return Length of the text, if >= size it was cut short
+ */
+size_t exo_format_profile(const exo_profile *profile, char *buf, size_t size)
+{
+  static const char *phases[EXO_PHASE_COUNT] = {"activation", "recv", "active", "build", "send", "scan"};
+  static const char *types[EXO_ACTIVATE + 1] = {"-", "write", "read", "subscribe", "activate"};
+  size_t len = 0;
+  int n, p, t;
+
+  n = snprintf(buf, size, "%u exo_operate calls\n%-11s %-10s %10s %14s %12s\n",
+               (unsigned)profile->operate_calls, "phase", "op", "calls", "ticks", "ticks/call");
+  len += n > 0 ? n : 0;
+
+  for (p = 0; p < EXO_PHASE_COUNT; p++) {
+    for (t = 0; t <= EXO_ACTIVATE; t++) {
+      if (profile->calls[p][t] == 0)
+        continue;
+
+      n = snprintf(buf + (len < size ? len : size), len < size ? size - len : 0,
+                   "%-11s %-10s %10u %14llu %12.1f\n", phases[p], types[t],
+                   (unsigned)profile->calls[p][t], (unsigned long long)profile->ticks[p][t],
+                   (double)profile->ticks[p][t] / profile->calls[p][t]);
+      len += n > 0 ? n : 0;
+    }
+  }
+
+  return len;
+}
+#endif
+
 // Internal Functions
 
-static void exo_process_waiting_datagrams(exo_op *op, uint8_t count)
+static uint32_t exo_rand(exo_context *ctx)
+{
+  // xorshift32, each context has its own so no locking is needed
+  ctx->rng ^= ctx->rng << 13;
+  ctx->rng ^= ctx->rng >> 17;
+  ctx->rng ^= ctx->rng << 5;
+  return ctx->rng;
+}
+
+// takes newly published submissions and puts waiting ones into free ops
+static uint8_t exo_bind_submissions(exo_context *ctx, const exo_op_set *set)
+{
+  exo_submission *slot, *best;
+  exo_op *o = set->array;
+  uint32_t pos;
+  uint8_t bound = 0;
+
+  for (;;) {
+    slot = &ctx->subs[ctx->sub_dequeue & ctx->sub_mask];
+    if (EXO_LOAD_ACQUIRE(&slot->seq) != ctx->sub_dequeue + 1)
+      break;
+    slot->state = EXO_SUB_WAITING;
+    ctx->sub_dequeue++;
+  }
+
+  for (;;) {
+    if (set->pool != NULL) {
+      if (set->pool->free == NULL)
+        return bound;
+    } else {
+      while (o < set->array + set->count && (o->type != EXO_NULL || o->state != EXO_REQUEST_NULL))
+        o++;
+      if (o == set->array + set->count)
+        return bound;
+    }
+
+    best = NULL;
+    for (pos = ctx->sub_release; pos != ctx->sub_dequeue; pos++) {
+      slot = &ctx->subs[pos & ctx->sub_mask];
+      if (slot->state == EXO_SUB_WAITING && (best == NULL || slot->priority > best->priority))
+        best = slot;
+    }
+
+    if (best == NULL)
+      return bound;
+
+    if (set->pool != NULL)
+      o = exo_op_acquire(set->pool);
+    if (best->type == EXO_WRITE)
+      exo_write(o, best->alias, best->value);
+    else
+      exo_read(o, best->alias, best->value, sizeof(best->value));
+
+    o->sub = best;
+    best->state = EXO_SUB_BOUND;
+    bound = 1;
+  }
+}
+
+// reports finished submissions and frees their ops and, in order, slots
+static void exo_complete_submissions(exo_context *ctx, const exo_op_set *set)
+{
+  exo_submission *slot;
+  exo_op *o, *next;
+
+  for (o = exo_next_op(set, set->activation); o != NULL; o = next) {
+    next = exo_next_op(set, o);
+    if (o->sub == NULL || !exo_is_op_finished(o))
+      continue;
+
+    slot = o->sub;
+    if (slot->done != NULL)
+      slot->done(ctx, slot, exo_is_op_success(o), slot->arg);
+
+    slot->state = EXO_SUB_DONE;
+    if (set->pool != NULL)
+      exo_op_release(set->pool, o);
+    else
+      exo_op_init(o);
+  }
+
+  while (ctx->sub_release != ctx->sub_dequeue) {
+    slot = &ctx->subs[ctx->sub_release & ctx->sub_mask];
+    if (slot->state != EXO_SUB_DONE)
+      break;
+    slot->state = 0;
+    EXO_STORE_RELEASE(&slot->seq, ctx->sub_release + ctx->sub_mask + 1);
+    ctx->sub_release++;
+  }
+}
+
+static void exo_pool_link(exo_pool *pool, exo_op *op)
+{
+  op->prev = NULL;
+  op->next = pool->live;
+  if (pool->live != NULL)
+    pool->live->prev = op;
+  pool->live = op;
+  pool->live_count++;
+}
+
+static void exo_snapshot_publish(exo_snapshot *snapshot, const uint8_t *val, size_t len, uint32_t obs_seq)
+{
+  uint32_t version = snapshot->version + 1;
+  exo_snapshot_buf *buf = &snapshot->buf[version & 1];
+
+  if (len >= EXO_SNAPSHOT_VALUE_MAX)
+    len = EXO_SNAPSHOT_VALUE_MAX - 1;
+
+  EXO_STORE_RELAXED(&buf->seq, buf->seq + 1);
+  EXO_FENCE_RELEASE();
+
+  memcpy(buf->value, val, len);
+  buf->len = len;
+  buf->obs_seq = obs_seq;
+
+  EXO_STORE_RELEASE(&buf->seq, buf->seq + 1);
+  EXO_STORE_RELEASE(&snapshot->version, version);
+}
+
+static exo_arena_value *exo_arena_value_of(exo_value_arena *arena, exo_op *op)
+{
+  exo_arena_value *v;
+
+  if ((op->type != EXO_READ && op->type != EXO_SUBSCRIBE) || op->value_max != 0 ||
+      op->value == NULL || (uint8_t *)op->value < arena->buf ||
+      (uint8_t *)op->value >= arena->buf + arena->used)
+    return NULL;
+
+  v = (exo_arena_value *)op->value - 1;
+  return v->gen == op->value_gen ? v : NULL;
+}
+
+// drops the values no op in the set points at any more, and skip's, which is
+// about to be replaced, then slides the rest to the front
+static void exo_arena_compact(exo_context *ctx, const exo_op_set *set, exo_op *skip)
+{
+  exo_value_arena *arena = &ctx->arena;
+  exo_arena_value *v;
+  size_t from, to = 0, size;
+  exo_op *o;
+
+  EXO_STAT_INC(ctx, arena_compactions);
+
+  for (from = 0; from < arena->used; from += v->size) {
+    v = (exo_arena_value *)(arena->buf + from);
+    v->owner = NULL;
+  }
+
+  for (o = set->activation; o != NULL; o = exo_next_op(set, o)) {
+    if (o != skip && (v = exo_arena_value_of(arena, o)) != NULL)
+      v->owner = o;
+  }
+
+  for (from = 0; from < arena->used; from += size) {
+    v = (exo_arena_value *)(arena->buf + from);
+    size = v->size;
+    if (v->owner == NULL)
+      continue;
+
+    if (to != from) {
+      memmove(arena->buf + to, v, size);
+      v = (exo_arena_value *)(arena->buf + to);
+    }
+    v->owner->value = (char *)(v + 1);
+    to += size;
+  }
+
+  arena->used = to;
+}
+
+// copies a received value to where the op wants it, non-zero if it won't fit
+static uint8_t exo_store_value(exo_context *ctx, const exo_op_set *set, exo_op *op,
+                               const uint8_t *val, size_t len)
+{
+  exo_value_arena *arena = &ctx->arena;
+  exo_arena_value *v;
+  size_t size = EXO_ARENA_ROUND(sizeof(exo_arena_value) + len + 1);
+
+  if (op->value_max != 0) {
+    if (op->value == NULL || len + 1 > op->value_max)
+      return 1;
+    memcpy(op->value, val, len);
+    op->value[len] = '\0';
+    return 0;
+  }
+
+  if (arena->buf == NULL || (op->type != EXO_READ && op->type != EXO_SUBSCRIBE))
+    return 1;
+
+  if (arena->size - arena->used < size) {
+    exo_arena_compact(ctx, set, op);
+    op->value = NULL;
+    if (arena->size - arena->used < size)
+      return 1;
+  }
+
+  if (++arena->gen == 0)
+    arena->gen = 1;
+
+  v = (exo_arena_value *)(arena->buf + arena->used);
+  v->owner = NULL;
+  v->gen = arena->gen;
+  v->size = size;
+  arena->used += size;
+
+  op->value = (char *)(v + 1);
+  op->value_gen = v->gen;
+  memcpy(op->value, val, len);
+  op->value[len] = '\0';
+  return 0;
+}
+
+static void exo_record_pdu(exo_context *ctx, coap_pdu *pdu, exo_record_dir dir)
+{
+  exo_record *rec = &ctx->records[ctx->record_head];
+
+  rec->time = ctx->now;
+  rec->len = pdu->len;
+  rec->dir = dir;
+  memcpy(rec->buf, pdu->buf, pdu->len < EXO_RECORD_SNAPLEN ? pdu->len : EXO_RECORD_SNAPLEN);
+
+  if (++ctx->record_head == ctx->record_count)
+    ctx->record_head = 0;
+  if (ctx->record_used < ctx->record_count)
+    ctx->record_used++;
+}
+
+static uint8_t exo_send(exo_context *ctx, coap_pdu *pdu)
+{
+  uint8_t ret = ctx->pal->udp_send(ctx->pal_data, pdu->buf, pdu->len);
+
+  EXO_TRACE3(pdu__send, pdu->buf, pdu->len, ret);
+
+  if (ret != 0) {
+    EXO_STAT_INC(ctx, send_errors);
+    exo_pal_error(ctx, ret);
+    return 1;
+  }
+
+  if (ctx->pal_errors != EXO_PAL_REOPEN_NOW)
+    ctx->pal_errors = 0;
+  EXO_STAT_INC(ctx, sent);
+  if (ctx->records != NULL)
+    exo_record_pdu(ctx, pdu, EXO_RECORD_SENT);
+
+  return 0;
+}
+
+static uint8_t exo_recv(exo_context *ctx, coap_pdu *pdu)
+{
+  uint8_t ret = ctx->pal->udp_recv(ctx->pal_data, pdu->buf, pdu->max, &pdu->len);
+
+  if (ret == 0) {
+    EXO_TRACE2(pdu__recv, pdu->buf, pdu->len);
+    EXO_STAT_INC(ctx, received);
+    if (ctx->pal_errors != EXO_PAL_REOPEN_NOW)
+      ctx->pal_errors = 0;
+    if (ctx->records != NULL)
+      exo_record_pdu(ctx, pdu, EXO_RECORD_RECEIVED);
+  } else if (ret != 2) {
+    EXO_STAT_INC(ctx, recv_errors);
+    exo_pal_error(ctx, ret);
+  }
+
+  return ret;
+}
+
+// counts errors towards a new socket, 2 only means the PAL isn't ready yet
+static void exo_pal_error(exo_context *ctx, uint8_t ret)
+{
+  if (ret == 3)
+    ctx->pal_errors = EXO_PAL_REOPEN_NOW;
+  else if (ret != 2 && ctx->pal_errors < EXO_PAL_ERRORS_REOPEN)
+    ctx->pal_errors++;
+}
+
+// The PAL's socket keeps failing, the interface went down or the address
+// changed. Have the PAL open a new one and move every op over to it: nothing
+// is dropped, subscriptions register again since notifications would still
+// go to the old address, and pending requests go out again right away.
+static void exo_reopen(exo_context *ctx, const exo_op_set *set)
+{
+  exo_op *o;
+
+  ctx->pal_errors = 0;
+  ctx->reopen_at = ctx->now + EXO_REOPEN_INTERVAL_US;
+  EXO_STAT_INC(ctx, reopens);
+
+  if (ctx->pal->udp_sock(ctx->pal_data) != 0)
+    return;
+
+  for (o = set->activation; o != NULL; o = exo_next_op(set, o)) {
+    if (o->state == EXO_REQUEST_SUBSCRIBED)
+      EXO_OP_SET_STATE(o, EXO_REQUEST_NEW);
+    else if (o->state == EXO_REQUEST_PENDING ||
+             (o->type == EXO_SUBSCRIBE && o->state == EXO_REQUEST_SUCCESS))
+      o->timeout = ctx->now;
+  }
+}
+
+// records how long the op waited for its ACK and how often it was resent
+static void exo_record_ack(exo_context *ctx, exo_op *op)
+{
+  uint64_t rtt = ctx->now - op->sent_at;
+  exo_hist_id id;
+
+  switch (op->type) {
+    case EXO_READ:
+      id = EXO_HIST_READ;
+      break;
+    case EXO_WRITE:
+      id = EXO_HIST_WRITE;
+      break;
+    case EXO_SUBSCRIBE:
+      id = EXO_HIST_SUBSCRIBE;
+      break;
+    case EXO_ACTIVATE:
+      id = EXO_HIST_ACTIVATE;
+      break;
+    default:
+      return;
+  }
+
+  exo_hist_record(&ctx->hist[id], rtt > UINT32_MAX ? UINT32_MAX : (uint32_t)rtt);
+  exo_hist_record(&ctx->hist[EXO_HIST_RETRIES], op->retries);
+}
+
+static void exo_process_waiting_datagrams(exo_context *ctx, const exo_op_set *set)
 {
   uint8_t buf[MINIMUM_DATAGRAM_SIZE];
   coap_pdu pdu;
   coap_option opt;
   coap_payload payload;
-  int i;
+  coap_type type;
+  uint16_t mid;
+  uint64_t token;
+  exo_op *o;
 
   pdu.buf = buf;
   pdu.max = MINIMUM_DATAGRAM_SIZE;
   pdu.len = 0;
 
   // receive a UDP packet if one or more waiting
-  while (exopal_udp_recv(pdu.buf, pdu.max, &pdu.len) == 0) {
-    if (coap_validate_pkt(&pdu) != CE_NONE)
+  while (exo_recv(ctx, &pdu) == 0) {
+    if (coap_validate_pkt(&pdu) != CE_NONE) {
+      EXO_TRACE2(pdu__invalid, pdu.buf, pdu.len);
+      EXO_STAT_INC(ctx, invalid);
       continue; //Invalid Packet, Ignore
+    }
 
-    for (i = 0; i < count; i++) {
-      if (coap_get_type(&pdu) == CT_CON || coap_get_type(&pdu) == CT_NON) {
-        if (op[i].state == EXO_REQUEST_SUBSCRIBED && coap_get_token(&pdu) == op[i].token) {
+    // the same for every op, don't parse them again for each
+    type = coap_get_type(&pdu);
+    mid = coap_get_mid(&pdu);
+    token = coap_get_token(&pdu);
+
+    for (o = set->activation; o != NULL; o = exo_next_op(set, o)) {
+      if (type == CT_CON || type == CT_NON) {
+        if (o->state == EXO_REQUEST_SUBSCRIBED && token == o->token) {
           if (coap_get_code(&pdu) == CC_CONTENT) {
             uint32_t new_seq = 0;
             opt = coap_get_option_by_num(&pdu, CON_OBSERVE, 0);
@@ -321,19 +1768,22 @@ static void exo_process_waiting_datagrams(exo_op *op, uint8_t count)
 
             payload = coap_get_payload(&pdu);
             if (payload.len == 0) {
-              op[i].value[0] = '\0';
-            } else if (payload.len+1 > op[i].value_max || op[i].value == 0) {
-              op[i].state = EXO_REQUEST_ERROR;
+              exo_store_value(ctx, set, o, payload.val, 0);
+              if (o->snapshot != NULL)
+                exo_snapshot_publish(o->snapshot, payload.val, 0, new_seq);
+            } else if (exo_store_value(ctx, set, o, payload.val, payload.len) != 0) {
+              EXO_OP_SET_STATE(o, EXO_REQUEST_ERROR);
+              EXO_STAT_INC(ctx, error_oversize);
             } else{
-              memcpy(op[i].value, payload.val, payload.len);
-              op[i].value[payload.len] = 0;
-              op[i].mid = coap_get_mid(&pdu);
+              if (o->snapshot != NULL)
+                exo_snapshot_publish(o->snapshot, payload.val, payload.len, new_seq);
+              o->mid = mid;
               // TODO: User proper logic to ensure it's a new value not a different, but old one.
-              if (op[i].obs_seq != new_seq) {
-                op[i].state = EXO_REQUEST_SUB_ACK_NEW;
-                op[i].obs_seq = new_seq;
+              if (o->obs_seq != new_seq) {
+                EXO_OP_SET_STATE(o, EXO_REQUEST_SUB_ACK_NEW);
+                o->obs_seq = new_seq;
               } else {
-                op[i].state = EXO_REQUEST_SUB_ACK;
+                EXO_OP_SET_STATE(o, EXO_REQUEST_SUB_ACK);
               }
 
               opt = coap_get_option_by_num(&pdu, CON_MAX_AGE, 0);
@@ -343,43 +1793,46 @@ static void exo_process_waiting_datagrams(exo_op *op, uint8_t count)
               }
 
               // Set timeout between Max-Age to Max-Age + ACK_RANDOM_FACTOR (CoAP Defined)
-              op[i].timeout = exopal_get_time() + (max_age * 1000000)
-                                                + (((uint64_t)rand() % 1500000));
+              o->timeout = ctx->now + (max_age * 1000000)
+                                                + (((uint64_t)exo_rand(ctx) % 1500000));
             }
           } else if (coap_get_code_class(&pdu) != 2) {
-            op[i].state = EXO_REQUEST_ERROR;
+            EXO_OP_SET_STATE(o, EXO_REQUEST_ERROR);
+            EXO_STAT_INC(ctx, error_response);
           }
           break;
         }
-      } else if (coap_get_type(&pdu) == CT_ACK) {
-        if (op[i].state == EXO_REQUEST_PENDING && op[i].mid == coap_get_mid(&pdu)) {
+      } else if (type == CT_ACK) {
+        if (o->state == EXO_REQUEST_PENDING && o->mid == mid) {
+          exo_record_ack(ctx, o);
+
           if (coap_get_code_class(&pdu) == 2) {
-            switch (op[i].type) {
+            switch (o->type) {
               case EXO_WRITE:
-                op[i].state = EXO_REQUEST_SUCCESS;
+                EXO_OP_SET_STATE(o, EXO_REQUEST_SUCCESS);
                 break;
               case EXO_READ:
                 payload = coap_get_payload(&pdu);
                 if (payload.len == 0) {
-                  op[i].value[0] = '\0';
-                } else if (payload.len+1 > op[i].value_max || op[i].value == 0) {
-                  op[i].state = EXO_REQUEST_ERROR;
+                  exo_store_value(ctx, set, o, payload.val, 0);
+                } else if (exo_store_value(ctx, set, o, payload.val, payload.len) != 0) {
+                  EXO_OP_SET_STATE(o, EXO_REQUEST_ERROR);
+                  EXO_STAT_INC(ctx, error_oversize);
                 } else{
-                  memcpy(op[i].value, payload.val, payload.len);
-                  op[i].value[payload.len] = 0;
-                  op[i].state = EXO_REQUEST_SUCCESS;
+                  EXO_OP_SET_STATE(o, EXO_REQUEST_SUCCESS);
                 }
                 break;
               case EXO_SUBSCRIBE:
                 payload = coap_get_payload(&pdu);
                 if (payload.len == 0) {
-                  op[i].value[0] = '\0';
-                } else if (payload.len+1 > op[i].value_max || op[i].value == 0) {
-                  op[i].state = EXO_REQUEST_ERROR;
+                  exo_store_value(ctx, set, o, payload.val, 0);
+                } else if (exo_store_value(ctx, set, o, payload.val, payload.len) != 0) {
+                  EXO_OP_SET_STATE(o, EXO_REQUEST_ERROR);
+                  EXO_STAT_INC(ctx, error_oversize);
                 } else{
-                  memcpy(op[i].value, payload.val, payload.len);
-                  op[i].value[payload.len] = 0;
-                  op[i].state = EXO_REQUEST_SUCCESS;
+                  // with a snapshot nobody has to exo_op_done() it
+                  EXO_OP_SET_STATE(o, o->snapshot != NULL ? EXO_REQUEST_SUBSCRIBED
+                                                                  : EXO_REQUEST_SUCCESS);
 
                   opt = coap_get_option_by_num(&pdu, CON_MAX_AGE, 0);
                   uint8_t max_age = 120; // default, 2 minutes, see RFC4787 Sec 4.3
@@ -389,66 +1842,78 @@ static void exo_process_waiting_datagrams(exo_op *op, uint8_t count)
 
                   opt = coap_get_option_by_num(&pdu, CON_OBSERVE, 0);
                   for (int j = 0; j < opt.len; j++) {
-                    op[i].obs_seq = (op[i].obs_seq << (8*j)) | opt.val[j];
+                    o->obs_seq = (o->obs_seq << (8*j)) | opt.val[j];
                   }
 
+                  if (o->snapshot != NULL)
+                    exo_snapshot_publish(o->snapshot, payload.val, payload.len, o->obs_seq);
+
                   // Set timeout between Max-Age to Max-Age + ACK_RANDOM_FACTOR (CoAP Defined)
-                  op[i].timeout = exopal_get_time() + (max_age * 1000000)
-                                                    + (((uint64_t)rand() % 1500000));
+                  o->timeout = ctx->now + (max_age * 1000000)
+                                                    + (((uint64_t)exo_rand(ctx) % 1500000));
                 }
                 break;
               case EXO_ACTIVATE:
                 payload = coap_get_payload(&pdu);
                 if (payload.len == CIK_LENGTH) {
-                  memcpy(cik, payload.val, CIK_LENGTH);
-                  cik[CIK_LENGTH] = 0;
-                  op[i].state = EXO_REQUEST_SUCCESS;
-                  exopal_store_cik(cik);
-                  device_state = EXO_STATE_GOOD;
+                  memcpy(ctx->cik, payload.val, CIK_LENGTH);
+                  ctx->cik[CIK_LENGTH] = 0;
+                  EXO_OP_SET_STATE(o, EXO_REQUEST_SUCCESS);
+                  ctx->pal->store_cik(ctx->pal_data, ctx->cik);
+                  ctx->device_state = EXO_STATE_GOOD;
                 } else {
-                  op[i].state = EXO_REQUEST_ERROR;
+                  EXO_OP_SET_STATE(o, EXO_REQUEST_ERROR);
+                  EXO_STAT_INC(ctx, error_activation);
                 }
 
                 // We're done with this op now.
-                exo_op_init(&op[i]);
+                exo_op_init(o);
                 break;
               case EXO_NULL: // pending null request? shouldn't be possible
                 continue;
             }
           } else {
-            op[i].state = EXO_REQUEST_ERROR;
+            EXO_OP_SET_STATE(o, EXO_REQUEST_ERROR);
+            EXO_STAT_INC(ctx, error_response);
 
             if (coap_get_code(&pdu) == CC_UNAUTHORIZED){
-              //device_state = EXO_STATE_BAD_CIK;
+              //ctx->device_state = EXO_STATE_BAD_CIK;
 
-              if (op[0].type == EXO_NULL || op[0].timeout < exopal_get_time())
-                exo_activate(&op[0]);
+              if (ctx->activation.type == EXO_NULL || ctx->activation.timeout < ctx->now)
+                exo_activate(&ctx->activation);
             } else if (coap_get_code(&pdu) == CC_NOT_FOUND) {
-              device_state = EXO_STATE_GOOD;
+              ctx->device_state = EXO_STATE_GOOD;
             }
           }
 
           break;
         }
 
-      } else if (coap_get_type(&pdu) == CT_RST) {
-        if ((op[i].state == EXO_REQUEST_PENDING || op[i].state == EXO_REQUEST_SUBSCRIBED) &&
-            (op[i].mid == coap_get_mid(&pdu) && op[i].token == coap_get_token(&pdu))){
-          op[i].state = EXO_REQUEST_ERROR;
+      } else if (type == CT_RST) {
+        if ((o->state == EXO_REQUEST_PENDING || o->state == EXO_REQUEST_SUBSCRIBED) &&
+            (o->mid == mid && o->token == token)){
+          EXO_OP_SET_STATE(o, EXO_REQUEST_ERROR);
+          EXO_STAT_INC(ctx, error_reset);
           break;
         }
       }
     }
 
     // if the above loop ends normally we don't recognize message, reply RST
-    if (i == count){
-      if (coap_get_type(&pdu) == CT_CON) {
+    if (o != NULL)
+      EXO_TRACE2(pdu__match, o, mid);
+
+    if (o == NULL){
+      if (type == CT_CON) {
+        EXO_TRACE1(pdu__rst, mid);
+
         // this can't fail
-        exo_build_msg_rst(&pdu, coap_get_mid(&pdu), coap_get_token(&pdu), coap_get_tkl(&pdu));
+        exo_build_msg_rst(&pdu, mid, token, coap_get_tkl(&pdu));
 
         // best effort, don't bother checking if it failed, nothing we can do it
         // it did anyway
-        exopal_udp_send(pdu.buf, pdu.len);
+        if (exo_send(ctx, &pdu) == 0)
+          EXO_STAT_INC(ctx, rst_sent);
       }
 
       break;
@@ -457,86 +1922,112 @@ static void exo_process_waiting_datagrams(exo_op *op, uint8_t count)
 }
 
 // process all ops that are in an active state
-static void exo_process_active_ops(exo_op *op, uint8_t count)
+static exo_state exo_process_active_ops(exo_context *ctx, const exo_op_set *set)
 {
+  exo_state state = EXO_IDLE;
   uint8_t buf[MINIMUM_DATAGRAM_SIZE];
   coap_pdu pdu;
-  int i;
-  uint64_t now = exopal_get_time();
+  exo_op *o;
+  uint64_t now = ctx->now;
+  uint8_t sent, held;
+  EXO_PROF_DECL(prof);
 
   pdu.buf = buf;
   pdu.max = MINIMUM_DATAGRAM_SIZE;
   pdu.len = 0;
 
-  for (i = 0; i < count; i++) {
-    switch (op[i].state) {
+  for (o = set->activation; o != NULL; o = exo_next_op(set, o)) {
+    held = 0;
+    switch (o->state) {
       case EXO_REQUEST_NEW:
         // Build and Send Request
-        switch (op[i].type) {
+        EXO_PROF_START(ctx, prof);
+        switch (o->type) {
           case EXO_READ:
-            exo_build_msg_read(&pdu, op[i].alias);
+            exo_build_msg_read(ctx, &pdu, o->alias);
             break;
           case EXO_SUBSCRIBE:
-            exo_build_msg_observe(&pdu, op[i].alias);
+            exo_build_msg_observe(ctx, &pdu, o->alias);
+            // re-register with the same token so the platform replaces the
+            // observation instead of adding one, RFC7641 Sec 3.3.1
+            if (o->tkl != 0)
+              coap_set_token(&pdu, o->token, o->tkl);
             break;
           case EXO_WRITE:
-            exo_build_msg_write(&pdu, op[i].alias, op[i].value);
+            exo_build_msg_write(ctx, &pdu, o->alias, o->value);
             break;
           case EXO_ACTIVATE:
-            exo_build_msg_activate(&pdu, vendor, model, serial);
+            exo_build_msg_activate(ctx, &pdu, ctx->vendor, ctx->model, ctx->serial);
             break;
           default:
-            op[i].type = EXO_NULL;
+            o->type = EXO_NULL;
             continue;
         }
-
-        if (exopal_udp_send(pdu.buf, pdu.len) == 0) {
-          op[i].state = EXO_REQUEST_PENDING;
-          op[i].timeout = exopal_get_time() + 4000000;
-          op[i].mid = coap_get_mid(&pdu);
-          op[i].token = coap_get_token(&pdu);
+        EXO_PROF_LAP(ctx, prof, EXO_PHASE_BUILD, o->type);
+
+        sent = exo_send(ctx, &pdu);
+        EXO_PROF_LAP(ctx, prof, EXO_PHASE_SEND, o->type);
+
+        if (sent == 0) {
+          EXO_OP_SET_STATE(o, EXO_REQUEST_PENDING);
+          o->sent_at = ctx->now;
+          o->timeout = o->sent_at + EXO_ACK_TIMEOUT_US;
+          o->retries = 0;
+          o->mid = coap_get_mid(&pdu);
+          o->token = coap_get_token(&pdu);
+          o->tkl = coap_get_tkl(&pdu);
+        } else {
+          // the PAL can't send yet, e.g. no address, try again next time
+          held = 1;
         }
 
         break;
       case EXO_REQUEST_SUBSCRIBED:
       case EXO_REQUEST_PENDING:
         // check if pending requests have reached timeout
-        if (op[i].timeout <= now){
-          switch (op[i].type) {
+        if (o->timeout <= now){
+          switch (o->type) {
             case EXO_READ:
             case EXO_WRITE:
             case EXO_ACTIVATE:
-              if (op[i].retries < COAP_MAX_RETRANSMIT){
-                switch (op[i].type) {
+              if (o->retries < EXO_MAX_RETRANSMIT){
+                EXO_PROF_START(ctx, prof);
+                switch (o->type) {
                   case EXO_READ:
-                    exo_build_msg_read(&pdu, op[i].alias);
+                    exo_build_msg_read(ctx, &pdu, o->alias);
                     break;
                   case EXO_WRITE:
-                    exo_build_msg_write(&pdu, op[i].alias, op[i].value);
+                    exo_build_msg_write(ctx, &pdu, o->alias, o->value);
                     break;
                   case EXO_ACTIVATE:
-                    exo_build_msg_activate(&pdu, vendor, model, serial);
+                    exo_build_msg_activate(ctx, &pdu, ctx->vendor, ctx->model, ctx->serial);
                     break;
                   default:
                     break;
                 }
 
                 // reuse old mid and token
-                coap_set_mid(&pdu, op[i].mid);
-                coap_set_token(&pdu, op[i].token, op[i].tkl);
-
-                if (exopal_udp_send(pdu.buf, pdu.len) == 0) {
-                  op[i].retries++;
-                  op[i].timeout = exopal_get_time() + (op[i].retries * COAP_PROBING_RATE * 1000000)
-                                                    + (((uint64_t)rand() % 1500000));
+                coap_set_mid(&pdu, o->mid);
+                coap_set_token(&pdu, o->token, o->tkl);
+                EXO_PROF_LAP(ctx, prof, EXO_PHASE_BUILD, o->type);
+
+                sent = exo_send(ctx, &pdu);
+                EXO_PROF_LAP(ctx, prof, EXO_PHASE_SEND, o->type);
+
+                if (sent == 0) {
+                  EXO_STAT_INC(ctx, retransmits);
+                  o->retries++;
+                  o->timeout = ctx->now + ((uint64_t)o->retries * EXO_RETRANSMIT_STEP_US)
+                                                    + (EXO_RETRANSMIT_JITTER_US ? (uint64_t)exo_rand(ctx) % EXO_RETRANSMIT_JITTER_US : 0);
                 }
               } else {
-                op[i].state = EXO_REQUEST_ERROR;
+                EXO_OP_SET_STATE(o, EXO_REQUEST_ERROR);
+                EXO_STAT_INC(ctx, error_timeout);
               }
               break;
             case EXO_SUBSCRIBE:
               // force a new observe request
-              op[i].state = EXO_REQUEST_NEW;
+              EXO_OP_SET_STATE(o, EXO_REQUEST_NEW);
               break;
             default:
               break;
@@ -546,31 +2037,46 @@ static void exo_process_active_ops(exo_op *op, uint8_t count)
       case EXO_REQUEST_SUB_ACK_NEW:
       case EXO_REQUEST_SUB_ACK:
         // send ack for observe notification
-        exo_build_msg_ack(&pdu, op[i].mid);
-
-        if (exopal_udp_send(pdu.buf, pdu.len) == 0) {
-          if (op[i].state == EXO_REQUEST_SUB_ACK)
-            op[i].state = EXO_REQUEST_SUBSCRIBED;
-          else if (op[i].state == EXO_REQUEST_SUB_ACK_NEW)
-            op[i].state = EXO_REQUEST_SUCCESS;
+        EXO_PROF_START(ctx, prof);
+        exo_build_msg_ack(&pdu, o->mid);
+        EXO_PROF_LAP(ctx, prof, EXO_PHASE_BUILD, o->type);
+
+        sent = exo_send(ctx, &pdu);
+        EXO_PROF_LAP(ctx, prof, EXO_PHASE_SEND, o->type);
+
+        if (sent == 0) {
+          if (o->state == EXO_REQUEST_SUB_ACK)
+            EXO_OP_SET_STATE(o, EXO_REQUEST_SUBSCRIBED);
+          else if (o->state == EXO_REQUEST_SUB_ACK_NEW)
+            EXO_OP_SET_STATE(o, o->snapshot != NULL ? EXO_REQUEST_SUBSCRIBED
+                                                            : EXO_REQUEST_SUCCESS);
         }
         break;
       default:
         break;
     }
+
+    // tally what is left to do while the op is still in cache, ops the PAL
+    // couldn't send only wait, calling again right away won't help them
+    if (o->state == EXO_REQUEST_NEW && !held)
+      state = EXO_BUSY;
+    else if ((o->state == EXO_REQUEST_PENDING || o->state == EXO_REQUEST_NEW) && state == EXO_IDLE)
+      state = EXO_WAITING;
   }
+
+  return state;
 }
 
 
-exo_error exo_build_msg_activate(coap_pdu *pdu, const char *vendor, const char *model, const char *serial_number)
+exo_error exo_build_msg_activate(exo_context *ctx, coap_pdu *pdu, const char *vendor, const char *model, const char *serial_number)
 {
     coap_error ret;
     coap_init_pdu(pdu);
     ret = coap_set_version(pdu, COAP_V1);
     ret |= coap_set_type(pdu, CT_CON);
     ret |= coap_set_code(pdu, CC_POST);
-    ret |= coap_set_mid(pdu, message_id_counter++);
-    ret |= coap_set_token(pdu, rand(), 2);
+    ret |= coap_set_mid(pdu, ctx->message_id_counter++);
+    ret |= coap_set_token(pdu, exo_rand(ctx), 2);
     ret |= coap_add_option(pdu, CON_URI_PATH, (uint8_t*)"provision", 9);
     ret |= coap_add_option(pdu, CON_URI_PATH, (uint8_t*)"activate", 8);
     ret |= coap_add_option(pdu, CON_URI_PATH, (uint8_t*)vendor, strlen(vendor));
@@ -580,29 +2086,33 @@ exo_error exo_build_msg_activate(coap_pdu *pdu, const char *vendor, const char *
     if (ret != CE_NONE)
       return EXO_GENERAL_ERROR;
 
+    EXO_TRACE3(pdu__build, coap_get_code(pdu), coap_get_mid(pdu), pdu->len);
+
     return EXO_OK;
 }
 
-exo_error exo_build_msg_read(coap_pdu *pdu, const char *alias)
+exo_error exo_build_msg_read(exo_context *ctx, coap_pdu *pdu, const char *alias)
 {
     coap_error ret;
     coap_init_pdu(pdu);
     ret = coap_set_version(pdu, COAP_V1);
     ret |= coap_set_type(pdu, CT_CON);
     ret |= coap_set_code(pdu, CC_GET);
-    ret |= coap_set_mid(pdu, message_id_counter++);
-    ret |= coap_set_token(pdu, rand(), 2);
+    ret |= coap_set_mid(pdu, ctx->message_id_counter++);
+    ret |= coap_set_token(pdu, exo_rand(ctx), 2);
     ret |= coap_add_option(pdu, CON_URI_PATH, (uint8_t*)"1a", 2);
     ret |= coap_add_option(pdu, CON_URI_PATH, (uint8_t*)alias, strlen(alias));
-    ret |= coap_add_option(pdu, CON_URI_QUERY, (uint8_t*)cik, 40);
+    ret |= coap_add_option(pdu, CON_URI_QUERY, (uint8_t*)ctx->cik, CIK_LENGTH);
 
     if (ret != CE_NONE)
       return EXO_GENERAL_ERROR;
 
+    EXO_TRACE3(pdu__build, coap_get_code(pdu), coap_get_mid(pdu), pdu->len);
+
     return EXO_OK;
 }
 
-exo_error exo_build_msg_observe(coap_pdu *pdu, const char *alias)
+exo_error exo_build_msg_observe(exo_context *ctx, coap_pdu *pdu, const char *alias)
 {
     uint8_t obs_opt = 0;
     coap_error ret;
@@ -610,36 +2120,40 @@ exo_error exo_build_msg_observe(coap_pdu *pdu, const char *alias)
     ret = coap_set_version(pdu, COAP_V1);
     ret |= coap_set_type(pdu, CT_CON);
     ret |= coap_set_code(pdu, CC_GET);
-    ret |= coap_set_mid(pdu, message_id_counter++);
-    ret |= coap_set_token(pdu, rand(), 2);
+    ret |= coap_set_mid(pdu, ctx->message_id_counter++);
+    ret |= coap_set_token(pdu, exo_rand(ctx), 2);
     ret |= coap_add_option(pdu, CON_OBSERVE, &obs_opt, 1);
     ret |= coap_add_option(pdu, CON_URI_PATH, (uint8_t*)"1a", 2);
     ret |= coap_add_option(pdu, CON_URI_PATH, (uint8_t*)alias, strlen(alias));
-    ret |= coap_add_option(pdu, CON_URI_QUERY, (uint8_t*)cik, 40);
+    ret |= coap_add_option(pdu, CON_URI_QUERY, (uint8_t*)ctx->cik, CIK_LENGTH);
 
     if (ret != CE_NONE)
       return EXO_GENERAL_ERROR;
 
+    EXO_TRACE3(pdu__build, coap_get_code(pdu), coap_get_mid(pdu), pdu->len);
+
     return EXO_OK;
 }
 
-exo_error exo_build_msg_write(coap_pdu *pdu, const char *alias, const char *value)
+exo_error exo_build_msg_write(exo_context *ctx, coap_pdu *pdu, const char *alias, const char *value)
 {
     coap_error ret;
     coap_init_pdu(pdu);
     ret = coap_set_version(pdu, COAP_V1);
     ret |= coap_set_type(pdu, CT_CON);
     ret |= coap_set_code(pdu, CC_POST);
-    ret |= coap_set_mid(pdu, message_id_counter++);
-    ret |= coap_set_token(pdu, rand(), 2);
+    ret |= coap_set_mid(pdu, ctx->message_id_counter++);
+    ret |= coap_set_token(pdu, exo_rand(ctx), 2);
     ret |= coap_add_option(pdu, CON_URI_PATH, (uint8_t*)"1a", 2);
     ret |= coap_add_option(pdu, CON_URI_PATH, (uint8_t*)alias, strlen(alias));
-    ret |= coap_add_option(pdu, CON_URI_QUERY, (uint8_t*)cik, 40);
+    ret |= coap_add_option(pdu, CON_URI_QUERY, (uint8_t*)ctx->cik, CIK_LENGTH);
     ret |= coap_set_payload(pdu, (uint8_t *)value, strlen(value));
 
     if (ret != CE_NONE)
       return EXO_GENERAL_ERROR;
 
+    EXO_TRACE3(pdu__build, coap_get_code(pdu), coap_get_mid(pdu), pdu->len);
+
     return EXO_OK;
 }
 
@@ -656,6 +2170,8 @@ exo_error exo_build_msg_rst(coap_pdu *pdu, const uint16_t mid, const uint64_t to
     if (ret != CE_NONE)
       return EXO_GENERAL_ERROR;
 
+    EXO_TRACE3(pdu__build, coap_get_code(pdu), coap_get_mid(pdu), pdu->len);
+
     return EXO_OK;
 }
 
@@ -671,6 +2187,8 @@ exo_error exo_build_msg_ack(coap_pdu *pdu, const uint16_t mid)
     if (ret != CE_NONE)
       return EXO_GENERAL_ERROR;
 
+    EXO_TRACE3(pdu__build, coap_get_code(pdu), coap_get_mid(pdu), pdu->len);
+
     return EXO_OK;
 }
 
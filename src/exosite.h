@@ -37,7 +37,7 @@
 #define EXOSITE_H
 
 #include <stdint.h>
-#include "exosite_pal.h"
+#include <stddef.h>
 
 
 // DEFINES
@@ -100,23 +100,341 @@ typedef enum exo_request_state
   EXO_REQUEST_ERROR,
 } exo_request_state;
 
+/*!
+ * \brief Platform Abstraction Layer Operations
+ *
+ * Table of functions the library uses to talk to the network, clock and
+ * non-volatile storage. Each PAL exports one of these (see the `pal/` folder)
+ * and it is handed to `exo_init()` along with a pointer to the PAL's own
+ * instance data, which is passed back as the first argument of every call.
+ * Since no PAL is bound at link time several contexts, each with their own
+ * PAL, can live in the same binary.
+ *
+ * All functions return 0 on success, else an error code, unless otherwise
+ * noted.
+ */
+typedef struct exo_pal_ops
+{
+	uint8_t (*init)(void *pal);
+	uint8_t (*store_cik)(void *pal, const char *cik);
+	uint8_t (*retrieve_cik)(void *pal, char *cik);   // 1 if no CIK saved, >1 fatal
+	uint8_t (*udp_sock)(void *pal);
+	uint8_t (*udp_send)(void *pal, const uint8_t *buf, size_t len);  // 2 if it can't send
+	                                                 // yet, 3 if udp_sock must run again
+	uint8_t (*udp_recv)(void *pal, uint8_t *buf, size_t size, size_t *rlen); // 2 if none waiting,
+	                                                 // 3 if udp_sock must run again
+	uint64_t (*get_time)(void *pal);                 // microseconds, must not jump
+	int (*udp_fd)(void *pal);                        // descriptor that polls readable when
+	                                                 // a datagram waits, -1 or NULL if none
+} exo_pal_ops;
+
+/*!
+ * \brief Runtime Statistics
+ *
+ * Counters kept by each context since `exo_init()`. Only the thread running
+ * `exo_operate()` updates them, use `exo_get_stats()` to read a copy from any
+ * thread. They wrap at 2^32.
+ */
+typedef struct exo_stats
+{
+	uint32_t sent;              // datagrams handed to the PAL
+	uint32_t received;          // datagrams received from the PAL
+	uint32_t send_errors;       // PAL refused to send
+	uint32_t recv_errors;       // PAL receive failed (not just nothing waiting)
+	uint32_t retransmits;       // requests sent again after a timeout
+	uint32_t invalid;           // received datagrams that weren't valid CoAP
+	uint32_t rst_sent;          // RSTs sent for messages we didn't recognize
+	uint32_t error_timeout;     // ops failed, out of retransmits
+	uint32_t error_response;    // ops failed, non 2.xx response
+	uint32_t error_reset;       // ops failed, RST from the platform
+	uint32_t error_oversize;    // ops failed, payload larger than value_max
+	uint32_t error_activation;  // activations with a malformed CIK
+	uint32_t arena_compactions; // value arena ran out and was compacted
+	uint32_t reopens;           // udp_sock called again after PAL errors
+} exo_stats;
+
+// Histograms keep 2^EXO_HIST_SUB_BITS buckets per power of two, so any value
+// they report is within 1/2^EXO_HIST_SUB_BITS of what was recorded.
+#ifndef EXO_HIST_SUB_BITS
+#define EXO_HIST_SUB_BITS                       3
+#endif
+#define EXO_HIST_SUB_COUNT                      (1 << EXO_HIST_SUB_BITS)
+#define EXO_HIST_BUCKETS                        ((33 - EXO_HIST_SUB_BITS) * EXO_HIST_SUB_COUNT)
+
+typedef enum exo_hist_id
+{
+	EXO_HIST_READ,          // first send to ACK of reads, microseconds
+	EXO_HIST_WRITE,         // first send to ACK of writes, microseconds
+	EXO_HIST_SUBSCRIBE,     // observe request to ACK, including re-establishing
+	                        // after Max-Age ran out, microseconds
+	EXO_HIST_ACTIVATE,      // activation request to ACK, microseconds
+	EXO_HIST_RETRIES,       // retransmits an acknowledged request needed
+	EXO_HIST_COUNT,
+} exo_hist_id;
+
+/*!
+ * \brief Log-Linear Histogram
+ *
+ * Fixed size histogram of 32 bit values. Small values get a bucket each,
+ * larger ones share a bucket with values that differ by less than
+ * 1/EXO_HIST_SUB_COUNT. Use `exo_hist_percentile()` to query one.
+ */
+typedef struct exo_hist
+{
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint64_t sum;
+	uint32_t buckets[EXO_HIST_BUCKETS];
+} exo_hist;
+
+// Bytes of each datagram the flight recorder keeps, longer ones are cut.
+#ifndef EXO_RECORD_SNAPLEN
+#define EXO_RECORD_SNAPLEN                      128
+#endif
+
+typedef enum exo_record_dir
+{
+	EXO_RECORD_SENT,
+	EXO_RECORD_RECEIVED,
+} exo_record_dir;
+
+/*!
+ * \brief Flight Recorder Entry
+ *
+ * One datagram as seen by the library, see `exo_set_recorder()`.
+ */
+typedef struct exo_record
+{
+	uint64_t time;                          // PAL time, microseconds
+	uint16_t len;                           // length on the wire
+	uint8_t dir;                            // exo_record_dir
+	uint8_t buf[EXO_RECORD_SNAPLEN];
+} exo_record;
+
+/*!
+ * Called by `exo_dump_pcap()` with each piece of the capture, in order.
+ * Return 0 to go on, anything else stops the dump.
+ */
+typedef int (*exo_pcap_write)(void *arg, const void *buf, size_t len);
+
+#ifdef EXO_ENABLE_PROFILE
+typedef enum exo_phase
+{
+	EXO_PHASE_ACTIVATION,   // deciding whether to (re)activate
+	EXO_PHASE_RECV,         // draining and matching received datagrams
+	EXO_PHASE_ACTIVE,       // the pass over active ops, includes BUILD and SEND
+	EXO_PHASE_BUILD,        // building requests and ACKs
+	EXO_PHASE_SEND,         // PAL sends
+	EXO_PHASE_SCAN,         // final scans for the return value
+	EXO_PHASE_COUNT,
+} exo_phase;
+
+/*!
+ * \brief Phase Profile
+ *
+ * Time spent in each phase of `exo_operate()`, in ticks of
+ * EXO_PROFILE_CLOCK(), split by the type of op it was spent on. Phases that
+ * aren't about one op count under EXO_NULL. Only there when built with
+ * EXO_ENABLE_PROFILE, which the library and everything using it must agree
+ * on.
+ */
+typedef struct exo_profile
+{
+	uint64_t ticks[EXO_PHASE_COUNT][EXO_ACTIVATE + 1];
+	uint32_t calls[EXO_PHASE_COUNT][EXO_ACTIVATE + 1];
+	uint32_t operate_calls;
+} exo_profile;
+#endif
+
+// Longest alias and value a submission can carry, including the NUL.
+#ifndef EXO_SUBMIT_ALIAS_MAX
+#define EXO_SUBMIT_ALIAS_MAX                    32
+#endif
+#ifndef EXO_SUBMIT_VALUE_MAX
+#define EXO_SUBMIT_VALUE_MAX                    64
+#endif
+
+struct exo_context;
+struct exo_submission;
+
+/*!
+ * Called on the thread running `exo_operate()` when a submitted request has
+ * finished. For reads `sub->value` holds what was read. The submission is
+ * reused as soon as this returns, copy out anything you want to keep.
+ */
+typedef void (*exo_submit_done)(struct exo_context *ctx, struct exo_submission *sub,
+                                uint8_t success, void *arg);
+
+/*!
+ * Called on the submitting thread after every successful submission, e.g. to
+ * wake the thread running `exo_operate()`. Must not block.
+ */
+typedef void (*exo_submit_wake)(struct exo_context *ctx, void *arg);
+
+/*!
+ * \brief Submission Queue Slot
+ *
+ * Storage for one queued request, see `exo_set_submit_queue()`. Treat the
+ * members as private, except in a `exo_submit_done` callback.
+ */
+typedef struct exo_submission
+{
+	uint32_t seq;
+	uint8_t type;
+	uint8_t priority;
+	uint8_t state;
+	char alias[EXO_SUBMIT_ALIAS_MAX];
+	char value[EXO_SUBMIT_VALUE_MAX];
+	exo_submit_done done;
+	void *arg;
+} exo_submission;
+
+// Longest subscription value a snapshot keeps, including the NUL.
+#ifndef EXO_SNAPSHOT_VALUE_MAX
+#define EXO_SNAPSHOT_VALUE_MAX                  64
+#endif
+
+typedef struct exo_snapshot_buf
+{
+	uint32_t seq;                       // odd while being written
+	uint32_t obs_seq;
+	uint16_t len;
+	char value[EXO_SNAPSHOT_VALUE_MAX];
+} exo_snapshot_buf;
+
+/*!
+ * \brief Latest Value of a Subscription
+ *
+ * Attach one to a subscribe op with `exo_op_set_snapshot()` and every value
+ * received is published into it, readable from any thread with
+ * `exo_snapshot_read()`. Two buffers, each with its own sequence count: the
+ * receive path fills the one readers aren't being pointed at, then flips
+ * `version`, so it never waits and a reader only has to retry when two
+ * values arrive during its copy. Treat the members as private.
+ */
+typedef struct exo_snapshot
+{
+	uint32_t version;                   // values published, the latest is
+	                                    // in buf[version & 1]
+	exo_snapshot_buf buf[2];
+} exo_snapshot;
+
+/*!
+ * \brief Value Arena
+ *
+ * Optional memory, given to a context with `exo_set_value_arena()`, that
+ * reads and subscribes queued without a buffer take their values from. Each
+ * value is allocated at its exact size, tagged with a generation that its op
+ * remembers. A value replaced by a newer one no longer matches its op, and
+ * when the arena is full those are dropped and the rest slid together. Treat
+ * the members as private.
+ */
+typedef struct exo_value_arena
+{
+	uint8_t *buf;
+	size_t size;
+	size_t used;                        // bump pointer
+	uint32_t gen;                       // last generation handed out
+} exo_value_arena;
+
+/*!
+ * \brief Request
+ *
+ * What the scans in `exo_operate()` touch on every op comes first and fits
+ * in the first 40 bytes, the rest is only read when the op is sent, answered
+ * or bound. 96 bytes on 64 bit targets. `type` holds an `exo_request_type`, `state` an
+ * `exo_request_state`.
+ */
 typedef struct exo_op
 {
-	exo_request_type type;
-	exo_request_state state;
-	const char * alias;
-	char * value;
-	size_t value_max;
+	// hot
+	uint8_t state;
+	uint8_t type;
+	uint8_t tkl;
+	uint8_t retries;
 	uint16_t mid;
 	uint32_t obs_seq;
-	uint8_t tkl;
+	uint32_t value_gen;                 // arena allocation value points at,
+	                                    // cold but fills the padding here
 	uint64_t token;
 	uint64_t timeout;
-	uint8_t retries;
+	struct exo_op *next;                // list links, owned by the library
+	// cold
+	struct exo_op *prev;
+	uint64_t sent_at;
+	const char * alias;
+	char * value;
+	size_t value_max;                   // 0 on reads and subscribes: value
+	                                    // comes from the context's arena
+	exo_submission *sub;
+	exo_snapshot *snapshot;
 } exo_op;
 
+/*!
+ * \brief Op Pool
+ *
+ * Ops carved out of memory you provide with `exo_pool_init()`, handed out
+ * with `exo_op_acquire()` and given back with `exo_op_release()`, both O(1).
+ * `exo_operate_pool()` only visits the ops that are acquired. Treat the
+ * members as private.
+ */
+typedef struct exo_pool
+{
+	exo_op *free;                       // singly linked through next
+	exo_op *live;                       // doubly linked
+	size_t capacity;
+	size_t live_count;
+} exo_pool;
+
+// Arena size that holds n ops whatever its alignment.
+#define EXO_POOL_ARENA_SIZE(n)                  ((n) * sizeof(exo_op) + sizeof(uint64_t))
+
+/*!
+ * \brief Library Context
+ *
+ * Holds everything the library knows about one device. You have to hold the
+ * memory for it, it is filled in by `exo_init()`. Treat the members as
+ * private.
+ */
+typedef struct exo_context
+{
+	const exo_pal_ops *pal;
+	void *pal_data;
+	char cik[CIK_LENGTH + 1];
+	const char *vendor;
+	const char *model;
+	const char *serial;
+	uint16_t message_id_counter;
+	uint32_t rng;
+	uint64_t now;                            // PAL time at the start of this
+	                                         // exo_operate(), microseconds
+	exo_device_state device_state;
+	uint8_t pal_errors;                      // PAL send and receive errors in a row
+	uint64_t reopen_at;                      // PAL time udp_sock may run again
+	exo_stats stats;
+	exo_hist hist[EXO_HIST_COUNT];
+	exo_record *records;
+	size_t record_count;
+	size_t record_head;                      // next slot to write
+	size_t record_used;
+#ifdef EXO_ENABLE_PROFILE
+	exo_profile profile;
+#endif
+	exo_submission *subs;
+	uint32_t sub_mask;
+	uint32_t sub_enqueue;                    // shared by all producers
+	uint32_t sub_dequeue;                    // the rest only by exo_operate()
+	uint32_t sub_release;
+	exo_submit_wake sub_wake;
+	void *sub_wake_arg;
+	exo_value_arena arena;
+	exo_op activation;
+} exo_context;
+
 // PUBLIC FUNCTIONS
-exo_error exo_init(const char * vendor, const char *model, const char *sn);
+exo_error exo_init(exo_context *ctx, const exo_pal_ops *pal, void *pal_data,
+                   const char * vendor, const char *model, const char *sn);
 
 void exo_write(exo_op *op, const char * alias, const char * value);
 void exo_read(exo_op *op, const char * alias, char * value, const size_t value_max);
@@ -124,6 +442,8 @@ void exo_subscribe(exo_op *op, const char * alias, char * value, const size_t va
 
 void exo_op_init(exo_op *op);
 void exo_op_done(exo_op *op);
+void exo_op_set_snapshot(exo_op *op, exo_snapshot *snapshot);
+uint32_t exo_snapshot_read(const exo_snapshot *snapshot, char *value, size_t size, uint32_t *obs_seq);
 
 uint8_t exo_is_op_valid(exo_op *op);
 uint8_t exo_is_op_success(exo_op *op);
@@ -132,7 +452,46 @@ uint8_t exo_is_op_read(exo_op *op);
 uint8_t exo_is_op_subscribe(exo_op *op);
 uint8_t exo_is_op_write(exo_op *op);
 
-exo_state exo_operate(exo_op * ops, uint8_t count);
+exo_state exo_operate(exo_context *ctx, exo_op * ops, size_t count);
+
+size_t exo_pool_init(exo_pool *pool, void *arena, size_t size);
+exo_op *exo_op_acquire(exo_pool *pool);
+void exo_op_release(exo_pool *pool, exo_op *op);
+exo_state exo_operate_pool(exo_context *ctx, exo_pool *pool);
+
+exo_error exo_set_value_arena(exo_context *ctx, void *buf, size_t size);
+
+exo_error exo_save_state(exo_context *ctx, exo_op *ops, size_t count,
+                         uint8_t *buf, size_t size, size_t *len);
+exo_error exo_restore_state(exo_context *ctx, exo_op *ops, size_t count,
+                            const uint8_t *buf, size_t len);
+exo_error exo_save_state_pool(exo_context *ctx, exo_pool *pool,
+                              uint8_t *buf, size_t size, size_t *len);
+exo_error exo_restore_state_pool(exo_context *ctx, exo_pool *pool,
+                                 const uint8_t *buf, size_t len);
+
+void exo_get_stats(exo_context *ctx, exo_stats *stats);
+void exo_get_hist(exo_context *ctx, exo_hist_id id, exo_hist *hist);
+void exo_reset_hist(exo_context *ctx, exo_hist_id id);
+
+void exo_hist_record(exo_hist *hist, uint32_t value);
+uint32_t exo_hist_percentile(const exo_hist *hist, double percentile);
+
+void exo_set_recorder(exo_context *ctx, exo_record *records, size_t count);
+exo_error exo_dump_pcap(exo_context *ctx, exo_pcap_write write, void *arg);
+
+exo_error exo_set_submit_queue(exo_context *ctx, exo_submission *slots, size_t count);
+exo_error exo_submit_write(exo_context *ctx, const char *alias, const char *value,
+                           uint8_t priority, exo_submit_done done, void *arg);
+exo_error exo_submit_read(exo_context *ctx, const char *alias,
+                          uint8_t priority, exo_submit_done done, void *arg);
+void exo_set_submit_wake(exo_context *ctx, exo_submit_wake wake, void *arg);
+
+#ifdef EXO_ENABLE_PROFILE
+void exo_get_profile(exo_context *ctx, exo_profile *profile);
+void exo_reset_profile(exo_context *ctx);
+size_t exo_format_profile(const exo_profile *profile, char *buf, size_t size);
+#endif
 
 
 #endif
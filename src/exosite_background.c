@@ -0,0 +1,377 @@
+/*****************************************************************************
+*
+*  exosite_background.c - Background I/O thread for the Exosite library
+*  Copyright (C) 2015 Exosite LLC
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*    Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+*
+*    Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the
+*    distribution.
+*
+*    Neither the name of Texas Instruments Incorporated nor the names of
+*    its contributors may be used to endorse or promote products derived
+*    from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+*  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+*  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+*  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+*  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+*  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+*  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+*  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+*  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*****************************************************************************/
+
+/*
+ * Runs exo_operate() on a thread of its own so the application doesn't have
+ * to own a polling loop. Linux only, it sleeps in epoll on the PAL's socket
+ * (see `udp_fd` in exo_pal_ops) and an eventfd that submitters signal. PALs
+ * without a socket to wait on are polled every EXO_BACKGROUND_POLL_MS while
+ * requests are outstanding.
+ *
+ * Submitters only touch the eventfd when the I/O thread said it is about to
+ * sleep, so a burst of submissions costs one syscall, not one each. Before
+ * sleeping the I/O thread announces it and then looks at the submit queue
+ * once more; both sides use sequentially consistent operations so at least
+ * one of them sees the other.
+ */
+
+#include "exosite_background.h"
+
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+static void exo_background_signal(int fd, uint64_t n)
+{
+  ssize_t rv = write(fd, &n, sizeof(n));
+  (void)rv;   // only fails if the counter would overflow, it's awake then
+}
+
+static void exo_background_drain(int fd)
+{
+  uint64_t n;
+  ssize_t rv = read(fd, &n, sizeof(n));
+  (void)rv;
+}
+
+// exo_submit_wake, runs on the submitting thread
+static void exo_background_wake(exo_context *ctx, void *arg)
+{
+  exo_background *bg = arg;
+
+  if (__atomic_exchange_n(&bg->sleeping, 0, __ATOMIC_SEQ_CST))
+    exo_background_signal(bg->wake_fd, 1);
+}
+
+// exo_submit_done, runs on the I/O thread
+static void exo_background_done(exo_context *ctx, exo_submission *sub, uint8_t success, void *arg)
+{
+  exo_background *bg = ctx->sub_wake_arg;
+  uint32_t pos = bg->done_enqueue;
+  exo_completion *c = &bg->done[pos & bg->done_mask];
+
+  if (__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) != pos) {
+    __atomic_fetch_add(&bg->lost, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  c->type = sub->type;
+  c->success = success;
+  memcpy(c->alias, sub->alias, sizeof(c->alias));
+  memcpy(c->value, sub->value, sizeof(c->value));
+  c->arg = arg;
+
+  __atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+  bg->done_enqueue = pos + 1;
+}
+
+// Keeps the PAL's descriptor in the epoll set, it may change on reconnect.
+// A new socket often gets the number of the one closed before it, which epoll
+// has already forgotten, so every reopen registers it again.
+static void exo_background_watch(exo_background *bg)
+{
+  const exo_pal_ops *pal = bg->ctx->pal;
+  struct epoll_event ev;
+  int fd = pal->udp_fd != NULL ? pal->udp_fd(bg->ctx->pal_data) : -1;
+
+  if (fd == bg->sock_fd && bg->ctx->stats.reopens == bg->reopens)
+    return;
+
+  if (bg->sock_fd != -1)
+    epoll_ctl(bg->epoll_fd, EPOLL_CTL_DEL, bg->sock_fd, NULL);
+
+  bg->sock_fd = -1;
+  bg->reopens = bg->ctx->stats.reopens;
+  if (fd == -1)
+    return;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  if (epoll_ctl(bg->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0)
+    bg->sock_fd = fd;
+}
+
+// milliseconds until the earliest op deadline, capped
+static int exo_background_timeout(exo_background *bg)
+{
+  exo_context *ctx = bg->ctx;
+  uint64_t now = ctx->pal->get_time(ctx->pal_data);
+  uint64_t next = now + EXO_BACKGROUND_MAX_WAIT_MS * 1000ULL;
+  size_t i;
+
+  if (ctx->device_state != EXO_STATE_GOOD && ctx->activation.timeout < next)
+    next = ctx->activation.timeout;
+
+  for (i = 0; i < bg->count; i++) {
+    if ((bg->ops[i].state == EXO_REQUEST_PENDING || bg->ops[i].state == EXO_REQUEST_SUBSCRIBED) &&
+        bg->ops[i].timeout < next)
+      next = bg->ops[i].timeout;
+  }
+
+  return next <= now ? 0 : (int)((next - now + 999) / 1000);
+}
+
+static void *exo_background_run(void *arg)
+{
+  exo_background *bg = arg;
+  exo_context *ctx = bg->ctx;
+  struct epoll_event ev[2];
+  uint32_t completed;
+  exo_state state;
+  int timeout, n, i;
+
+  while (!__atomic_load_n(&bg->stop, __ATOMIC_ACQUIRE)) {
+    completed = bg->done_enqueue;
+    state = exo_operate(ctx, bg->ops, bg->count);
+    if (bg->done_enqueue != completed)
+      exo_background_signal(bg->done_fd, bg->done_enqueue - completed);
+
+    exo_background_watch(bg);
+    timeout = state == EXO_BUSY ? 0 : exo_background_timeout(bg);
+    if (state != EXO_IDLE && bg->sock_fd == -1 && timeout > EXO_BACKGROUND_POLL_MS)
+      timeout = EXO_BACKGROUND_POLL_MS;
+
+    __atomic_store_n(&bg->sleeping, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ctx->sub_enqueue, __ATOMIC_SEQ_CST) != ctx->sub_dequeue)
+      timeout = 0;
+
+    n = timeout != 0 ? epoll_wait(bg->epoll_fd, ev, 2, timeout) : 0;
+    __atomic_store_n(&bg->sleeping, 0, __ATOMIC_SEQ_CST);
+
+    for (i = 0; i < n; i++) {
+      if (ev[i].data.fd == bg->wake_fd)
+        exo_background_drain(bg->wake_fd);
+    }
+  }
+
+  return NULL;
+}
+
+/*!
+ * \brief Starts a thread that runs `exo_operate()` for you
+ *
+ * The thread owns ctx and ops until `exo_stop_background()`, don't touch
+ * either in the meantime except through the submit and background calls.
+ * ctx needs a submit queue (`exo_set_submit_queue()`) and ops room for the
+ * requests. The thread sleeps until the PAL's socket is readable, something
+ * is submitted or an op times out.
+ *
+ * \param[out] bg                Background thread state, you hold the memory
+ * \param[in]  ctx               Initialized context with a submit queue
+ * \param[in]  ops               Ops the thread passes to `exo_operate()`
+ * \param[in]  count             Number of ops
+ * \param[in]  completions       Storage for the completion queue
+ * \param[in]  completion_count  Number of completions, a power of two
+ *
+ * \return EXO_OK, EXO_GENERAL_ERROR if something is missing or a descriptor
+ *         or the thread couldn't be created
+ */
+exo_error exo_start_background(exo_background *bg, exo_context *ctx, exo_op *ops, size_t count,
+                               exo_completion *completions, size_t completion_count)
+{
+  struct epoll_event ev;
+  size_t i;
+
+  if (ctx->subs == NULL || count == 0 || completions == NULL || completion_count == 0 ||
+      (completion_count & (completion_count - 1)) != 0 || completion_count > 0x80000000UL)
+    return EXO_GENERAL_ERROR;
+
+  memset(bg, 0, sizeof(*bg));
+  bg->ctx = ctx;
+  bg->ops = ops;
+  bg->count = count;
+  bg->done = completions;
+  bg->done_mask = completion_count - 1;
+  bg->sock_fd = -1;
+
+  for (i = 0; i < completion_count; i++)
+    completions[i].seq = i;
+
+  bg->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  bg->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  bg->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = bg->wake_fd;
+
+  if (bg->epoll_fd == -1 || bg->wake_fd == -1 || bg->done_fd == -1 ||
+      epoll_ctl(bg->epoll_fd, EPOLL_CTL_ADD, bg->wake_fd, &ev) != 0)
+    goto fail;
+
+  exo_set_submit_wake(ctx, exo_background_wake, bg);
+
+  if (pthread_create(&bg->thread, NULL, exo_background_run, bg) != 0) {
+    exo_set_submit_wake(ctx, NULL, NULL);
+    goto fail;
+  }
+
+  return EXO_OK;
+
+fail:
+  if (bg->epoll_fd != -1)
+    close(bg->epoll_fd);
+  if (bg->wake_fd != -1)
+    close(bg->wake_fd);
+  if (bg->done_fd != -1)
+    close(bg->done_fd);
+  return EXO_GENERAL_ERROR;
+}
+
+/*!
+ * \brief Stops the background thread and waits for it
+ *
+ * Requests still queued or in flight are left where they are, calling
+ * `exo_operate()` or `exo_start_background()` again carries on with them.
+ * Stop submitting from other threads first.
+ *
+ * \param[in] bg  Running background thread
+ */
+void exo_stop_background(exo_background *bg)
+{
+  __atomic_store_n(&bg->stop, 1, __ATOMIC_RELEASE);
+  exo_background_signal(bg->wake_fd, 1);
+  pthread_join(bg->thread, NULL);
+
+  exo_set_submit_wake(bg->ctx, NULL, NULL);
+
+  close(bg->epoll_fd);
+  close(bg->wake_fd);
+  close(bg->done_fd);
+}
+
+/*!
+ * \brief Queues a write for the background thread, from any thread
+ *
+ * \param[in] bg        Running background thread
+ * \param[in] alias     Alias of dataport to write to, copied
+ * \param[in] value     Value to write, copied
+ * \param[in] priority  Higher priority requests get free ops first
+ * \param[in] arg       Handed back in the completion
+ *
+ * \return as `exo_submit_write()`
+ */
+exo_error exo_background_write(exo_background *bg, const char *alias, const char *value,
+                               uint8_t priority, void *arg)
+{
+  return exo_submit_write(bg->ctx, alias, value, priority, exo_background_done, arg);
+}
+
+/*!
+ * \brief Queues a read for the background thread, from any thread
+ *
+ * Same as `exo_background_write()`, the value read is in the completion.
+ */
+exo_error exo_background_read(exo_background *bg, const char *alias, uint8_t priority, void *arg)
+{
+  return exo_submit_read(bg->ctx, alias, priority, exo_background_done, arg);
+}
+
+/*!
+ * \brief Takes the oldest finished request, from any thread
+ *
+ * Never blocks, any number of threads may take at once.
+ *
+ * \param[in]  bg          Running background thread
+ * \param[out] completion  Copy of the finished request
+ *
+ * \return 1 if there was one, else 0
+ */
+uint8_t exo_background_take(exo_background *bg, exo_completion *completion)
+{
+  uint32_t pos = __atomic_load_n(&bg->done_dequeue, __ATOMIC_RELAXED), seq;
+  exo_completion *c;
+
+  for (;;) {
+    c = &bg->done[pos & bg->done_mask];
+    seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+
+    if (seq == pos + 1) {
+      if (__atomic_compare_exchange_n(&bg->done_dequeue, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if ((int32_t)(seq - (pos + 1)) < 0) {
+      return 0;
+    } else {
+      pos = __atomic_load_n(&bg->done_dequeue, __ATOMIC_RELAXED);
+    }
+  }
+
+  *completion = *c;
+  completion->seq = pos;
+  __atomic_store_n(&c->seq, pos + bg->done_mask + 1, __ATOMIC_RELEASE);
+
+  return 1;
+}
+
+/*!
+ * \brief Waits until a request may have finished
+ *
+ * Returns right away if one is waiting, follow it with
+ * `exo_background_take()` until that returns 0.
+ *
+ * \param[in] bg          Running background thread
+ * \param[in] timeout_ms  Longest to wait, -1 for no limit
+ *
+ * \return 1 if there may be a completion, 0 on timeout
+ */
+uint8_t exo_background_wait(exo_background *bg, int timeout_ms)
+{
+  uint32_t pos = __atomic_load_n(&bg->done_dequeue, __ATOMIC_RELAXED);
+  struct pollfd pfd = {bg->done_fd, POLLIN, 0};
+
+  if (__atomic_load_n(&bg->done[pos & bg->done_mask].seq, __ATOMIC_ACQUIRE) == pos + 1)
+    return 1;
+
+  if (poll(&pfd, 1, timeout_ms) <= 0)
+    return 0;
+
+  exo_background_drain(bg->done_fd);
+
+  return 1;
+}
+
+/*!
+ * \brief Number of completions dropped because nobody took them in time
+ *
+ * \param[in] bg  Background thread
+ */
+uint32_t exo_background_lost(exo_background *bg)
+{
+  return __atomic_load_n(&bg->lost, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,108 @@
+/*****************************************************************************
+*
+*  exosite_background.h - Background I/O thread for the Exosite library
+*  Copyright (C) 2015 Exosite LLC
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*    Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+*
+*    Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the
+*    distribution.
+*
+*    Neither the name of Texas Instruments Incorporated nor the names of
+*    its contributors may be used to endorse or promote products derived
+*    from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+*  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+*  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+*  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+*  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+*  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+*  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+*  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+*  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*****************************************************************************/
+
+#ifndef EXOSITE_BACKGROUND_H
+#define EXOSITE_BACKGROUND_H
+
+#include <pthread.h>
+
+#include "exosite.h"
+
+// Longest the I/O thread sleeps without being woken, milliseconds.
+#ifndef EXO_BACKGROUND_MAX_WAIT_MS
+#define EXO_BACKGROUND_MAX_WAIT_MS              1000
+#endif
+
+// How often it looks for datagrams while requests are outstanding when the
+// PAL has no descriptor to wait on, milliseconds.
+#ifndef EXO_BACKGROUND_POLL_MS
+#define EXO_BACKGROUND_POLL_MS                  10
+#endif
+
+/*!
+ * \brief Finished Request
+ *
+ * What `exo_background_take()` hands back for each request queued with
+ * `exo_background_write()` or `exo_background_read()`.
+ */
+typedef struct exo_completion
+{
+	uint32_t seq;
+	uint8_t type;                       // EXO_WRITE or EXO_READ
+	uint8_t success;
+	char alias[EXO_SUBMIT_ALIAS_MAX];
+	char value[EXO_SUBMIT_VALUE_MAX];   // what was read, or written
+	void *arg;
+} exo_completion;
+
+/*!
+ * \brief Background I/O Thread
+ *
+ * Filled in by `exo_start_background()`, you hold the memory. Treat the
+ * members as private.
+ */
+typedef struct exo_background
+{
+	exo_context *ctx;
+	exo_op *ops;
+	size_t count;
+	exo_completion *done;
+	uint32_t done_mask;
+	uint32_t done_enqueue;              // only the I/O thread
+	uint32_t done_dequeue;              // shared by all consumers
+	uint32_t lost;                      // completions dropped, queue was full
+	uint8_t sleeping;                   // I/O thread is in or near epoll_wait()
+	uint8_t stop;
+	int epoll_fd;
+	int wake_fd;                        // eventfd, producers to the I/O thread
+	int done_fd;                        // eventfd, the I/O thread to consumers
+	int sock_fd;                        // PAL descriptor currently registered
+	uint32_t reopens;                   // ctx->stats.reopens when it was
+	pthread_t thread;
+} exo_background;
+
+exo_error exo_start_background(exo_background *bg, exo_context *ctx, exo_op *ops, size_t count,
+                               exo_completion *completions, size_t completion_count);
+void exo_stop_background(exo_background *bg);
+
+exo_error exo_background_write(exo_background *bg, const char *alias, const char *value,
+                               uint8_t priority, void *arg);
+exo_error exo_background_read(exo_background *bg, const char *alias, uint8_t priority, void *arg);
+
+uint8_t exo_background_take(exo_background *bg, exo_completion *completion);
+uint8_t exo_background_wait(exo_background *bg, int timeout_ms);
+uint32_t exo_background_lost(exo_background *bg);
+
+#endif
@@ -0,0 +1,87 @@
+/*****************************************************************************
+*
+*  exosite_trace.h - Static tracepoints
+*  Copyright (C) 2015 Exosite LLC
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*    Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+*
+*    Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the
+*    distribution.
+*
+*    Neither the name of Texas Instruments Incorporated nor the names of
+*    its contributors may be used to endorse or promote products derived
+*    from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+*  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+*  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+*  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+*  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+*  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+*  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+*  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+*  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*****************************************************************************/
+
+#ifndef EXOSITE_TRACE_H
+#define EXOSITE_TRACE_H
+
+/*
+ * Static tracepoints under the `exosite` provider. Build with
+ * -DEXO_ENABLE_SDT (needs <sys/sdt.h>, from systemtap-sdt-dev or
+ * systemtap-sdt-devel) and they become USDT probes that bpftrace, perf and
+ * SystemTap can attach to, each a single nop until someone does. Without it
+ * they compile to nothing and their arguments aren't evaluated.
+ *
+ * Probes and their arguments:
+ *
+ *   operate__entry(ctx, count)         exo_operate() called
+ *   operate__return(ctx, exo_state)    exo_operate() returning
+ *   op__state(op, type, old, new)      op moved between exo_request_states
+ *   pdu__build(code, mid, len)         request, ACK or RST built
+ *   pdu__send(buf, len, ret)           datagram handed to the PAL, ret 0 if sent
+ *   pdu__recv(buf, len)                datagram received from the PAL
+ *   pdu__invalid(buf, len)             received datagram isn't valid CoAP
+ *   pdu__match(op, mid)                received datagram belongs to op
+ *   pdu__rst(mid)                      CON nobody was waiting for, RST sent
+ *   pal__resolve__entry(host, port)    PAL looking up the server
+ *   pal__resolve__return(ret)
+ *   pal__send__entry(len)              PAL send syscall
+ *   pal__send__return(ret)             bytes sent or -1
+ *   pal__recv__entry(size)             PAL receive syscall
+ *   pal__recv__return(ret)             bytes received or -1
+ *
+ * e.g. bpftrace -e 'usdt:./posixsubscribe:exosite:op__state { @[arg2, arg3] = count(); }'
+ */
+
+#ifdef EXO_ENABLE_SDT
+
+#include <sys/sdt.h>
+
+#define EXO_TRACE0(name)                        DTRACE_PROBE(exosite, name)
+#define EXO_TRACE1(name, a)                     DTRACE_PROBE1(exosite, name, a)
+#define EXO_TRACE2(name, a, b)                  DTRACE_PROBE2(exosite, name, a, b)
+#define EXO_TRACE3(name, a, b, c)               DTRACE_PROBE3(exosite, name, a, b, c)
+#define EXO_TRACE4(name, a, b, c, d)            DTRACE_PROBE4(exosite, name, a, b, c, d)
+
+#else
+
+#define EXO_TRACE0(name)                        do {} while (0)
+#define EXO_TRACE1(name, a)                     do {} while (0)
+#define EXO_TRACE2(name, a, b)                  do {} while (0)
+#define EXO_TRACE3(name, a, b, c)               do {} while (0)
+#define EXO_TRACE4(name, a, b, c, d)            do {} while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,349 @@
+/*****************************************************************************
+*
+*  Copyright (C) 2015 Exosite LLC
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*    Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+*
+*    Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the
+*    distribution.
+*
+*    Neither the name of Texas Instruments Incorporated nor the names of
+*    its contributors may be used to endorse or promote products derived
+*    from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+*  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+*  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+*  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+*  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+*  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+*  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+*  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+*  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*****************************************************************************/
+
+/*
+ * Op engine benchmarks
+ *
+ * Drives exo_operate() through the loopback PAL against a peer that answers
+ * every request on the spot, so only the library is measured. Reports:
+ *
+ *   throughput/<type>   completed ops per second, batches of BATCH ops
+ *   idle_poll           CPU ns per exo_operate() with N subscriptions idle
+ *   dispatch_p50/p99    CPU ns to deliver one notification to the last of N
+ *                       subscriptions
+ *
+ * Built with EXO_ENABLE_PROFILE the library's phase profile of each benchmark
+ * is printed to stderr as well.
+ *
+ * Usage: bench [-f csv|json] [-m max_ops]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "exosite.h"
+#include "exosite_pal.h"
+#include "coap.h"
+
+#define MAX_OPS         100000
+#define SUBSCRIBE_BATCH 8192    // stays below the loopback queue length
+#define BATCH           64
+#define RUN_NS          500000000ULL
+#define DISPATCH_RUNS   1000
+
+static const char BENCH_CIK[] = "a32c85ba9dda45823be416246cf8b433baa068d7";
+
+static exo_context ctx;
+static exopal_loopback lb;
+static exo_op ops[MAX_OPS + 1];
+static char values[MAX_OPS + 1][16];
+static uint64_t samples[DISPATCH_RUNS];
+static uint32_t first_with[0x10000];
+
+static int json;
+static int rows;
+
+static uint64_t wall_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t cpu_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void report(const char *name, size_t op_count, double value, const char *unit)
+{
+#ifdef EXO_ENABLE_PROFILE
+	static char text[2048];
+	exo_profile profile;
+
+	exo_get_profile(&ctx, &profile);
+	exo_format_profile(&profile, text, sizeof(text));
+	fprintf(stderr, "%s/%zu\n%s\n", name, op_count, text);
+	exo_reset_profile(&ctx);
+#endif
+
+	if (json) {
+		printf("%s\n  {\"benchmark\": \"%s\", \"ops\": %zu, \"value\": %.1f, \"unit\": \"%s\"}",
+		       rows == 0 ? "[" : ",", name, op_count, value, unit);
+	} else {
+		if (rows == 0)
+			printf("benchmark,ops,value,unit\n");
+		printf("%s,%zu,%.1f,%s\n", name, op_count, value, unit);
+	}
+
+	rows++;
+	fflush(stdout);
+}
+
+// Answers every confirmable request with a piggybacked success response.
+static void bench_peer(exopal_loopback *l, const uint8_t *buf, size_t len, void *peer_data)
+{
+	uint8_t rsp_buf[64];
+	coap_pdu req = {(uint8_t *)buf, len, len};
+	coap_pdu rsp = {rsp_buf, 0, sizeof(rsp_buf)};
+	coap_option opt;
+	uint8_t seq = 1, max_age = 255;
+
+	if (coap_get_type(&req) != CT_CON || coap_get_code(&req) == CC_EMPTY)
+		return;
+
+	coap_init_pdu(&rsp);
+	coap_set_version(&rsp, COAP_V1);
+	coap_set_type(&rsp, CT_ACK);
+	coap_set_mid(&rsp, coap_get_mid(&req));
+	coap_set_token(&rsp, coap_get_token(&req), coap_get_tkl(&req));
+
+	if (coap_get_code(&req) == CC_POST) {
+		opt = coap_get_option_by_num(&req, CON_URI_PATH, 0);
+		if (opt.len == 9) { // provision
+			coap_set_code(&rsp, CC_CONTENT);
+			coap_set_payload(&rsp, (uint8_t *)BENCH_CIK, CIK_LENGTH);
+		} else {
+			coap_set_code(&rsp, CC_CHANGED);
+		}
+	} else {
+		coap_set_code(&rsp, CC_CONTENT);
+		if (coap_get_option_by_num(&req, CON_OBSERVE, 0).num != 0)
+			coap_add_option(&rsp, CON_OBSERVE, &seq, 1);
+		coap_add_option(&rsp, CON_MAX_AGE, &max_age, 1);
+		coap_set_payload(&rsp, (uint8_t *)"21.5", 4);
+	}
+
+	exopal_loopback_inject(l, rsp.buf, rsp.len);
+}
+
+static void run_until_idle(size_t count)
+{
+	int i;
+
+	for (i = 0; i < 1000; i++) {
+		if (exo_operate(&ctx, ops, count) == EXO_IDLE)
+			return;
+	}
+
+	fprintf(stderr, "operate never went idle\n");
+	exit(1);
+}
+
+static void setup(void)
+{
+	memset(&lb, 0, sizeof(lb));
+	lb.peer = bench_peer;
+	exopal_loopback_set_cik(&lb, BENCH_CIK);
+
+	if (exo_init(&ctx, &exopal_loopback_ops, &lb, "vendor", "model", "bench") != EXO_OK) {
+		fprintf(stderr, "exo_init failed\n");
+		exit(1);
+	}
+
+	for (size_t i = 0; i <= MAX_OPS; i++)
+		exo_op_init(&ops[i]);
+
+	// get activation out of the way
+	run_until_idle(1);
+}
+
+static void bench_throughput(const char *name, exo_request_type type)
+{
+	uint64_t start = wall_ns(), elapsed, completed = 0;
+
+	do {
+		for (size_t i = 1; i <= BATCH; i++) {
+			exo_op_init(&ops[i]);
+			switch (type) {
+				case EXO_WRITE:
+					exo_write(&ops[i], "uptime", "1234");
+					break;
+				case EXO_READ:
+					exo_read(&ops[i], "temp", values[i], sizeof(values[i]));
+					break;
+				default:
+					exo_subscribe(&ops[i], "setpoint", values[i], sizeof(values[i]));
+					break;
+			}
+		}
+
+		run_until_idle(BATCH + 1);
+
+		for (size_t i = 1; i <= BATCH; i++) {
+			if (exo_is_op_success(&ops[i]))
+				completed++;
+			exo_op_init(&ops[i]);
+		}
+
+		elapsed = wall_ns() - start;
+	} while (elapsed < RUN_NS);
+
+	report(name, BATCH, completed * 1e9 / elapsed, "ops/s");
+}
+
+static void subscribe_all(size_t n)
+{
+	for (size_t i = 1; i <= n; i++)
+		exo_op_init(&ops[i]);
+
+	for (size_t first = 1, last; first <= n; first = last + 1) {
+		last = first + SUBSCRIBE_BATCH - 1 < n ? first + SUBSCRIBE_BATCH - 1 : n;
+		for (size_t i = first; i <= last; i++)
+			exo_subscribe(&ops[i], "setpoint", values[i], sizeof(values[i]));
+
+		run_until_idle(last + 1);
+
+		for (size_t i = first; i <= last; i++)
+			exo_op_done(&ops[i]);
+	}
+}
+
+static void bench_idle_poll(size_t n)
+{
+	uint64_t polls = 0, start, elapsed;
+
+	subscribe_all(n);
+
+	start = cpu_ns();
+	do {
+		for (int k = 0; k < 64; k++)
+			exo_operate(&ctx, ops, n + 1);
+		polls += 64;
+		elapsed = cpu_ns() - start;
+	} while (elapsed < RUN_NS / 4);
+
+	report("idle_poll", n, (double)elapsed / polls, "ns/poll");
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void bench_dispatch(size_t n)
+{
+	uint8_t buf[64];
+	coap_pdu pdu = {buf, 0, sizeof(buf)};
+	exo_op *target = NULL;
+	uint8_t max_age = 255;
+	uint16_t seq;
+	uint64_t start;
+
+	subscribe_all(n);
+
+	// tokens are random 16 bit values, aim at the last subscription whose
+	// token no subscription before it has
+	memset(first_with, 0, sizeof(first_with));
+	for (size_t i = 1; i <= n; i++) {
+		if (first_with[ops[i].token & 0xFFFF] == 0)
+			first_with[ops[i].token & 0xFFFF] = i;
+	}
+	for (size_t i = n; target == NULL; i--) {
+		if (first_with[ops[i].token & 0xFFFF] == i)
+			target = &ops[i];
+	}
+
+	for (int r = 0; r < DISPATCH_RUNS; r++) {
+		seq = r + 2;
+		coap_init_pdu(&pdu);
+		coap_set_version(&pdu, COAP_V1);
+		coap_set_type(&pdu, CT_CON);
+		coap_set_code(&pdu, CC_CONTENT);
+		coap_set_mid(&pdu, 0x8000 + r);
+		coap_set_token(&pdu, target->token, 2);
+		coap_add_option(&pdu, CON_OBSERVE, (uint8_t[]){seq >> 8, seq & 0xFF}, 2);
+		coap_add_option(&pdu, CON_MAX_AGE, &max_age, 1);
+		coap_set_payload(&pdu, (uint8_t *)"22.0", 4);
+
+		exopal_loopback_inject(&lb, pdu.buf, pdu.len);
+
+		start = cpu_ns();
+		exo_operate(&ctx, ops, n + 1);
+		samples[r] = cpu_ns() - start;
+
+		if (!exo_is_op_success(target)) {
+			fprintf(stderr, "notification was not delivered\n");
+			exit(1);
+		}
+		exo_op_done(target);
+	}
+
+	qsort(samples, DISPATCH_RUNS, sizeof(samples[0]), cmp_u64);
+	report("dispatch_p50", n, samples[DISPATCH_RUNS / 2], "ns");
+	report("dispatch_p99", n, samples[DISPATCH_RUNS * 99 / 100], "ns");
+}
+
+int main(int argc, char **argv)
+{
+	static const size_t scales[] = {1, 10, 100, 1000, 10000, 100000};
+	size_t max_ops = MAX_OPS;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "f:m:")) != -1) {
+		switch (opt) {
+			case 'f': json = strcmp(optarg, "json") == 0; break;
+			case 'm': max_ops = strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "usage: %s [-f csv|json] [-m max_ops]\n", argv[0]);
+				return 2;
+		}
+	}
+
+	if (max_ops > MAX_OPS)
+		max_ops = MAX_OPS;
+
+	setup();
+
+	bench_throughput("throughput/write", EXO_WRITE);
+	bench_throughput("throughput/read", EXO_READ);
+	bench_throughput("throughput/subscribe", EXO_SUBSCRIBE);
+
+	for (size_t i = 0; i < sizeof(scales) / sizeof(scales[0]) && scales[i] <= max_ops; i++)
+		bench_idle_poll(scales[i]);
+
+	for (size_t i = 0; i < sizeof(scales) / sizeof(scales[0]) && scales[i] <= max_ops; i++)
+		bench_dispatch(scales[i]);
+
+	if (json)
+		printf("\n]\n");
+
+	return 0;
+}
@@ -1,15 +1,1339 @@
 #include <stdarg.h>
 #include <stddef.h>
 #include <setjmp.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 #include <cmocka.h>
-/* A test case that does nothing and succeeds. */
-static void null_test_success(void **state) {
+
+#include "exosite.h"
+#include "exosite_pal.h"
+#include "../pal/posix/exosite_pal.h"
+#include "exosite_background.h"
+#include "coap.h"
+#include "mockserver.h"
+#include "exosim.h"
+
+static const char TEST_CIK[] = "a32c85ba9dda45823be416246cf8b433baa068d7";
+
+/* Answers every confirmable request the way the platform would. */
+static void platform_peer(exopal_loopback *lb, const uint8_t *buf, size_t len, void *peer_data)
+{
+	uint8_t req_buf[EXOPAL_LOOPBACK_MTU], rsp_buf[EXOPAL_LOOPBACK_MTU];
+	coap_pdu req = {req_buf, len, sizeof(req_buf)};
+	coap_pdu rsp = {rsp_buf, 0, sizeof(rsp_buf)};
+	coap_option opt;
+
+	memcpy(req_buf, buf, len);
+	if (coap_validate_pkt(&req) != CE_NONE || coap_get_type(&req) != CT_CON)
+		return;
+
+	coap_init_pdu(&rsp);
+	coap_set_version(&rsp, COAP_V1);
+	coap_set_type(&rsp, CT_ACK);
+	coap_set_mid(&rsp, coap_get_mid(&req));
+	coap_set_token(&rsp, coap_get_token(&req), coap_get_tkl(&req));
+
+	opt = coap_get_option_by_num(&req, CON_URI_PATH, 0);
+	if (opt.len == 9 && memcmp(opt.val, "provision", 9) == 0) {
+		coap_set_code(&rsp, CC_CONTENT);
+		coap_set_payload(&rsp, (uint8_t *)TEST_CIK, CIK_LENGTH);
+	} else if (coap_get_code(&req) == CC_POST) {
+		coap_set_code(&rsp, CC_CHANGED);
+	} else {
+		coap_set_code(&rsp, CC_CONTENT);
+		coap_set_payload(&rsp, (uint8_t *)"42", 2);
+	}
+
+	exopal_loopback_inject(lb, rsp.buf, rsp.len);
+}
+
+/* Hands datagrams to an in-process mock server instead. */
+static void mock_peer(exopal_loopback *lb, const uint8_t *buf, size_t len, void *peer_data)
+{
+	exomock_server *srv = peer_data;
+	uint8_t rsp[EXOMOCK_MTU];
+	uint32_t peer;
+	size_t rlen;
+
+	exomock_receive(srv, 0, lb->time, buf, len);
+	while (exomock_poll(srv, lb->time, &peer, rsp, sizeof(rsp), &rlen) == 0)
+		exopal_loopback_inject(lb, rsp, rlen);
+}
+
+static void run_until_idle(exo_context *ctx, exo_op *ops, uint8_t count)
+{
+	int i;
+
+	for (i = 0; i < 100; i++) {
+		if (exo_operate(ctx, ops, count) == EXO_IDLE)
+			return;
+	}
+
+	fail_msg("%s", "operate never went idle");
+}
+
+static void setup_device(exo_context *ctx, exopal_loopback *lb, exo_op *ops, uint8_t count)
+{
+	int i;
+
+	memset(lb, 0, sizeof(*lb));
+	lb->peer = platform_peer;
+
+	assert_int_equal(exo_init(ctx, &exopal_loopback_ops, lb, "vendor", "model", "001"), EXO_OK);
+
+	for (i = 0; i < count; i++)
+		exo_op_init(&ops[i]);
+}
+
+static void test_activate(void **state)
+{
+	exo_context ctx;
+	exopal_loopback lb;
+	exo_op ops[2];
+
+	(void) state; /* unused */
+
+	setup_device(&ctx, &lb, ops, 2);
+	run_until_idle(&ctx, ops, 2);
+
+	assert_int_equal(lb.has_cik, 1);
+	assert_memory_equal(lb.cik, TEST_CIK, CIK_LENGTH);
+	assert_string_equal(ctx.cik, TEST_CIK);
+}
+
+static void test_write(void **state)
+{
+	exo_context ctx;
+	exopal_loopback lb;
+	exo_op ops[2];
+
+	(void) state; /* unused */
+
+	setup_device(&ctx, &lb, ops, 2);
+	exo_write(&ops[1], "uptime", "12");
+	run_until_idle(&ctx, ops, 2);
+
+	assert_true(exo_is_op_finished(&ops[1]));
+	assert_true(exo_is_op_success(&ops[1]));
+}
+
+static void test_read(void **state)
+{
+	exo_context ctx;
+	exopal_loopback lb;
+	exo_op ops[2];
+	char value[8];
+
+	(void) state; /* unused */
+
+	setup_device(&ctx, &lb, ops, 2);
+	exo_read(&ops[1], "temp", value, sizeof(value));
+	run_until_idle(&ctx, ops, 2);
+
+	assert_true(exo_is_op_success(&ops[1]));
+	assert_string_equal(value, "42");
+}
+
+static void test_retransmit_on_timeout(void **state)
+{
+	exo_context ctx;
+	exopal_loopback lb;
+	exo_op ops[2];
+	uint8_t buf[EXOPAL_LOOPBACK_MTU];
+	coap_pdu pdu = {buf, 0, sizeof(buf)};
+	exo_stats stats;
+	uint16_t mid;
+
+	(void) state; /* unused */
+
+	setup_device(&ctx, &lb, ops, 2);
+	run_until_idle(&ctx, ops, 2);
+
+	// stop answering
+	lb.peer = NULL;
+	exo_write(&ops[1], "uptime", "12");
+	assert_int_equal(exo_operate(&ctx, ops, 2), EXO_WAITING);
+	assert_int_equal(exopal_loopback_take(&lb, pdu.buf, pdu.max, &pdu.len), 0);
+	mid = coap_get_mid(&pdu);
+
+	exo_operate(&ctx, ops, 2);
+	assert_int_not_equal(exopal_loopback_take(&lb, pdu.buf, pdu.max, &pdu.len), 0);
+
+	exopal_loopback_advance(&lb, 5000000);
+	exo_operate(&ctx, ops, 2);
+	assert_int_equal(exopal_loopback_take(&lb, pdu.buf, pdu.max, &pdu.len), 0);
+	assert_int_equal(coap_get_mid(&pdu), mid);
+	assert_int_equal(ops[1].retries, 1);
+
+	exo_get_stats(&ctx, &stats);
+	assert_int_equal(stats.retransmits, 1);
+	assert_int_equal(stats.error_timeout, 0);
+}
+
+static void test_retransmit_keeps_token(void **state)
+{
+	exo_context ctx;
+	exopal_loopback lb;
+	exo_op ops[2];
+	uint8_t buf[EXOPAL_LOOPBACK_MTU];
+	coap_pdu pdu = {buf, 0, sizeof(buf)};
+	uint64_t token;
+	uint8_t tkl;
+
 	(void) state; /* unused */
+
+	setup_device(&ctx, &lb, ops, 2);
+	run_until_idle(&ctx, ops, 2);
+
+	lb.peer = NULL;
+	exo_write(&ops[1], "uptime", "12");
+	exo_operate(&ctx, ops, 2);
+	assert_int_equal(exopal_loopback_take(&lb, pdu.buf, pdu.max, &pdu.len), 0);
+	token = coap_get_token(&pdu);
+	tkl = coap_get_tkl(&pdu);
+	assert_int_not_equal(tkl, 0);
+	assert_int_equal(ops[1].tkl, tkl);
+
+	// the retransmit must match the original, not go out with no token
+	exopal_loopback_advance(&lb, 5000000);
+	exo_operate(&ctx, ops, 2);
+	assert_int_equal(exopal_loopback_take(&lb, pdu.buf, pdu.max, &pdu.len), 0);
+	assert_int_equal(coap_get_tkl(&pdu), tkl);
+	assert_int_equal(coap_get_token(&pdu), token);
+
+	// and is answered with it
+	lb.peer = platform_peer;
+	exopal_loopback_advance(&lb, 10000000);
+	run_until_idle(&ctx, ops, 2);
+	assert_true(exo_is_op_success(&ops[1]));
+	assert_int_equal(ops[1].retries, 2);
+
+	// an op used again starts over
+	exo_op_done(&ops[1]);
+	exo_write(&ops[1], "uptime", "13");
+	exo_operate(&ctx, ops, 2);
+	assert_int_equal(ops[1].state, EXO_REQUEST_PENDING);
+	assert_int_equal(ops[1].retries, 0);
+}
+
+static void test_subscribe_notification(void **state)
+{
+	static exomock_server srv;
+	exo_context ctx;
+	exopal_loopback lb;
+	exo_op ops[3];
+	char value[8];
+
+	(void) state; /* unused */
+
+	exomock_init(&srv, 1);
+	exomock_set_alias(&srv, "cmd", "on", 2);
+	srv.cik[0] = 0; // subscribe goes out before activation finishes
+
+	setup_device(&ctx, &lb, ops, 3);
+	lb.peer = mock_peer;
+	lb.peer_data = &srv;
+
+	exo_subscribe(&ops[1], "cmd", value, sizeof(value));
+	run_until_idle(&ctx, ops, 3);
+	assert_true(exo_is_op_success(&ops[1]));
+	assert_string_equal(value, "on");
+	exo_op_done(&ops[1]);
+
+	// a write to the same dataport is pushed back to us
+	exo_write(&ops[2], "cmd", "off");
+	run_until_idle(&ctx, ops, 3);
+	assert_true(exo_is_op_success(&ops[2]));
+	assert_true(exo_is_op_success(&ops[1]));
+	assert_string_equal(value, "off");
+	assert_int_equal(srv.counters.notifications, 1);
+}
+
+static void test_rst_unknown_con(void **state)
+{
+	exo_context ctx;
+	exopal_loopback lb;
+	exo_op ops[2];
+	uint8_t con[] = {0x42, CC_CONTENT, 0x12, 0x34, 0xAA, 0xBB};
+	uint8_t bad[] = {0x00, 0x00};
+	uint8_t buf[EXOPAL_LOOPBACK_MTU];
+	coap_pdu pdu = {buf, 0, sizeof(buf)};
+	exo_stats before, after;
+
+	(void) state; /* unused */
+
+	setup_device(&ctx, &lb, ops, 2);
+	run_until_idle(&ctx, ops, 2);
+
+	lb.peer = NULL;
+	exo_get_stats(&ctx, &before);
+	exopal_loopback_inject(&lb, bad, sizeof(bad));
+	exopal_loopback_inject(&lb, con, sizeof(con));
+	exo_operate(&ctx, ops, 2);
+
+	exo_get_stats(&ctx, &after);
+	assert_int_equal(after.received - before.received, 2);
+	assert_int_equal(after.invalid - before.invalid, 1);
+	assert_int_equal(after.rst_sent - before.rst_sent, 1);
+	assert_int_equal(after.sent - before.sent, 1);
+
+	assert_int_equal(exopal_loopback_take(&lb, pdu.buf, pdu.max, &pdu.len), 0);
+	assert_int_equal(coap_validate_pkt(&pdu), CE_NONE);
+	assert_int_equal(coap_get_type(&pdu), CT_RST);
+	assert_int_equal(coap_get_mid(&pdu), 0x1234);
+	assert_int_equal(coap_get_tkl(&pdu), 2);
 }
+
+static void test_hist_percentile(void **state)
+{
+	static exo_hist hist;
+	uint32_t i, p50, p99;
+
+	(void) state; /* unused */
+
+	memset(&hist, 0, sizeof(hist));
+	assert_int_equal(exo_hist_percentile(&hist, 50), 0);
+
+	for (i = 1; i <= 10000; i++)
+		exo_hist_record(&hist, i * 100);
+
+	p50 = exo_hist_percentile(&hist, 50);
+	p99 = exo_hist_percentile(&hist, 99);
+
+	// buckets are within 1/EXO_HIST_SUB_COUNT of the real value
+	assert_in_range(p50, 500000, 500000 + 500000 / EXO_HIST_SUB_COUNT);
+	assert_in_range(p99, 990000, 990000 + 990000 / EXO_HIST_SUB_COUNT);
+	assert_in_range(exo_hist_percentile(&hist, 0), 100, 100 + 100 / EXO_HIST_SUB_COUNT);
+	assert_int_equal(exo_hist_percentile(&hist, 100), 1000000);
+	assert_int_equal(exo_hist_percentile(&hist, -5), exo_hist_percentile(&hist, 0));
+	assert_int_equal(exo_hist_percentile(&hist, 150), 1000000);
+	assert_int_equal(hist.count, 10000);
+
+	// small values are exact, the largest one still has a bucket
+	memset(&hist, 0, sizeof(hist));
+	exo_hist_record(&hist, 3);
+	exo_hist_record(&hist, UINT32_MAX);
+	assert_int_equal(exo_hist_percentile(&hist, 50), 3);
+	assert_int_equal(exo_hist_percentile(&hist, 100), UINT32_MAX);
+}
+
+static void test_write_latency(void **state)
+{
+	exo_context ctx;
+	exopal_loopback lb;
+	exo_op ops[2];
+	uint8_t buf[EXOPAL_LOOPBACK_MTU];
+	coap_pdu pdu = {buf, 0, sizeof(buf)};
+	exo_hist hist;
+
+	(void) state; /* unused */
+
+	setup_device(&ctx, &lb, ops, 2);
+	run_until_idle(&ctx, ops, 2);
+
+	exo_get_hist(&ctx, EXO_HIST_ACTIVATE, &hist);
+	assert_int_equal(hist.count, 1);
+
+	// answer the write by hand 1.5 ms after it went out
+	lb.peer = NULL;
+	exo_write(&ops[1], "uptime", "12");
+	exo_operate(&ctx, ops, 2);
+	assert_int_equal(exopal_loopback_take(&lb, pdu.buf, pdu.max, &pdu.len), 0);
+
+	exopal_loopback_advance(&lb, 1500);
+	coap_set_type(&pdu, CT_ACK);
+	coap_set_code(&pdu, CC_CHANGED);
+	pdu.len = 4 + coap_get_tkl(&pdu);
+	exopal_loopback_inject(&lb, pdu.buf, pdu.len);
+	run_until_idle(&ctx, ops, 2);
+	assert_true(exo_is_op_success(&ops[1]));
+
+	exo_get_hist(&ctx, EXO_HIST_WRITE, &hist);
+	assert_int_equal(hist.count, 1);
+	assert_int_equal(hist.min, 1500);
+	assert_int_equal(exo_hist_percentile(&hist, 99), 1500);
+
+	exo_get_hist(&ctx, EXO_HIST_RETRIES, &hist);
+	assert_int_equal(hist.count, 2);
+	assert_int_equal(hist.max, 0);
+
+	exo_reset_hist(&ctx, EXO_HIST_WRITE);
+	exo_get_hist(&ctx, EXO_HIST_WRITE, &hist);
+	assert_int_equal(hist.count, 0);
+}
+
+typedef struct pcap_buf
+{
+	uint8_t data[4096];
+	size_t len;
+} pcap_buf;
+
+static int pcap_to_buf(void *arg, const void *buf, size_t len)
+{
+	pcap_buf *out = arg;
+
+	if (out->len + len > sizeof(out->data))
+		return 1;
+
+	memcpy(out->data + out->len, buf, len);
+	out->len += len;
+	return 0;
+}
+
+static void test_flight_recorder(void **state)
+{
+	static pcap_buf out;
+	exo_context ctx;
+	exopal_loopback lb;
+	exo_op ops[2];
+	exo_record records[3];
+	uint32_t hdr[4];
+	uint8_t *ip;
+	size_t off;
+	int packets = 0;
+	time_t start = time(NULL);
+
+	(void) state; /* unused */
+
+	setup_device(&ctx, &lb, ops, 2);
+	exo_set_recorder(&ctx, records, 3);
+	run_until_idle(&ctx, ops, 2);
+
+	exo_write(&ops[1], "uptime", "12");
+	run_until_idle(&ctx, ops, 2);
+
+	// activate and write, each a request and an ACK, only the last 3 kept
+	assert_int_equal(ctx.record_used, 3);
+	assert_int_equal(records[0].dir, EXO_RECORD_RECEIVED);
+
+	out.len = 0;
+	assert_int_equal(exo_dump_pcap(&ctx, pcap_to_buf, &out), EXO_OK);
+
+	memcpy(hdr, out.data, 8);
+	assert_int_equal(hdr[0], 0xa1b2c3d4);
+
+	for (off = 24; off < out.len; packets++) {
+		memcpy(hdr, out.data + off, sizeof(hdr));
+		ip = out.data + off + sizeof(hdr);
+
+		assert_int_equal(ip[0], 0x45);
+		assert_int_equal(ip[9], 17);
+		assert_int_equal((ip[2] << 8) | ip[3], hdr[3]);
+		assert_int_equal((ip[24] << 8) | ip[25], hdr[3] - 20);
+		assert_int_equal(ip[28] >> 6, COAP_V1);
+
+		// time of day, not time since the loopback clock started
+		assert_in_range(hdr[0], start - 60, time(NULL));
+
+		// the write request goes out in the middle
+		if (packets == 1) {
+			assert_int_equal(ip[15], 2);
+			assert_int_equal((ip[22] << 8) | ip[23], 5683);
+			assert_int_equal(ip[29], CC_POST);
+		}
+
+		off += sizeof(hdr) + hdr[2];
+	}
+
+	assert_int_equal(off, out.len);
+	assert_int_equal(packets, 3);
+
+	// a failing writer stops the dump
+	out.len = sizeof(out.data);
+	assert_int_equal(exo_dump_pcap(&ctx, pcap_to_buf, &out), EXO_GENERAL_ERROR);
+}
+
+typedef struct submit_log
+{
+	char order[8][EXO_SUBMIT_ALIAS_MAX];
+	char values[8][EXO_SUBMIT_VALUE_MAX];
+	int count;
+	int failed;
+} submit_log;
+
+static void submit_done(struct exo_context *ctx, struct exo_submission *sub, uint8_t success, void *arg)
+{
+	submit_log *log = arg;
+
+	if (!success)
+		log->failed++;
+	strcpy(log->order[log->count], sub->alias);
+	strcpy(log->values[log->count], sub->value);
+	log->count++;
+}
+
+static void test_submit_queue(void **state)
+{
+	exo_context ctx;
+	exopal_loopback lb;
+	exo_op ops[1];
+	exo_submission slots[4];
+	submit_log log;
+
+	(void) state; /* unused */
+
+	memset(&log, 0, sizeof(log));
+	setup_device(&ctx, &lb, ops, 1);
+	assert_int_equal(exo_submit_write(&ctx, "uptime", "1", 0, NULL, NULL), EXO_GENERAL_ERROR);
+	assert_int_equal(exo_set_submit_queue(&ctx, slots, 3), EXO_GENERAL_ERROR);
+	assert_int_equal(exo_set_submit_queue(&ctx, slots, 4), EXO_OK);
+	run_until_idle(&ctx, ops, 1);
+
+	assert_int_equal(exo_submit_write(&ctx, "uptime", "1", 0, submit_done, &log), EXO_OK);
+	assert_int_equal(exo_submit_write(&ctx, "errors", "2", 0, submit_done, &log), EXO_OK);
+	assert_int_equal(exo_submit_read(&ctx, "temp", 5, submit_done, &log), EXO_OK);
+	assert_int_equal(exo_submit_write(&ctx, "uptime", "3", 0, submit_done, &log), EXO_OK);
+	assert_int_equal(exo_submit_write(&ctx, "uptime", "4", 0, submit_done, &log), EXO_OUT_OF_SPACE);
+
+	// one free op, so they go one at a time, the read first
+	run_until_idle(&ctx, ops, 1);
+	assert_int_equal(log.count, 4);
+	assert_int_equal(log.failed, 0);
+	assert_string_equal(log.order[0], "temp");
+	assert_string_equal(log.values[0], "42");
+	assert_string_equal(log.order[1], "uptime");
+	assert_string_equal(log.values[1], "1");
+	assert_string_equal(log.order[2], "errors");
+	assert_string_equal(log.order[3], "uptime");
+	assert_int_equal(ops[0].type, EXO_NULL);
+
+	// and the slots are free again
+	assert_int_equal(exo_submit_write(&ctx, "uptime", "5", 0, NULL, NULL), EXO_OK);
+}
+
+static void test_pool(void **state)
+{
+	exo_context ctx;
+	exopal_loopback lb;
+	exo_pool pool;
+	exo_op *op[5];
+	exo_submission slots[4];
+	submit_log log;
+	char arena[EXO_POOL_ARENA_SIZE(4)];
+	char value[8];
+	int i;
+
+	(void) state; /* unused */
+
+	memset(&log, 0, sizeof(log));
+	setup_device(&ctx, &lb, NULL, 0);
+	assert_int_equal(exo_pool_init(&pool, arena, sizeof(arena)), 4);
+
+	for (i = 0; i < 5; i++)
+		op[i] = exo_op_acquire(&pool);
+	assert_null(op[4]);
+	assert_int_equal(pool.live_count, 4);
+
+	exo_op_release(&pool, op[2]);
+	exo_op_release(&pool, op[3]);
+	assert_int_equal(pool.live_count, 2);
+
+	exo_write(op[0], "uptime", "12");
+	exo_read(op[1], "temp", value, sizeof(value));
+	for (i = 0; i < 100 && exo_operate_pool(&ctx, &pool) != EXO_IDLE; i++)
+		;
+	assert_true(exo_is_op_success(op[0]));
+	assert_true(exo_is_op_success(op[1]));
+	assert_string_equal(value, "42");
+
+	// a released op comes back clean
+	exo_op_release(&pool, op[0]);
+	op[0] = exo_op_acquire(&pool);
+	assert_int_equal(op[0]->type, EXO_NULL);
+	assert_int_equal(op[0]->state, EXO_REQUEST_NULL);
+
+	// submissions take ops from the free list and give them back
+	exo_op_release(&pool, op[0]);
+	exo_op_release(&pool, op[1]);
+	assert_int_equal(exo_set_submit_queue(&ctx, slots, 4), EXO_OK);
+	assert_int_equal(exo_submit_write(&ctx, "uptime", "1", 0, submit_done, &log), EXO_OK);
+	assert_int_equal(exo_submit_read(&ctx, "temp", 0, submit_done, &log), EXO_OK);
+	for (i = 0; i < 100 && exo_operate_pool(&ctx, &pool) != EXO_IDLE; i++)
+		;
+	assert_int_equal(log.count, 2);
+	assert_int_equal(log.failed, 0);
+	assert_int_equal(pool.live_count, 0);
+}
+
+static void test_value_arena(void **state)
+{
+	exo_context ctx;
+	exopal_loopback lb;
+	exo_op ops[2];
+	uint64_t arena[16];
+	uint8_t buf[EXOPAL_LOOPBACK_MTU];
+	coap_pdu pdu = {buf, 0, sizeof(buf)};
+	char payload[128];
+	uint16_t seq;
+	int r, len;
+
+	(void) state; /* unused */
+
+	setup_device(&ctx, &lb, ops, 2);
+	assert_int_equal(exo_set_value_arena(&ctx, arena, 8), EXO_GENERAL_ERROR);
+	assert_int_equal(exo_set_value_arena(&ctx, arena, sizeof(arena)), EXO_OK);
+
+	exo_subscribe(&ops[0], "setpoint", NULL, 0);
+	exo_read(&ops[1], "temp", NULL, 0);
+	run_until_idle(&ctx, ops, 2);
+	assert_true(exo_is_op_success(&ops[1]));
+	assert_true(exo_is_op_success(&ops[0]));
+	assert_string_equal(ops[1].value, "42");
+	assert_string_equal(ops[0].value, "42");
+	exo_op_done(&ops[0]);
+
+	// values of any size that fits, the read's survives being moved around
+	for (r = 0; r < 40; r++) {
+		seq = r + 2;
+		len = 10 + r * 7 % 60;
+		memset(payload, 'a' + r % 26, len);
+
+		coap_init_pdu(&pdu);
+		coap_set_version(&pdu, COAP_V1);
+		coap_set_type(&pdu, CT_CON);
+		coap_set_code(&pdu, CC_CONTENT);
+		coap_set_mid(&pdu, 0x8000 + r);
+		coap_set_token(&pdu, ops[0].token, 2);
+		coap_add_option(&pdu, CON_OBSERVE, (uint8_t[]){seq >> 8, seq & 0xFF}, 2);
+		coap_set_payload(&pdu, (uint8_t *)payload, len);
+
+		exopal_loopback_inject(&lb, pdu.buf, pdu.len);
+		run_until_idle(&ctx, ops, 2);
+		assert_true(exo_is_op_success(&ops[0]));
+		assert_int_equal(strlen(ops[0].value), len);
+		assert_memory_equal(ops[0].value, payload, len);
+		assert_string_equal(ops[1].value, "42");
+		exo_op_done(&ops[0]);
+	}
+	assert_true(ctx.stats.arena_compactions > 0);
+	assert_int_equal(ctx.stats.error_oversize, 0);
+
+	// more than the whole arena still fails
+	seq = 100;
+	memset(payload, 'z', 120);
+	coap_init_pdu(&pdu);
+	coap_set_version(&pdu, COAP_V1);
+	coap_set_type(&pdu, CT_CON);
+	coap_set_code(&pdu, CC_CONTENT);
+	coap_set_mid(&pdu, 0x9000);
+	coap_set_token(&pdu, ops[0].token, 2);
+	coap_add_option(&pdu, CON_OBSERVE, (uint8_t[]){seq >> 8, seq & 0xFF}, 2);
+	coap_set_payload(&pdu, (uint8_t *)payload, 120);
+	exopal_loopback_inject(&lb, pdu.buf, pdu.len);
+	exo_operate(&ctx, ops, 2);
+	assert_int_equal(ops[0].state, EXO_REQUEST_ERROR);
+	assert_int_equal(ctx.stats.error_oversize, 1);
+	assert_string_equal(ops[1].value, "42");
+}
+
+#define SUBMIT_THREADS 4
+#define SUBMIT_EACH 500
+
+static void *submit_thread(void *arg)
+{
+	exo_context *ctx = arg;
+	int i;
+
+	for (i = 0; i < SUBMIT_EACH; i++) {
+		while (exo_submit_write(ctx, "uptime", "1", i & 1, NULL, NULL) == EXO_OUT_OF_SPACE)
+			sched_yield();
+	}
+
+	return NULL;
+}
+
+static void test_submit_threads(void **state)
+{
+	static exo_submission slots[16];
+	exo_context ctx;
+	exopal_loopback lb;
+	exo_op ops[8];
+	exo_stats stats;
+	pthread_t threads[SUBMIT_THREADS];
+	int i;
+
+	(void) state; /* unused */
+
+	setup_device(&ctx, &lb, ops, 8);
+	exo_set_submit_queue(&ctx, slots, 16);
+	run_until_idle(&ctx, ops, 8);
+
+	for (i = 0; i < SUBMIT_THREADS; i++)
+		assert_int_equal(pthread_create(&threads[i], NULL, submit_thread, &ctx), 0);
+
+	// run until every submission has completed and given its slot back
+	while (ctx.sub_release < SUBMIT_THREADS * SUBMIT_EACH)
+		exo_operate(&ctx, ops, 8);
+
+	for (i = 0; i < SUBMIT_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	// activation plus every write, each one request and one ACK
+	exo_get_stats(&ctx, &stats);
+	assert_int_equal(stats.sent, 1 + SUBMIT_THREADS * SUBMIT_EACH);
+	assert_int_equal(ctx.sub_release, SUBMIT_THREADS * SUBMIT_EACH);
+}
+
+static void test_background(void **state)
+{
+	exo_context ctx;
+	exopal_loopback lb;
+	exo_op ops[4];
+	exo_submission slots[8];
+	exo_completion completions[8], c;
+	exo_background bg;
+	int args[4] = {0, 1, 2, 3}, seen = 0, taken = 0;
+
+	(void) state; /* unused */
+
+	setup_device(&ctx, &lb, ops, 4);
+	assert_int_equal(exo_start_background(&bg, &ctx, ops, 4, completions, 8), EXO_GENERAL_ERROR);
+	exo_set_submit_queue(&ctx, slots, 8);
+	assert_int_equal(exo_start_background(&bg, &ctx, ops, 4, completions, 6), EXO_GENERAL_ERROR);
+	assert_int_equal(exo_start_background(&bg, &ctx, ops, 4, completions, 8), EXO_OK);
+
+	assert_int_equal(exo_background_write(&bg, "uptime", "1", 0, &args[0]), EXO_OK);
+	assert_int_equal(exo_background_write(&bg, "uptime", "2", 0, &args[1]), EXO_OK);
+	assert_int_equal(exo_background_read(&bg, "temp", 0, &args[2]), EXO_OK);
+
+	while (taken < 3 && exo_background_wait(&bg, 1000)) {
+		while (exo_background_take(&bg, &c)) {
+			assert_true(c.success);
+			seen |= 1 << *(int *)c.arg;
+			if (c.type == EXO_READ)
+				assert_string_equal(c.value, "42");
+			taken++;
+		}
+	}
+	assert_int_equal(seen, 7);
+
+	// the thread is asleep by now, a submission has to wake it well before
+	// it would have woken by itself
+	usleep(20000);
+	assert_int_equal(exo_background_write(&bg, "uptime", "3", 0, &args[3]), EXO_OK);
+	assert_true(exo_background_wait(&bg, EXO_BACKGROUND_MAX_WAIT_MS / 2));
+	assert_true(exo_background_take(&bg, &c));
+	assert_ptr_equal(c.arg, &args[3]);
+	assert_string_equal(c.value, "3");
+	assert_false(exo_background_take(&bg, &c));
+
+	exo_stop_background(&bg);
+	assert_int_equal(exo_background_lost(&bg), 0);
+
+	// queued after stopping, nothing runs until someone calls exo_operate()
+	assert_int_equal(exo_background_write(&bg, "uptime", "4", 0, NULL), EXO_OK);
+	assert_ptr_equal(ctx.sub_wake, NULL);
+}
+
+#define SNAPSHOT_UPDATES 5000
+
+typedef struct snapshot_reader
+{
+	exo_snapshot *snap;
+	int stop;
+	int reads;
+	int torn;
+	uint32_t last;
+} snapshot_reader;
+
+static void *snapshot_thread(void *arg)
+{
+	snapshot_reader *r = arg;
+	char value[16], expect[16];
+	uint32_t obs, version;
+
+	while (!__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) {
+		version = exo_snapshot_read(r->snap, value, sizeof(value), &obs);
+		// the first value came with the observe response, the rest carry
+		// their own sequence number
+		snprintf(expect, sizeof(expect), "%u", (unsigned)obs);
+		if ((version > 1 && strcmp(value, expect) != 0) || version < r->last)
+			r->torn++;
+		r->last = version;
+		__atomic_fetch_add(&r->reads, 1, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+static void test_snapshot(void **state)
+{
+	exo_context ctx;
+	exopal_loopback lb;
+	exo_op ops[2];
+	exo_snapshot snap;
+	snapshot_reader reader;
+	pthread_t thread;
+	uint8_t buf[64];
+	coap_pdu pdu = {buf, 0, sizeof(buf)};
+	char value[16], payload[16];
+	uint32_t obs;
+	uint16_t seq;
+	int r;
+
+	(void) state; /* unused */
+
+	setup_device(&ctx, &lb, ops, 2);
+	exo_subscribe(&ops[1], "setpoint", value, sizeof(value));
+	exo_op_set_snapshot(&ops[1], &snap);
+	assert_int_equal(exo_snapshot_read(&snap, value, sizeof(value), &obs), 0);
+
+	// no exo_op_done() needed, it goes straight back to listening
+	run_until_idle(&ctx, ops, 2);
+	assert_int_equal(ops[1].state, EXO_REQUEST_SUBSCRIBED);
+	assert_int_equal(exo_snapshot_read(&snap, value, sizeof(value), &obs), 1);
+	assert_string_equal(value, "42");
+	assert_int_equal(exo_snapshot_read(&snap, value, 2, NULL), 1);
+	assert_string_equal(value, "4");
+	// only the version, the buffer is left alone
+	assert_int_equal(exo_snapshot_read(&snap, value + 1, 0, NULL), 1);
+	assert_string_equal(value, "4");
+
+	memset(&reader, 0, sizeof(reader));
+	reader.snap = &snap;
+	assert_int_equal(pthread_create(&thread, NULL, snapshot_thread, &reader), 0);
+	while (__atomic_load_n(&reader.reads, __ATOMIC_ACQUIRE) == 0)
+		sched_yield();
+
+	for (r = 0; r < SNAPSHOT_UPDATES; r++) {
+		seq = r + 1;
+		snprintf(payload, sizeof(payload), "%u", (unsigned)seq);
+
+		coap_init_pdu(&pdu);
+		coap_set_version(&pdu, COAP_V1);
+		coap_set_type(&pdu, CT_CON);
+		coap_set_code(&pdu, CC_CONTENT);
+		coap_set_mid(&pdu, 0x8000 + r);
+		coap_set_token(&pdu, ops[1].token, 2);
+		coap_add_option(&pdu, CON_OBSERVE, (uint8_t[]){seq >> 8, seq & 0xFF}, 2);
+		coap_set_payload(&pdu, (uint8_t *)payload, strlen(payload));
+
+		exopal_loopback_inject(&lb, pdu.buf, pdu.len);
+		exo_operate(&ctx, ops, 2);
+		assert_int_equal(ops[1].state, EXO_REQUEST_SUBSCRIBED);
+	}
+
+	__atomic_store_n(&reader.stop, 1, __ATOMIC_RELEASE);
+	pthread_join(thread, NULL);
+
+	assert_int_equal(reader.torn, 0);
+	assert_true(reader.reads > 0);
+	exo_snapshot_read(&snap, value, sizeof(value), &obs);
+	assert_int_equal(obs, SNAPSHOT_UPDATES);
+}
+
+static void inject_notification(exopal_loopback *lb, uint16_t mid, uint64_t token, uint16_t seq,
+                                const char *payload)
+{
+	uint8_t buf[64];
+	coap_pdu pdu = {buf, 0, sizeof(buf)};
+
+	coap_init_pdu(&pdu);
+	coap_set_version(&pdu, COAP_V1);
+	coap_set_type(&pdu, CT_CON);
+	coap_set_code(&pdu, CC_CONTENT);
+	coap_set_mid(&pdu, mid);
+	coap_set_token(&pdu, token, 2);
+	coap_add_option(&pdu, CON_OBSERVE, (uint8_t[]){seq >> 8, seq & 0xFF}, 2);
+	coap_set_payload(&pdu, (uint8_t *)payload, strlen(payload));
+	exopal_loopback_inject(lb, pdu.buf, pdu.len);
+}
+
+static void test_warm_restart(void **state)
+{
+	exo_context ctx;
+	exopal_loopback lb;
+	exo_op ops[2];
+	char value[8];
+	uint8_t saved[128], buf[EXOPAL_LOOPBACK_MTU];
+	coap_pdu pdu = {buf, 0, sizeof(buf)};
+	size_t len;
+	uint64_t token;
+	uint16_t mid;
+
+	(void) state; /* unused */
+
+	setup_device(&ctx, &lb, ops, 2);
+	exo_subscribe(&ops[1], "setpoint", value, sizeof(value));
+	run_until_idle(&ctx, ops, 2);
+	exo_op_done(&ops[1]);
+	inject_notification(&lb, 0x8000, ops[1].token, 5, "77");
+	run_until_idle(&ctx, ops, 2);
+	assert_string_equal(value, "77");
+
+	assert_int_equal(exo_save_state(&ctx, ops, 2, saved, 8, &len), EXO_OUT_OF_SPACE);
+	assert_int_equal(exo_save_state(&ctx, ops, 2, saved, sizeof(saved), &len), EXO_OK);
+	token = ops[1].token;
+	mid = ctx.message_id_counter;
+
+	// restart, the value is there before anything was sent
+	memset(&lb, 0, sizeof(lb));
+	exopal_loopback_set_cik(&lb, TEST_CIK);
+	assert_int_equal(exo_init(&ctx, &exopal_loopback_ops, &lb, "vendor", "model", "001"), EXO_OK);
+	exo_op_init(&ops[0]);
+	exo_op_init(&ops[1]);
+	memset(value, 0, sizeof(value));
+	exo_subscribe(&ops[1], "setpoint", value, sizeof(value));
+
+	assert_int_equal(exo_restore_state(&ctx, ops, 2, saved, len - 1), EXO_GENERAL_ERROR);
+	assert_int_equal(ops[1].state, EXO_REQUEST_NEW);
+	assert_int_equal(exo_restore_state(&ctx, ops, 2, saved, len), EXO_OK);
+	assert_true(exo_is_op_success(&ops[1]));
+	assert_string_equal(value, "77");
+	assert_int_equal(ops[1].obs_seq, 5);
+	assert_int_equal(ctx.message_id_counter, (uint16_t)(mid + 1024));
+
+	// the old observation's notifications are still ours
+	exo_op_done(&ops[1]);
+	inject_notification(&lb, 0x8001, token, 6, "78");
+	exo_operate(&ctx, ops, 2);
+	assert_true(exo_is_op_success(&ops[1]));
+	assert_string_equal(value, "78");
+	assert_int_equal(ctx.stats.rst_sent, 0);
+
+	// and it re-registers with the same token
+	exo_op_done(&ops[1]);
+	exopal_loopback_advance(&lb, 300 * 1000000ULL);
+	exo_operate(&ctx, ops, 2);
+	exo_operate(&ctx, ops, 2);
+	while (exopal_loopback_take(&lb, buf, sizeof(buf), &pdu.len) == 0) {
+		if (coap_get_type(&pdu) == CT_CON && coap_get_code(&pdu) == CC_GET)
+			break;
+	}
+	assert_int_equal(coap_get_code(&pdu), CC_GET);
+	assert_int_equal(coap_get_token(&pdu), token);
+	assert_int_equal(coap_get_mid(&pdu), ops[1].mid);
+}
+
+static void test_warm_restart_pool(void **state)
+{
+	exo_context ctx;
+	exopal_loopback lb;
+	exo_pool pool;
+	exo_op *op;
+	char arena[EXO_POOL_ARENA_SIZE(2)];
+	char value[8];
+	uint8_t saved[128];
+	size_t len;
+	uint64_t token;
+
+	(void) state; /* unused */
+
+	setup_device(&ctx, &lb, NULL, 0);
+	exo_pool_init(&pool, arena, sizeof(arena));
+	exo_op_acquire(&pool);
+	op = exo_op_acquire(&pool);
+	exo_subscribe(op, "setpoint", value, sizeof(value));
+	while (exo_operate_pool(&ctx, &pool) != EXO_IDLE)
+		;
+	exo_op_done(op);
+	inject_notification(&lb, 0x8000, op->token, 5, "77");
+	while (exo_operate_pool(&ctx, &pool) != EXO_IDLE)
+		;
+	assert_int_equal(exo_save_state_pool(&ctx, &pool, saved, sizeof(saved), &len), EXO_OK);
+	assert_true(len > 7);
+	token = op->token;
+
+	memset(&lb, 0, sizeof(lb));
+	exopal_loopback_set_cik(&lb, TEST_CIK);
+	assert_int_equal(exo_init(&ctx, &exopal_loopback_ops, &lb, "vendor", "model", "001"), EXO_OK);
+	exo_pool_init(&pool, arena, sizeof(arena));
+	op = exo_op_acquire(&pool);
+	memset(value, 0, sizeof(value));
+	exo_subscribe(op, "setpoint", value, sizeof(value));
+
+	assert_int_equal(exo_restore_state_pool(&ctx, &pool, saved, len), EXO_OK);
+	assert_true(exo_is_op_success(op));
+	assert_string_equal(value, "77");
+	assert_int_equal(op->token, token);
+}
+
+static void test_reopen(void **state)
+{
+	exo_context ctx;
+	exopal_loopback lb;
+	exo_op ops[3];
+	char value[8];
+	uint64_t token;
+	int i;
+
+	(void) state; /* unused */
+
+	setup_device(&ctx, &lb, ops, 3);
+	exo_subscribe(&ops[1], "setpoint", value, sizeof(value));
+	run_until_idle(&ctx, ops, 3);
+	exo_op_done(&ops[1]);
+	token = ops[1].token;
+	assert_int_equal(lb.socks, 1);
+
+	// the link goes away, the write stays queued and the socket is replaced
+	lb.send_error = 1;
+	exo_write(&ops[2], "uptime", "12");
+	for (i = 0; i < 8; i++)
+		assert_int_not_equal(exo_operate(&ctx, ops, 3), EXO_IDLE);
+	assert_int_equal(lb.socks, 2);
+	assert_int_equal(ctx.stats.reopens, 1);
+	assert_int_equal(ops[2].state, EXO_REQUEST_NEW);
+	assert_int_equal(ops[1].state, EXO_REQUEST_NEW);
+
+	// only once per EXO_REOPEN_INTERVAL_US while it stays down
+	exopal_loopback_advance(&lb, 2000000);
+	exo_operate(&ctx, ops, 3);
+	assert_int_equal(lb.socks, 3);
+
+	// back up, nothing was lost and the subscription kept its token
+	lb.send_error = 0;
+	run_until_idle(&ctx, ops, 3);
+	assert_true(exo_is_op_success(&ops[2]));
+	assert_true(exo_is_op_success(&ops[1]));
+	assert_int_equal(ops[1].token, token);
+	assert_string_equal(value, "42");
+}
+
+/* A POSIX PAL that can't send: its socket is connected nowhere. */
+static void setup_posix(exopal_posix *posix)
+{
+	memset(posix, 0, sizeof(*posix));
+	assert_int_equal(exopal_posix_ops.init(posix), 0);
+	posix->addr_expires = UINT64_MAX; // nothing to resolve
+	posix->sock = socket(AF_INET, SOCK_DGRAM, 0);
+	assert_int_not_equal(posix->sock, -1);
+}
+
+static void test_posix_log_rate_limit(void **state)
+{
+	static const uint8_t ping[4] = {0x40, 0, 0x12, 0x34};
+	exopal_posix posix;
+	exopal_log_record rec;
+	char line[128];
+	int sock, i;
+
+	(void) state; /* unused */
+
+	setup_posix(&posix);
+
+	// the same error over and over is logged once a second
+	for (i = 0; i < 5; i++)
+		assert_int_equal(exopal_posix_ops.udp_send(&posix, ping, sizeof(ping)), 1);
+	assert_int_equal(exopal_posix_log_read(&posix, &rec), 0);
+	assert_int_equal(rec.code, EXOPAL_LOG_SEND);
+	assert_int_equal(rec.err, EDESTADDRREQ);
+	assert_int_equal(rec.id, 0x1234);
+	assert_int_equal(rec.repeats, 0);
+	assert_int_equal(exopal_posix_log_read(&posix, &rec), 1);
+
+	// the next one after that says how many were folded into it
+	posix.log.limit[EXOPAL_LOG_SEND].time -= EXOPAL_LOG_INTERVAL_US;
+	exopal_posix_ops.udp_send(&posix, ping, sizeof(ping));
+	assert_int_equal(exopal_posix_log_read(&posix, &rec), 0);
+	assert_int_equal(rec.repeats, 4);
+	exopal_posix_log_format(&rec, line, sizeof(line));
+	assert_non_null(strstr(line, "send: "));
+	assert_non_null(strstr(line, "mid 4660 (4 more)"));
+
+	// a different error ends the run straight away
+	exopal_posix_ops.udp_send(&posix, ping, sizeof(ping));
+	exopal_posix_ops.udp_send(&posix, ping, sizeof(ping));
+	sock = posix.sock;
+	close(sock);
+	exopal_posix_ops.udp_send(&posix, ping, sizeof(ping));
+	assert_int_equal(exopal_posix_log_read(&posix, &rec), 0);
+	assert_int_equal(rec.err, EDESTADDRREQ);
+	assert_int_equal(rec.repeats, 2);
+	assert_int_equal(exopal_posix_log_read(&posix, &rec), 0);
+	assert_int_equal(rec.err, EBADF);
+	assert_int_equal(rec.repeats, 0);
+	assert_int_equal(exopal_posix_log_read(&posix, &rec), 1);
+	assert_int_equal(posix.log.dropped, 0);
+
+	posix.sock = -1;
+	exopal_posix_close(&posix);
+}
+
+static void test_posix_log_full(void **state)
+{
+	static const uint8_t ping[4] = {0x40, 0, 0, 1};
+	exopal_posix posix;
+	exopal_log_record rec;
+	int sock, i;
+
+	(void) state; /* unused */
+
+	setup_posix(&posix);
+	sock = posix.sock;
+
+	// errors alternate so none is folded, nobody reads them
+	for (i = 0; i < EXOPAL_LOG_LEN + 3; i++) {
+		posix.sock = i % 2 == 0 ? sock : 1000;
+		assert_int_equal(exopal_posix_ops.udp_send(&posix, ping, sizeof(ping)), 1);
+	}
+	assert_int_equal(posix.log.dropped, 3);
+
+	// the oldest ones are kept
+	for (i = 0; i < EXOPAL_LOG_LEN; i++) {
+		assert_int_equal(exopal_posix_log_read(&posix, &rec), 0);
+		assert_int_equal(rec.err, i % 2 == 0 ? EDESTADDRREQ : EBADF);
+	}
+	assert_int_equal(exopal_posix_log_read(&posix, &rec), 1);
+
+	// there is room again, for an error other than the last one
+	posix.sock = 1000;
+	exopal_posix_ops.udp_send(&posix, ping, sizeof(ping));
+	assert_int_equal(exopal_posix_log_read(&posix, &rec), 0);
+	assert_int_equal(posix.log.dropped, 3);
+
+	posix.sock = sock;
+	exopal_posix_close(&posix);
+}
+
+static void test_posix_dns_moved(void **state)
+{
+	exopal_posix posix;
+	struct sockaddr_in *in;
+	uint8_t buf[16];
+	char path[64];
+	size_t len, i;
+	uint8_t ret = 2;
+	FILE *file;
+	int n;
+
+	(void) state; /* unused */
+
+	// the cached answer is stale, localhost resolves to something else
+	snprintf(path, sizeof(path), "/tmp/exotest-dns-%d", (int)getpid());
+	file = fopen(path, "w");
+	assert_non_null(file);
+	fprintf(file, "localhost 5683 %lld\n127.0.0.3\n", (long long)time(NULL) - 1);
+	fclose(file);
+
+	memset(&posix, 0, sizeof(posix));
+	posix.host = "localhost";
+	posix.dns_cache_path = path;
+	assert_int_equal(exopal_posix_ops.init(&posix), 0);
+	assert_int_equal(exopal_posix_ops.udp_sock(&posix), 0);
+	assert_int_not_equal(posix.sock, -1);
+	assert_int_equal(posix.addr_count, 1);
+
+	// the socket in use stays, the library is told to reopen
+	for (n = 0; n < 500 && ret == 2; n++) {
+		exopal_posix_ops.get_time(&posix);
+		ret = exopal_posix_ops.udp_recv(&posix, buf, sizeof(buf), &len);
+		if (ret == 2)
+			usleep(10000);
+	}
+	assert_int_equal(ret, 3);
+	assert_int_not_equal(posix.sock, -1);
+	assert_int_equal(exopal_posix_ops.udp_recv(&posix, buf, sizeof(buf), &len), 2);
+
+	for (i = 0; i < posix.addr_count; i++) {
+		in = (struct sockaddr_in *)&posix.addr[i].addr;
+		assert_false(in->sin_family == AF_INET && in->sin_addr.s_addr == htonl(0x7F000003));
+	}
+	assert_int_equal(exopal_posix_ops.udp_sock(&posix), 0);
+
+	exopal_posix_close(&posix);
+	unlink(path);
+}
+
+/* Answers CoAP pings with a RST when told to, drops everything else. */
+static void race_serve(int srv, int answer)
+{
+	struct sockaddr_storage from;
+	socklen_t from_len = sizeof(from);
+	uint8_t buf[16];
+	ssize_t n;
+
+	while ((n = recvfrom(srv, buf, sizeof(buf), 0, (struct sockaddr *)&from, &from_len)) >= 0) {
+		if (answer && n == 4 && buf[0] == 0x40 && buf[1] == 0) {
+			buf[0] = 0x70;
+			sendto(srv, buf, 4, 0, (struct sockaddr *)&from, from_len);
+		}
+		from_len = sizeof(from);
+	}
+}
+
+/* Runs the PAL's receive path, as exo_operate() would, until it returns
+   something other than 2 or the race settled without a move. */
+static uint8_t race_run(exopal_posix *posix, int srv[2], int answering)
+{
+	uint8_t buf[16];
+	size_t len;
+	uint8_t ret = 2;
+	int n;
+
+	for (n = 0; n < 3000 && ret == 2; n++) {
+		exopal_posix_ops.get_time(posix);
+		ret = exopal_posix_ops.udp_recv(posix, buf, sizeof(buf), &len);
+		if (ret == 2 && posix->sock != -1 && posix->race.start == 0 && !posix->moved)
+			break;
+		race_serve(srv[0], answering == 0);
+		race_serve(srv[1], answering == 1);
+		usleep(1000);
+	}
+
+	return ret;
+}
+
+static void test_posix_race_moves(void **state)
+{
+	exopal_posix posix;
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	uint8_t buf[16];
+	char path[64], port[8];
+	size_t len;
+	FILE *file;
+	int srv[2], i, old;
+
+	(void) state; /* unused */
+
+	// the platform on two addresses of the loopback interface
+	for (i = 0; i < 2; i++) {
+		srv[i] = socket(AF_INET, SOCK_DGRAM, 0);
+		assert_int_not_equal(srv[i], -1);
+		fcntl(srv[i], F_SETFL, O_NONBLOCK);
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(0x7F000001 + i);
+		if (i == 1)
+			addr.sin_port = htons(atoi(port));
+		assert_int_equal(bind(srv[i], (struct sockaddr *)&addr, sizeof(addr)), 0);
+		assert_int_equal(getsockname(srv[i], (struct sockaddr *)&addr, &addr_len), 0);
+		snprintf(port, sizeof(port), "%d", ntohs(addr.sin_port));
+	}
+
+	snprintf(path, sizeof(path), "/tmp/exotest-race-%d", (int)getpid());
+	file = fopen(path, "w");
+	assert_non_null(file);
+	fprintf(file, "exotest.invalid %s %lld\n127.0.0.1\n127.0.0.2\n", port, (long long)time(NULL) + 3600);
+	fclose(file);
+
+	memset(&posix, 0, sizeof(posix));
+	posix.host = "exotest.invalid";
+	posix.port = port;
+	posix.dns_cache_path = path;
+	assert_int_equal(exopal_posix_ops.init(&posix), 0);
+
+	// only the first answers, it gets the traffic
+	assert_int_equal(exopal_posix_ops.udp_sock(&posix), 0);
+	assert_int_equal(posix.addr_count, 2);
+	assert_int_equal(race_run(&posix, srv, 0), 2);
+	assert_int_not_equal(posix.sock, -1);
+	assert_int_equal(posix.addr_current, 0);
+	old = posix.sock;
+
+	// the next race is won by the other one, the socket in use stays until
+	// the library, told with a 3, reopens
+	posix.race_after = 0;
+	assert_int_equal(race_run(&posix, srv, 1), 3);
+	assert_int_equal(posix.sock, old);
+	assert_int_equal(posix.addr_current, 0);
+
+	// meanwhile it still gets what the platform sends to it
+	assert_int_equal(getsockname(old, (struct sockaddr *)&addr, &addr_len), 0);
+	assert_int_equal(sendto(srv[0], "\x50\x00\x00\x01", 4, 0, (struct sockaddr *)&addr, addr_len), 4);
+	usleep(10000);
+	assert_int_equal(exopal_posix_ops.udp_recv(&posix, buf, sizeof(buf), &len), 0);
+	assert_int_equal(len, 4);
+
+	// reopening goes straight to the winner without another race
+	assert_int_equal(exopal_posix_ops.udp_sock(&posix), 0);
+	assert_int_not_equal(posix.sock, -1);
+	assert_int_equal(posix.addr_current, 1);
+	assert_int_equal(posix.race.start, 0);
+	assert_int_equal(getpeername(posix.sock, (struct sockaddr *)&addr, &addr_len), 0);
+	assert_int_equal(ntohl(addr.sin_addr.s_addr), 0x7F000002);
+
+	exopal_posix_close(&posix);
+	close(srv[0]);
+	close(srv[1]);
+	unlink(path);
+}
+
+#define SIM_DEVICES 8
+#define SIM_HOURS 24
+
+static exosim sim;
+static exosim_device sim_devices[SIM_DEVICES];
+
+static void run_sim(uint32_t seed, exosim_stats *stats)
+{
+	assert_int_equal(exosim_init(&sim, sim_devices, SIM_DEVICES, seed), EXO_OK);
+
+	sim.up.dist = EXOSIM_DELAY_PARETO;
+	sim.up.delay_us = 20000;
+	sim.up.spread_us = 30000;
+	sim.up.loss_permille = 50;
+	sim.up.burst_permille = 10;
+	sim.up.burst_len = 4;
+	sim.up.duplicate_permille = 20;
+	sim.up.reorder_permille = 20;
+	sim.up.reorder_us = 100000;
+	sim.down = sim.up;
+	sim.write_interval_us = 60 * 1000000ULL;
+	sim.command_interval_us = 600 * 1000000ULL;
+
+	exosim_run(&sim, SIM_HOURS * 3600 * 1000000ULL);
+	*stats = sim.stats;
+}
+
+static void test_simulator(void **state)
+{
+	exosim_stats a, b;
+
+	(void) state; /* unused */
+
+	assert_int_equal(exosim_init(&sim, sim_devices, EXOSIM_MAX_DEVICES + 1, 1), EXO_GENERAL_ERROR);
+
+	// a day of eight devices on a bad link, twice over
+	run_sim(7, &a);
+	run_sim(7, &b);
+	assert_memory_equal(&a, &b, sizeof(a));
+
+	assert_int_equal(a.device_us, SIM_DEVICES * SIM_HOURS * 3600 * 1000000ULL);
+	assert_int_equal(a.writes, SIM_DEVICES * SIM_HOURS * 60);
+	assert_true(a.lost[0] > 0 && a.lost[1] > 0);
+	assert_true(a.duplicated[0] > 0 && a.duplicated[1] > 0);
+	assert_true(a.retransmits > 0);
+	assert_true(a.writes_ok > a.writes * 99 / 100);
+	assert_true(a.notifications > 0);
+	assert_int_equal(a.overflows, 0);
+	assert_true(exo_hist_percentile(&a.write_latency, 99) > exo_hist_percentile(&a.write_latency, 50));
+
+	run_sim(8, &b);
+	assert_true(memcmp(&a, &b, sizeof(a)) != 0);
+}
+
 int main(void) {
 	const struct CMUnitTest tests[] = {
-		cmocka_unit_test(null_test_success),
+		cmocka_unit_test(test_activate),
+		cmocka_unit_test(test_write),
+		cmocka_unit_test(test_read),
+		cmocka_unit_test(test_retransmit_on_timeout),
+		cmocka_unit_test(test_retransmit_keeps_token),
+		cmocka_unit_test(test_subscribe_notification),
+		cmocka_unit_test(test_rst_unknown_con),
+		cmocka_unit_test(test_hist_percentile),
+		cmocka_unit_test(test_write_latency),
+		cmocka_unit_test(test_flight_recorder),
+		cmocka_unit_test(test_submit_queue),
+		cmocka_unit_test(test_pool),
+		cmocka_unit_test(test_value_arena),
+		cmocka_unit_test(test_submit_threads),
+		cmocka_unit_test(test_background),
+		cmocka_unit_test(test_snapshot),
+		cmocka_unit_test(test_warm_restart),
+		cmocka_unit_test(test_warm_restart_pool),
+		cmocka_unit_test(test_reopen),
+		cmocka_unit_test(test_posix_log_rate_limit),
+		cmocka_unit_test(test_posix_log_full),
+		cmocka_unit_test(test_posix_dns_moved),
+		cmocka_unit_test(test_posix_race_moves),
+		cmocka_unit_test(test_simulator),
 	};
 	return cmocka_run_group_tests(tests, NULL, NULL);
 }
-
@@ -0,0 +1,718 @@
+/*****************************************************************************
+*
+*  Copyright (C) 2015 Exosite LLC
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*    Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+*
+*    Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the
+*    distribution.
+*
+*    Neither the name of Texas Instruments Incorporated nor the names of
+*    its contributors may be used to endorse or promote products derived
+*    from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+*  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+*  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+*  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+*  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+*  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+*  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+*  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+*  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*****************************************************************************/
+
+/*
+ * exoload - fleet load generator for the Exosite library
+ *
+ * Runs many simulated devices, each a context of its own on the posix PAL
+ * with its own socket, serial and CIK, against a server of your choosing,
+ * usually tools/mockserver. Every device keeps its subscriptions up and
+ * writes and reads on a schedule, all through the library's op engine, from
+ * one process or several forked ones. At the end it reports completed ops
+ * per second, latency percentiles from the libraries' own histograms,
+ * retransmits and the CPU time spent per device.
+ *
+ * Usage: exoload [-H host] [-p port] [-n devices] [-P processes] ...
+ *        (exoload -h lists them all)
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include "exosite.h"
+#include "exosite_pal.h"
+
+#define MAX_SUBS                8
+#define VALUE_MAX               64
+#define RESUBSCRIBE_US          5000000
+#define ACTIVATE_RETRY_US       100000
+#define EVENTS                  256
+
+enum { OP_WRITE, OP_READ, OP_SUB };
+
+typedef struct load_device
+{
+	exopal_posix posix;
+	exo_context ctx;
+	exo_op ops[OP_SUB + MAX_SUBS];
+	char values[OP_SUB + MAX_SUBS][VALUE_MAX];
+	char serial[24];
+	char cik[CIK_LENGTH + 1];
+	uint8_t has_cik;
+	uint64_t next_write;
+	uint64_t next_read;
+	uint64_t resubscribe_at;
+	uint64_t next_due;
+	int sock_fd;                // descriptor registered with epoll
+	uint32_t reopens;           // ctx.stats.reopens when it was
+} load_device;
+
+// what a process hands back to the parent
+typedef struct load_totals
+{
+	uint64_t writes;
+	uint64_t writes_ok;
+	uint64_t reads;
+	uint64_t reads_ok;
+	uint64_t notifications;
+	uint64_t sub_errors;
+	uint64_t sent;
+	uint64_t received;
+	uint64_t retransmits;
+	uint64_t failed;
+	uint32_t devices;
+	uint32_t activated;
+	double cpu_s;
+	exo_hist hist[EXO_HIST_COUNT];
+} load_totals;
+
+static const char *host = "127.0.0.1";
+static char host_addr[INET6_ADDRSTRLEN];
+static const char *port = "5683";
+static const char *write_alias = "load";
+static const char *read_alias = "load";
+static const char *vendor = "exoload";
+static const char *model = "exoload";
+static uint32_t device_count = 100;
+static uint32_t process_count = 1;
+static uint32_t sub_count = 1;
+static uint64_t duration_us = 60000000;
+static uint64_t ramp_us = 1000000;
+static uint64_t write_interval_us = 1000000;
+static uint64_t read_interval_us = 0;
+static uint8_t own_cik;
+static uint32_t rng = 1;
+
+static char sub_aliases[MAX_SUBS][8];
+
+static uint32_t load_rand(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+// the posix PAL keeps the CIK in a file, thousands of devices keep theirs here
+
+static uint8_t load_store_cik(void *pal, const char *cik)
+{
+	load_device *d = pal;
+
+	memcpy(d->cik, cik, CIK_LENGTH);
+	d->has_cik = 1;
+	return 0;
+}
+
+static uint8_t load_retrieve_cik(void *pal, char *cik)
+{
+	load_device *d = pal;
+
+	if (!d->has_cik)
+		return 1;
+
+	memcpy(cik, d->cik, CIK_LENGTH);
+	return 0;
+}
+
+static uint8_t load_init(void *pal)
+{
+	return exopal_posix_ops.init(&((load_device *)pal)->posix);
+}
+
+static uint8_t load_udp_sock(void *pal)
+{
+	return exopal_posix_ops.udp_sock(&((load_device *)pal)->posix);
+}
+
+static uint8_t load_udp_send(void *pal, const uint8_t *buf, size_t len)
+{
+	return exopal_posix_ops.udp_send(&((load_device *)pal)->posix, buf, len);
+}
+
+static uint8_t load_udp_recv(void *pal, uint8_t *buf, size_t size, size_t *rlen)
+{
+	return exopal_posix_ops.udp_recv(&((load_device *)pal)->posix, buf, size, rlen);
+}
+
+static uint64_t load_get_time(void *pal)
+{
+	return exopal_posix_ops.get_time(&((load_device *)pal)->posix);
+}
+
+static int load_udp_fd(void *pal)
+{
+	return exopal_posix_ops.udp_fd(&((load_device *)pal)->posix);
+}
+
+static const exo_pal_ops load_pal_ops = {
+	load_init,
+	load_store_cik,
+	load_retrieve_cik,
+	load_udp_sock,
+	load_udp_send,
+	load_udp_recv,
+	load_get_time,
+	load_udp_fd,
+};
+
+// the devices' clock, without going through one of them
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(EXOPAL_CLOCK, &ts);
+	return ts.tv_sec * (uint64_t)1000000 + ts.tv_nsec / 1000;
+}
+
+static double cpu_seconds(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+	       (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static void hist_merge(exo_hist *dst, const exo_hist *src)
+{
+	int i;
+
+	if (src->count == 0)
+		return;
+
+	if (dst->count == 0 || src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+	dst->count += src->count;
+	dst->sum += src->sum;
+	for (i = 0; i < EXO_HIST_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+}
+
+static int device_init(load_device *d, uint32_t index, uint64_t start)
+{
+	uint32_t i;
+
+	memset(d, 0, sizeof(*d));
+	d->sock_fd = -1;
+	d->posix.host = host;
+	d->posix.port = port;
+	snprintf(d->serial, sizeof(d->serial), "load%06" PRIu32, index);
+
+	// for servers that take any CIK, e.g. mockserver -c -
+	if (own_cik) {
+		snprintf(d->cik, sizeof(d->cik), "%040" PRIx32, index);
+		d->has_cik = 1;
+	}
+
+	if (exo_init(&d->ctx, &load_pal_ops, d, vendor, model, d->serial) != EXO_OK)
+		return 1;
+
+	// already provisioned, there is nothing to activate against
+	if (own_cik)
+		d->ctx.device_state = EXO_STATE_GOOD;
+
+	for (i = 0; i < OP_SUB + MAX_SUBS; i++)
+		exo_op_init(&d->ops[i]);
+
+	// spread the fleet's start over the ramp, and its writes over an interval
+	d->next_due = start + ramp_us * index / device_count;
+	d->next_write = d->next_due + (write_interval_us ? load_rand() % write_interval_us : 0);
+	d->next_read = d->next_due + (read_interval_us ? load_rand() % read_interval_us : 0);
+	d->resubscribe_at = d->next_due;
+
+	return 0;
+}
+
+static void device_schedule(load_device *d, load_totals *t, uint64_t now)
+{
+	exo_op *op;
+	uint32_t i;
+
+	if (write_interval_us != 0 && d->next_write <= now) {
+		d->next_write += write_interval_us;
+		if (d->next_write <= now)
+			d->next_write = now + write_interval_us;
+
+		// a write still outstanding is skipped, like a sensor would
+		if (d->ops[OP_WRITE].type == EXO_NULL) {
+			snprintf(d->values[OP_WRITE], VALUE_MAX, "%" PRIu64, now);
+			exo_write(&d->ops[OP_WRITE], write_alias, d->values[OP_WRITE]);
+			t->writes++;
+		}
+	}
+
+	if (read_interval_us != 0 && d->next_read <= now) {
+		d->next_read += read_interval_us;
+		if (d->next_read <= now)
+			d->next_read = now + read_interval_us;
+
+		if (d->ops[OP_READ].type == EXO_NULL) {
+			exo_read(&d->ops[OP_READ], read_alias, d->values[OP_READ], VALUE_MAX);
+			t->reads++;
+		}
+	}
+
+	for (i = 0; i < sub_count && d->resubscribe_at <= now; i++) {
+		op = &d->ops[OP_SUB + i];
+		if (op->type == EXO_NULL)
+			exo_subscribe(op, sub_aliases[i], d->values[OP_SUB + i], VALUE_MAX);
+	}
+}
+
+// sleep until the next timer or schedule, sockets wake us up before that
+static uint64_t device_next_due(load_device *d, uint64_t now)
+{
+	uint64_t next = now + 1000000;
+	exo_op *op;
+	uint32_t i;
+
+	// the library's timers expire on the microsecond after their deadline
+	op = &d->ctx.activation;
+	if (d->ctx.device_state != EXO_STATE_GOOD) {
+		if (op->state == EXO_REQUEST_PENDING && op->timeout + 1 < next)
+			return op->timeout + 1;
+		// activation failed, don't hammer the server with new ones
+		if (op->state != EXO_REQUEST_PENDING)
+			return now + ACTIVATE_RETRY_US;
+		return next;
+	}
+
+	if (write_interval_us != 0 && d->next_write < next)
+		next = d->next_write;
+	if (read_interval_us != 0 && d->next_read < next)
+		next = d->next_read;
+
+	for (i = 0; i < OP_SUB + sub_count; i++) {
+		op = &d->ops[i];
+		if (op->state == EXO_REQUEST_PENDING || op->state == EXO_REQUEST_SUBSCRIBED) {
+			if (op->timeout + 1 < next)
+				next = op->timeout + 1;
+		} else if (i >= OP_SUB && op->type == EXO_NULL && d->resubscribe_at < next) {
+			next = d->resubscribe_at;
+		}
+	}
+
+	return next;
+}
+
+// the PAL may open a new socket on reconnect, often under the closed one's number
+static void device_watch(int epfd, load_device *d, uint32_t index)
+{
+	struct epoll_event add;
+	int fd = load_udp_fd(d);
+
+	if (fd == d->sock_fd && d->ctx.stats.reopens == d->reopens)
+		return;
+
+	if (d->sock_fd != -1)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, d->sock_fd, NULL);
+
+	d->sock_fd = -1;
+	d->reopens = d->ctx.stats.reopens;
+	if (fd == -1)
+		return;
+
+	memset(&add, 0, sizeof(add));
+	add.events = EPOLLIN;
+	add.data.u32 = index;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &add) == 0)
+		d->sock_fd = fd;
+}
+
+static void device_run(load_device *d, load_totals *t, uint64_t now)
+{
+	exo_op *op;
+	uint32_t i;
+
+	// nothing but activation until there is a CIK to use
+	if (d->ctx.device_state == EXO_STATE_GOOD)
+		device_schedule(d, t, now);
+
+	for (i = 0; i < 8 && exo_operate(&d->ctx, d->ops, OP_SUB + sub_count) == EXO_BUSY; i++)
+		;
+
+	op = &d->ops[OP_WRITE];
+	if (exo_is_op_finished(op)) {
+		t->writes_ok += exo_is_op_success(op);
+		exo_op_init(op);
+	}
+
+	op = &d->ops[OP_READ];
+	if (exo_is_op_finished(op)) {
+		t->reads_ok += exo_is_op_success(op);
+		exo_op_init(op);
+	}
+
+	for (i = 0; i < sub_count; i++) {
+		op = &d->ops[OP_SUB + i];
+		if (exo_is_op_success(op)) {
+			t->notifications++;
+			exo_op_done(op);
+		} else if (op->state == EXO_REQUEST_ERROR) {
+			t->sub_errors++;
+			exo_op_init(op);
+			d->resubscribe_at = d->ctx.now + RESUBSCRIBE_US;
+		}
+	}
+
+	d->next_due = device_next_due(d, now);
+}
+
+static int run_devices(uint32_t first, uint32_t count, load_totals *t)
+{
+	struct epoll_event ev[EVENTS];
+	load_device *devices, *d;
+	uint64_t start, end, now, next;
+	double cpu;
+	int epfd, n, timeout;
+	uint32_t i;
+
+	memset(t, 0, sizeof(*t));
+	t->devices = count;
+
+	devices = calloc(count, sizeof(*devices));
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (devices == NULL || epfd == -1) {
+		perror("exoload");
+		return 1;
+	}
+
+	rng ^= first * 2654435761u;
+	if (rng == 0)
+		rng = 1;
+
+	start = now_us();
+	for (i = 0; i < count; i++) {
+		d = &devices[i];
+		if (device_init(d, first + i, start) != 0) {
+			fprintf(stderr, "device %" PRIu32 " failed to initialize, is the file descriptor limit high enough?\n",
+			        first + i);
+			return 1;
+		}
+
+		device_watch(epfd, d, i);
+	}
+
+	cpu = cpu_seconds();
+	start = now_us();
+	end = start + duration_us;
+
+	for (now = start; now < end; now = now_us()) {
+		next = end;
+		for (i = 0; i < count; i++) {
+			d = &devices[i];
+			if (d->next_due <= now) {
+				device_run(d, t, now);
+				device_watch(epfd, d, i);
+			}
+			if (d->next_due < next)
+				next = d->next_due;
+		}
+
+		now = now_us();
+		timeout = next <= now ? 0 : (int)((next - now + 999) / 1000);
+		n = epoll_wait(epfd, ev, EVENTS, timeout);
+
+		now = now_us();
+		while (n > 0) {
+			for (i = 0; i < (uint32_t)n; i++) {
+				d = &devices[ev[i].data.u32];
+				device_run(d, t, now);
+				device_watch(epfd, d, ev[i].data.u32);
+			}
+			// a full batch means more may be waiting
+			n = n == EVENTS ? epoll_wait(epfd, ev, EVENTS, 0) : 0;
+		}
+	}
+
+	t->cpu_s = cpu_seconds() - cpu;
+
+	for (i = 0; i < count; i++) {
+		exo_stats stats;
+		exo_hist hist;
+		int h;
+
+		d = &devices[i];
+		exo_get_stats(&d->ctx, &stats);
+		t->sent += stats.sent;
+		t->received += stats.received;
+		t->retransmits += stats.retransmits;
+		t->failed += stats.error_timeout + stats.error_response + stats.error_reset;
+		t->activated += d->ctx.device_state == EXO_STATE_GOOD;
+
+		for (h = 0; h < EXO_HIST_COUNT; h++) {
+			exo_get_hist(&d->ctx, h, &hist);
+			hist_merge(&t->hist[h], &hist);
+		}
+
+		exopal_posix_close(&d->posix);
+	}
+
+	close(epfd);
+	free(devices);
+
+	return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, p, len)) <= 0)
+			return 1;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = read(fd, p, len)) <= 0)
+			return 1;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static void merge(load_totals *dst, const load_totals *src)
+{
+	int h;
+
+	dst->writes += src->writes;
+	dst->writes_ok += src->writes_ok;
+	dst->reads += src->reads;
+	dst->reads_ok += src->reads_ok;
+	dst->notifications += src->notifications;
+	dst->sub_errors += src->sub_errors;
+	dst->sent += src->sent;
+	dst->received += src->received;
+	dst->retransmits += src->retransmits;
+	dst->failed += src->failed;
+	dst->devices += src->devices;
+	dst->activated += src->activated;
+	dst->cpu_s += src->cpu_s;
+
+	for (h = 0; h < EXO_HIST_COUNT; h++)
+		hist_merge(&dst->hist[h], &src->hist[h]);
+}
+
+static void report(const load_totals *t)
+{
+	static const char *names[] = {"read", "write", "subscribe", "activate"};
+	double secs = duration_us / 1e6;
+	int h;
+
+	printf("devices %" PRIu32 " activated %" PRIu32 " processes %" PRIu32 " seconds %.1f\n",
+	       t->devices, t->activated, process_count, secs);
+	printf("writes %" PRIu64 " ok %" PRIu64 " (%.1f/s)  reads %" PRIu64 " ok %" PRIu64 " (%.1f/s)\n",
+	       t->writes, t->writes_ok, t->writes_ok / secs, t->reads, t->reads_ok, t->reads_ok / secs);
+	printf("notifications %" PRIu64 " (%.1f/s)  subscribe errors %" PRIu64 "  failed ops %" PRIu64 "\n",
+	       t->notifications, t->notifications / secs, t->sub_errors, t->failed);
+	printf("ops/s %.1f\n", (t->writes_ok + t->reads_ok + t->notifications) / secs);
+	printf("datagrams sent %" PRIu64 " received %" PRIu64 " retransmits %" PRIu64 " (%.2f%% of sent)\n",
+	       t->sent, t->received, t->retransmits, t->sent ? 100.0 * t->retransmits / t->sent : 0);
+
+	for (h = EXO_HIST_READ; h <= EXO_HIST_ACTIVATE; h++) {
+		if (t->hist[h].count == 0)
+			continue;
+		printf("%-9s rtt ms  p50 %.2f  p99 %.2f  max %.2f  (%" PRIu32 ")\n", names[h],
+		       exo_hist_percentile(&t->hist[h], 50) / 1000.0,
+		       exo_hist_percentile(&t->hist[h], 99) / 1000.0,
+		       t->hist[h].max / 1000.0, t->hist[h].count);
+	}
+
+	printf("cpu %.2f s, %.1f us per device-second, %.1f%% of a core\n",
+	       t->cpu_s, t->devices ? t->cpu_s * 1e6 / t->devices / secs : 0,
+	       100.0 * t->cpu_s / secs);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+	        "usage: %s [options]\n"
+	        "  -H host        server to load (127.0.0.1)\n"
+	        "  -p port        its port (5683)\n"
+	        "  -n devices     simulated devices (100)\n"
+	        "  -P processes   processes to spread them over (1)\n"
+	        "  -t seconds     how long to run (60)\n"
+	        "  -R seconds     ramp up, device starts are spread over it (1)\n"
+	        "  -w ms          write interval per device, 0 none (1000)\n"
+	        "  -r ms          read interval per device, 0 none (0)\n"
+	        "  -a alias       alias written and read (load)\n"
+	        "  -s count       subscriptions per device, to sub0, sub1, ... (1, max %d)\n"
+	        "  -k             give each device a CIK of its own instead of activating,\n"
+	        "                 for servers accepting any (mockserver -c -)\n"
+	        "  -S seed        random seed for schedules (1)\n",
+	        name, MAX_SUBS);
+}
+
+static int resolve_host(void)
+{
+	struct addrinfo hints, *res;
+	int rv;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_DGRAM;
+	if ((rv = getaddrinfo(host, port, &hints, &res)) != 0)
+		return rv;
+
+	rv = getnameinfo(res->ai_addr, res->ai_addrlen, host_addr, sizeof(host_addr),
+	                 NULL, 0, NI_NUMERICHOST);
+	freeaddrinfo(res);
+	return rv;
+}
+
+int main(int argc, char **argv)
+{
+	load_totals total, part;
+	struct rlimit lim;
+	uint32_t p, per;
+	int opt, fds[2], *pipes, ret = 0;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "H:p:n:P:t:R:w:r:a:s:kS:h")) != -1) {
+		switch (opt) {
+			case 'H': host = optarg; break;
+			case 'p': port = optarg; break;
+			case 'n': device_count = strtoul(optarg, NULL, 0); break;
+			case 'P': process_count = strtoul(optarg, NULL, 0); break;
+			case 't': duration_us = strtod(optarg, NULL) * 1e6; break;
+			case 'R': ramp_us = strtod(optarg, NULL) * 1e6; break;
+			case 'w': write_interval_us = strtoull(optarg, NULL, 0) * 1000; break;
+			case 'r': read_interval_us = strtoull(optarg, NULL, 0) * 1000; break;
+			case 'a': write_alias = read_alias = optarg; break;
+			case 's': sub_count = strtoul(optarg, NULL, 0); break;
+			case 'k': own_cik = 1; break;
+			case 'S': rng = strtoul(optarg, NULL, 0); break;
+			default:
+				usage(argv[0]);
+				return 2;
+		}
+	}
+
+	if (device_count == 0 || process_count == 0 || process_count > device_count ||
+	    sub_count > MAX_SUBS || rng == 0) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	for (p = 0; p < MAX_SUBS; p++)
+		snprintf(sub_aliases[p], sizeof(sub_aliases[p]), "sub%" PRIu32, p);
+
+	// resolve once here, not once per device, and so every device has its
+	// socket right after exo_init()
+	if ((opt = resolve_host()) != 0) {
+		fprintf(stderr, "exoload: %s: %s\n", host, gai_strerror(opt));
+		return 1;
+	}
+	host = host_addr;
+
+	// one socket per device
+	if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+		lim.rlim_cur = lim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &lim);
+	}
+
+	memset(&total, 0, sizeof(total));
+	per = device_count / process_count;
+
+	if (process_count == 1) {
+		ret = run_devices(0, device_count, &total);
+		report(&total);
+		return ret;
+	}
+
+	// a pipe each, the totals are bigger than PIPE_BUF so writes could mix
+	pipes = calloc(process_count, sizeof(*pipes));
+	if (pipes == NULL)
+		return 1;
+
+	for (p = 0; p < process_count; p++) {
+		uint32_t first = p * per;
+		uint32_t count = p == process_count - 1 ? device_count - first : per;
+
+		if (pipe(fds) != 0 || (pid = fork()) == -1) {
+			perror("exoload");
+			return 1;
+		}
+
+		if (pid == 0) {
+			close(fds[0]);
+			if (run_devices(first, count, &part) != 0)
+				_exit(1);
+			_exit(write_all(fds[1], &part, sizeof(part)));
+		}
+
+		close(fds[1]);
+		pipes[p] = fds[0];
+	}
+
+	for (p = 0; p < process_count; p++) {
+		if (read_all(pipes[p], &part, sizeof(part)) == 0)
+			merge(&total, &part);
+		else
+			ret = 1;
+		close(pipes[p]);
+	}
+
+	while (wait(&opt) > 0)
+		ret |= !WIFEXITED(opt) || WEXITSTATUS(opt) != 0;
+
+	free(pipes);
+	report(&total);
+
+	return ret;
+}
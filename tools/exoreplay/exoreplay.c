@@ -0,0 +1,780 @@
+/*****************************************************************************
+*
+*  Copyright (C) 2015 Exosite LLC
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*    Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+*
+*    Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the
+*    distribution.
+*
+*    Neither the name of Texas Instruments Incorporated nor the names of
+*    its contributors may be used to endorse or promote products derived
+*    from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+*  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+*  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+*  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+*  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+*  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+*  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+*  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+*  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*****************************************************************************/
+
+
+/*
+ * exoreplay - replays captured Exosite CoAP traffic through the op engine
+ *
+ * Reads pcap captures (tcpdump or `exo_dump_pcap()` output) and plays every
+ * client in them back as a context of its own on the loopback PAL. Requests
+ * the client sent become ops submitted at the same moment, what the server
+ * sent is injected at the moment it arrived, with MIDs and tokens rewritten
+ * to the ones the replayed ops use. Timers run on the capture's clock, so
+ * Max-Age refresh waves, idle stretches and bursts of pushes hit the engine
+ * the way they did in the field, as fast as possible or, with -r, in real
+ * time. Reports how long `exo_operate()` took per datagram and how long ops
+ * took to complete.
+ *
+ * The library's own retransmits and refreshes stand in for the ones in the
+ * capture, a refresh in the capture only moves the library's forward.
+ *
+ * Usage: exoreplay [-p port] [-r] capture.pcap ...
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "exosite.h"
+#include "exosite_pal.h"
+#include "coap.h"
+
+#define MAX_CLIENTS             256
+#define MAX_SLOTS               64
+#define ALIAS_MAX               64
+#define VALUE_MAX               256
+#define MAX_PACKET              65536
+#define START_US                1000000
+
+#define LINKTYPE_NULL           0
+#define LINKTYPE_ETHERNET       1
+#define LINKTYPE_RAW            101
+#define LINKTYPE_LINUX_SLL      113
+#define LINKTYPE_IPV4           228
+#define LINKTYPE_IPV6           229
+
+enum { KIND_WRITE, KIND_READ, KIND_SUBSCRIBE, KINDS };
+
+typedef struct event
+{
+	uint64_t time;
+	size_t seq;                 // position in the capture, keeps the sort stable
+	size_t off;
+	uint16_t len;
+	uint16_t client;
+	uint8_t from_client;
+} event;
+
+// one op of a client and what the capture called it
+typedef struct slot
+{
+	uint64_t orig_token;
+	uint64_t submitted;
+	uint16_t orig_mid;
+	uint8_t used;
+	uint8_t completed;
+	char alias[ALIAS_MAX];
+	char value[VALUE_MAX];
+} slot;
+
+typedef struct client
+{
+	uint64_t key;
+	exo_context ctx;
+	exopal_loopback lb;
+	exo_op ops[MAX_SLOTS];
+	slot slots[MAX_SLOTS];
+	char serial[24];
+	char cik[CIK_LENGTH + 1];
+	uint16_t activate_mid;
+	uint8_t has_activate_mid;
+	uint8_t seen_request;       // activates if its first request did
+	uint8_t activates;
+	uint64_t next_due;
+} client;
+
+static client *clients[MAX_CLIENTS];
+static uint32_t client_count;
+
+static event *events;
+static size_t event_count, event_max;
+static uint8_t *bytes;
+static size_t bytes_used, bytes_max;
+
+static uint16_t server_port = 5683;
+static uint8_t realtime;
+static uint64_t first_time;
+
+static uint64_t total_packets, truncated, skipped_clients;
+static uint64_t inbound, outbound, unmatched, trace_retransmits, refreshes, dropped;
+static uint64_t submitted[KINDS], succeeded[KINDS], failed[KINDS], notifications;
+static uint64_t sent_by_library, operate_calls, engine_ns;
+static exo_hist latency[KINDS];         // submitted to completed, capture time us
+static exo_hist engine_in;              // exo_operate() per inbound datagram, ns
+static exo_hist engine_out;             // exo_operate() per submission, ns
+
+static uint64_t fnv1a(uint64_t h, const uint8_t *p, size_t len)
+{
+	while (len--) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void count_sent(exopal_loopback *lb, const uint8_t *buf, size_t len, void *peer_data)
+{
+	sent_by_library++;
+}
+
+
+//
+// Capture loading
+//
+
+static void add_event(uint64_t time, uint64_t key, uint8_t from_client, const uint8_t *buf, size_t len)
+{
+	uint32_t i;
+	client *c;
+	event *e;
+
+	for (i = 0; i < client_count && clients[i]->key != key; i++)
+		;
+
+	if (i == client_count) {
+		if (client_count == MAX_CLIENTS) {
+			skipped_clients++;
+			return;
+		}
+		if ((clients[i] = calloc(1, sizeof(client))) == NULL) {
+			perror("exoreplay");
+			exit(1);
+		}
+		clients[i]->key = key;
+		client_count++;
+	}
+	c = clients[i];
+
+	// a client whose first request is a dataport one was provisioned before
+	// the capture started, it gets the CIK that request carried
+	if (from_client && !c->seen_request && len > 4) {
+		uint8_t pbuf[MAX_PACKET];
+		coap_pdu pdu = {pbuf, len, sizeof(pbuf)};
+		coap_option opt;
+
+		memcpy(pbuf, buf, len);
+		if (coap_validate_pkt(&pdu) == CE_NONE && coap_get_type(&pdu) == CT_CON &&
+		    coap_get_code_class(&pdu) == 0 && coap_get_code(&pdu) != CC_EMPTY) {
+			c->seen_request = 1;
+			opt = coap_get_option_by_num(&pdu, CON_URI_PATH, 0);
+			c->activates = opt.len == 9 && memcmp(opt.val, "provision", 9) == 0;
+			opt = coap_get_option_by_num(&pdu, CON_URI_QUERY, 0);
+			if (opt.len == CIK_LENGTH)
+				memcpy(c->cik, opt.val, CIK_LENGTH);
+		}
+	}
+
+	if (event_count == event_max) {
+		event_max = event_max ? event_max * 2 : 4096;
+		if ((events = realloc(events, event_max * sizeof(*events))) == NULL) {
+			perror("exoreplay");
+			exit(1);
+		}
+	}
+	while (bytes_used + len > bytes_max) {
+		bytes_max = bytes_max ? bytes_max * 2 : 1 << 20;
+		if ((bytes = realloc(bytes, bytes_max)) == NULL) {
+			perror("exoreplay");
+			exit(1);
+		}
+	}
+
+	e = &events[event_count];
+	e->time = time;
+	e->seq = event_count++;
+	e->off = bytes_used;
+	e->len = len;
+	e->client = i;
+	e->from_client = from_client;
+	memcpy(bytes + bytes_used, buf, len);
+	bytes_used += len;
+}
+
+static void handle_udp(uint64_t time, const uint8_t *addr, size_t addr_len,
+                       const uint8_t *udp, size_t len, size_t orig_len)
+{
+	uint16_t sport, dport, ulen;
+	uint64_t key;
+
+	if (len < 8)
+		return;
+
+	sport = (udp[0] << 8) | udp[1];
+	dport = (udp[2] << 8) | udp[3];
+	ulen = (udp[4] << 8) | udp[5];
+
+	// snapped datagrams are replayed as far as they were captured
+	if (ulen > len || orig_len > len)
+		truncated++;
+	if (ulen < 8 || ulen > len)
+		ulen = len;
+	if (ulen - 8 > EXOPAL_LOOPBACK_MTU)
+		return;
+
+	if (dport == server_port) {
+		key = fnv1a(0xcbf29ce484222325ULL, addr, addr_len);  // source
+		key = fnv1a(key, udp, 2);
+		add_event(time, key, 1, udp + 8, ulen - 8);
+	} else if (sport == server_port) {
+		key = fnv1a(0xcbf29ce484222325ULL, addr + addr_len, addr_len);  // destination
+		key = fnv1a(key, udp + 2, 2);
+		add_event(time, key, 0, udp + 8, ulen - 8);
+	}
+}
+
+static void handle_ip(uint64_t time, const uint8_t *ip, size_t len, size_t orig_len)
+{
+	size_t hlen;
+
+	if (len < 1)
+		return;
+
+	if ((ip[0] >> 4) == 4) {
+		hlen = (ip[0] & 0x0F) * 4;
+		if (len < 20 || hlen < 20 || hlen > len || ip[9] != 17 || (((ip[6] & 0x1F) << 8) | ip[7]) != 0)
+			return;
+		handle_udp(time, ip + 12, 4, ip + hlen, len - hlen, orig_len - hlen);
+	} else if ((ip[0] >> 4) == 6) {
+		if (len < 40 || ip[6] != 17)
+			return;
+		handle_udp(time, ip + 8, 16, ip + 40, len - 40, orig_len - 40);
+	}
+}
+
+static void handle_frame(uint32_t linktype, uint64_t time, const uint8_t *buf, size_t len, size_t orig_len)
+{
+	size_t off = 0;
+	uint16_t ethertype;
+
+	switch (linktype) {
+		case LINKTYPE_NULL:
+			off = 4;
+			break;
+		case LINKTYPE_ETHERNET:
+			if (len < 14)
+				return;
+			off = 12;
+			ethertype = (buf[off] << 8) | buf[off + 1];
+			while ((ethertype == 0x8100 || ethertype == 0x88A8) && off + 6 <= len) {
+				off += 4;
+				ethertype = (buf[off] << 8) | buf[off + 1];
+			}
+			if (ethertype != 0x0800 && ethertype != 0x86DD)
+				return;
+			off += 2;
+			break;
+		case LINKTYPE_LINUX_SLL:
+			off = 16;
+			break;
+		case LINKTYPE_RAW:
+		case LINKTYPE_IPV4:
+		case LINKTYPE_IPV6:
+			break;
+		default:
+			return;
+	}
+
+	if (off < len)
+		handle_ip(time, buf + off, len - off, orig_len - off);
+}
+
+// captures merged or taken on several interfaces needn't be in time order
+static int event_cmp(const void *a, const void *b)
+{
+	const event *x = a, *y = b;
+
+	if (x->time != y->time)
+		return x->time < y->time ? -1 : 1;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static uint32_t swap32(uint32_t v)
+{
+	return (v >> 24) | ((v >> 8) & 0xFF00) | ((v << 8) & 0xFF0000) | (v << 24);
+}
+
+static int read_capture(const char *path)
+{
+	static uint8_t buf[MAX_PACKET];
+	FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+	uint32_t hdr[6], rec[4];
+	int swapped, nanos;
+	uint64_t time;
+	size_t i;
+
+	if (f == NULL) {
+		perror(path);
+		return 1;
+	}
+
+	if (fread(hdr, sizeof(hdr), 1, f) != 1) {
+		fprintf(stderr, "%s: too short for a pcap file\n", path);
+		goto fail;
+	}
+
+	swapped = hdr[0] == 0xd4c3b2a1 || hdr[0] == 0x4d3cb2a1;
+	if (swapped)
+		for (i = 0; i < 6; i++)
+			hdr[i] = swap32(hdr[i]);
+
+	if (hdr[0] != 0xa1b2c3d4 && hdr[0] != 0xa1b23c4d) {
+		fprintf(stderr, "%s: not a pcap file (pcapng isn't supported, convert with editcap -F pcap)\n", path);
+		goto fail;
+	}
+	nanos = hdr[0] == 0xa1b23c4d;
+
+	while (fread(rec, sizeof(rec), 1, f) == 1) {
+		if (swapped)
+			for (i = 0; i < 4; i++)
+				rec[i] = swap32(rec[i]);
+
+		if (rec[2] > sizeof(buf)) {
+			fprintf(stderr, "%s: record of %u bytes, file is corrupt\n", path, rec[2]);
+			goto fail;
+		}
+		if (fread(buf, 1, rec[2], f) != rec[2])
+			break;
+
+		time = rec[0] * 1000000ULL + (nanos ? rec[1] / 1000 : rec[1]);
+		if (total_packets++ == 0 || time < first_time)
+			first_time = time;
+
+		handle_frame(hdr[5] & 0x0FFFFFFF, time, buf, rec[2], rec[3] > rec[2] ? rec[3] : rec[2]);
+	}
+
+	if (f != stdin)
+		fclose(f);
+	return 0;
+
+fail:
+	if (f != stdin)
+		fclose(f);
+	return 1;
+}
+
+
+//
+// Replay
+//
+
+static int kind_of(exo_op *op)
+{
+	switch (op->type) {
+		case EXO_WRITE: return KIND_WRITE;
+		case EXO_READ: return KIND_READ;
+		default: return KIND_SUBSCRIBE;
+	}
+}
+
+static void collect(client *c)
+{
+	uint64_t now = c->lb.time;
+	exo_op *op;
+	slot *s;
+	int i, kind;
+
+	for (i = 0; i < MAX_SLOTS; i++) {
+		s = &c->slots[i];
+		op = &c->ops[i];
+		if (!s->used)
+			continue;
+
+		kind = kind_of(op);
+		if (kind == KIND_SUBSCRIBE && exo_is_op_success(op)) {
+			// the first value is the subscribe completing, later ones are pushes
+			if (!s->completed) {
+				s->completed = 1;
+				succeeded[kind]++;
+				exo_hist_record(&latency[kind], now - s->submitted);
+			} else {
+				notifications++;
+			}
+			exo_op_done(op);
+		} else if (exo_is_op_finished(op)) {
+			if (exo_is_op_success(op)) {
+				succeeded[kind]++;
+				exo_hist_record(&latency[kind], now - s->submitted);
+			} else {
+				failed[kind]++;
+			}
+			exo_op_init(op);
+			s->used = 0;
+		}
+	}
+}
+
+static uint64_t next_due(client *c)
+{
+	uint64_t next = UINT64_MAX;
+	exo_op *op;
+	int i;
+
+	for (i = -1; i < MAX_SLOTS; i++) {
+		op = i < 0 ? &c->ctx.activation : &c->ops[i];
+		if ((op->state == EXO_REQUEST_PENDING || op->state == EXO_REQUEST_SUBSCRIBED) &&
+		    op->timeout + 1 < next)
+			next = op->timeout + 1;
+	}
+
+	return next;
+}
+
+static void run(client *c, uint64_t now, exo_hist *hist)
+{
+	uint64_t start;
+	int i;
+
+	c->lb.time = now;
+
+	start = now_ns();
+	for (i = 0; i < 8; i++) {
+		operate_calls++;
+		if (exo_operate(&c->ctx, c->ops, MAX_SLOTS) != EXO_BUSY)
+			break;
+	}
+	start = now_ns() - start;
+
+	engine_ns += start;
+	if (hist != NULL)
+		exo_hist_record(hist, start);
+
+	collect(c);
+	c->next_due = next_due(c);
+}
+
+static slot *find_slot(client *c, uint8_t by_token, uint64_t id, exo_op **op)
+{
+	int i;
+
+	for (i = 0; i < MAX_SLOTS; i++) {
+		if (!c->slots[i].used)
+			continue;
+		if (by_token ? c->slots[i].orig_token == id : c->slots[i].orig_mid == id) {
+			*op = &c->ops[i];
+			return &c->slots[i];
+		}
+	}
+
+	return NULL;
+}
+
+static void submit(client *c, uint64_t now, coap_pdu *pdu)
+{
+	coap_option opt;
+	char alias[ALIAS_MAX];
+	uint32_t observe = 0;
+	uint8_t has_observe = 0;
+	coap_payload payload;
+	exo_op *op;
+	slot *s;
+	int i;
+
+	if (coap_get_type(pdu) != CT_CON || coap_get_code_class(pdu) != 0 || coap_get_code(pdu) == CC_EMPTY)
+		return;
+
+	opt = coap_get_option_by_num(pdu, CON_URI_PATH, 0);
+	if (opt.len == 9 && memcmp(opt.val, "provision", 9) == 0) {
+		c->activate_mid = coap_get_mid(pdu);
+		c->has_activate_mid = 1;
+		return;
+	}
+	if (opt.len != 2 || memcmp(opt.val, "1a", 2) != 0)
+		return;
+
+	opt = coap_get_option_by_num(pdu, CON_URI_PATH, 1);
+	if (opt.num == 0 || opt.len >= ALIAS_MAX)
+		return;
+	memcpy(alias, opt.val, opt.len);
+	alias[opt.len] = 0;
+
+	opt = coap_get_option_by_num(pdu, CON_OBSERVE, 0);
+	if (opt.num != 0) {
+		has_observe = 1;
+		for (i = 0; i < opt.len; i++)
+			observe = (observe << 8) | opt.val[i];
+	}
+
+	// the same request again, the library does its own retransmits
+	if (find_slot(c, 0, coap_get_mid(pdu), &op) != NULL) {
+		trace_retransmits++;
+		return;
+	}
+
+	if (has_observe && observe == 0) {
+		for (i = 0; i < MAX_SLOTS; i++) {
+			s = &c->slots[i];
+			op = &c->ops[i];
+			if (!s->used || kind_of(op) != KIND_SUBSCRIBE || strcmp(s->alias, alias) != 0)
+				continue;
+
+			// a refresh, answer it on the op that is already there
+			s->orig_token = coap_get_token(pdu);
+			s->orig_mid = coap_get_mid(pdu);
+			if (op->state == EXO_REQUEST_SUBSCRIBED)
+				op->timeout = now;
+			refreshes++;
+			run(c, now, &engine_out);
+			return;
+		}
+	} else if (has_observe) {
+		return;                     // deregistration, no op for that
+	}
+
+	for (i = 0; i < MAX_SLOTS && c->slots[i].used; i++)
+		;
+	if (i == MAX_SLOTS) {
+		dropped++;
+		return;
+	}
+
+	s = &c->slots[i];
+	op = &c->ops[i];
+	memset(s, 0, sizeof(*s));
+	s->used = 1;
+	s->submitted = now;
+	s->orig_token = coap_get_token(pdu);
+	s->orig_mid = coap_get_mid(pdu);
+	strcpy(s->alias, alias);
+
+	if (coap_get_code(pdu) == CC_GET && has_observe) {
+		exo_subscribe(op, s->alias, s->value, VALUE_MAX);
+		submitted[KIND_SUBSCRIBE]++;
+	} else if (coap_get_code(pdu) == CC_GET) {
+		exo_read(op, s->alias, s->value, VALUE_MAX);
+		submitted[KIND_READ]++;
+	} else {
+		payload = coap_get_payload(pdu);
+		if (payload.len >= VALUE_MAX)
+			payload.len = VALUE_MAX - 1;
+		memcpy(s->value, payload.val, payload.len);
+		exo_write(op, s->alias, s->value);
+		submitted[KIND_WRITE]++;
+	}
+
+	run(c, now, &engine_out);
+}
+
+static void deliver(client *c, uint64_t now, coap_pdu *pdu)
+{
+	uint8_t type = coap_get_type(pdu);
+	exo_op *op = NULL;
+
+	if (type == CT_ACK || type == CT_RST) {
+		if (c->has_activate_mid && coap_get_mid(pdu) == c->activate_mid)
+			op = &c->ctx.activation;
+		else
+			find_slot(c, 0, coap_get_mid(pdu), &op);
+
+		if (op != NULL) {
+			coap_set_mid(pdu, op->mid);
+			if (coap_get_tkl(pdu) != 0)
+				coap_set_token(pdu, op->token, op->tkl);
+		}
+	} else if (find_slot(c, 1, coap_get_token(pdu), &op) != NULL) {
+		coap_set_token(pdu, op->token, op->tkl);
+	}
+
+	if (op == NULL)
+		unmatched++;
+
+	exopal_loopback_inject(&c->lb, pdu->buf, pdu->len);
+	run(c, now, &engine_in);
+}
+
+static void sleep_until(uint64_t wall_start, uint64_t t)
+{
+	uint64_t now = now_ns() / 1000, due = wall_start + t - START_US;
+	struct timespec ts;
+
+	if (due > now) {
+		ts.tv_sec = (due - now) / 1000000;
+		ts.tv_nsec = (due - now) % 1000000 * 1000;
+		nanosleep(&ts, NULL);
+	}
+}
+
+static void replay(void)
+{
+	uint8_t buf[EXOPAL_LOOPBACK_MTU + 8];
+	uint64_t t, wall_start = now_ns() / 1000, end;
+	uint32_t i;
+	size_t n;
+	client *c;
+
+	for (i = 0; i < client_count; i++) {
+		c = clients[i];
+		c->lb.peer = count_sent;
+		c->lb.time = START_US;
+		snprintf(c->serial, sizeof(c->serial), "replay%03" PRIu32, i);
+		if (!c->activates && c->cik[0] != 0)
+			exopal_loopback_set_cik(&c->lb, c->cik);
+
+		exo_init(&c->ctx, &exopal_loopback_ops, &c->lb, "exoreplay", "exoreplay", c->serial);
+		for (n = 0; n < MAX_SLOTS; n++)
+			exo_op_init(&c->ops[n]);
+
+		// provisioned before the capture, nothing to activate against
+		if (!c->activates)
+			c->ctx.device_state = EXO_STATE_GOOD;
+
+		run(c, START_US, NULL);
+	}
+
+	for (n = 0; n <= event_count; n++) {
+		event *e = n < event_count ? &events[n] : NULL;
+
+		// timers that run out before the next datagram, capped at the end
+		end = e != NULL ? e->time - first_time + START_US
+		                : events[event_count - 1].time - first_time + START_US;
+		for (i = 0; i < client_count; i++) {
+			c = clients[i];
+			while (c->next_due < end) {
+				t = c->next_due;
+				if (realtime)
+					sleep_until(wall_start, t);
+				run(c, t, NULL);
+				if (c->next_due <= t)
+					c->next_due = t + 1;
+			}
+		}
+
+		if (e == NULL)
+			break;
+
+		if (realtime)
+			sleep_until(wall_start, end);
+
+		c = clients[e->client];
+		memcpy(buf, bytes + e->off, e->len);
+		{
+			coap_pdu pdu = {buf, e->len, sizeof(buf)};
+
+			if (coap_validate_pkt(&pdu) != CE_NONE)
+				continue;
+
+			if (e->from_client) {
+				outbound++;
+				submit(c, end, &pdu);
+			} else {
+				inbound++;
+				deliver(c, end, &pdu);
+			}
+		}
+	}
+}
+
+
+//
+// Report
+//
+
+static void report(double wall_s)
+{
+	static const char *names[KINDS] = {"write", "read", "subscribe"};
+	double span = event_count ? (events[event_count - 1].time - first_time) / 1e6 : 0;
+	int k;
+
+	printf("%" PRIu64 " packets, %zu CoAP from %" PRIu32 " clients over %.1f s, replayed in %.3f s\n",
+	       total_packets, event_count, client_count, span, wall_s);
+	if (truncated || skipped_clients)
+		printf("%" PRIu64 " datagrams were cut short by the snap length, %" PRIu64 " packets from clients past %d skipped\n",
+		       truncated, skipped_clients, MAX_CLIENTS);
+	printf("%" PRIu64 " from clients, %" PRIu64 " retransmits in the capture, %" PRIu64 " refreshes, %" PRIu64 " dropped, ops full\n",
+	       outbound, trace_retransmits, refreshes, dropped);
+	printf("%" PRIu64 " to clients, %" PRIu64 " unmatched, %" PRIu64 " notifications, %" PRIu64 " datagrams sent by the library\n\n",
+	       inbound, unmatched, notifications, sent_by_library);
+
+	printf("%-10s %9s %9s %7s %9s %9s %9s\n", "op", "submitted", "ok", "failed", "p50 ms", "p99 ms", "max ms");
+	for (k = 0; k < KINDS; k++) {
+		printf("%-10s %9" PRIu64 " %9" PRIu64 " %7" PRIu64 " %9.1f %9.1f %9.1f\n", names[k],
+		       submitted[k], succeeded[k], failed[k],
+		       exo_hist_percentile(&latency[k], 50) / 1e3,
+		       exo_hist_percentile(&latency[k], 99) / 1e3,
+		       latency[k].max / 1e3);
+	}
+
+	printf("\nexo_operate() %" PRIu64 " calls, %.3f ms in total\n", operate_calls, engine_ns / 1e6);
+	printf("per datagram received  p50 %" PRIu32 " ns  p99 %" PRIu32 " ns  max %" PRIu32 " ns\n",
+	       exo_hist_percentile(&engine_in, 50), exo_hist_percentile(&engine_in, 99), engine_in.max);
+	printf("per op submitted       p50 %" PRIu32 " ns  p99 %" PRIu32 " ns  max %" PRIu32 " ns\n",
+	       exo_hist_percentile(&engine_out, 50), exo_hist_percentile(&engine_out, 99), engine_out.max);
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t start;
+	int opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "p:rh")) != -1) {
+		switch (opt) {
+			case 'p': server_port = atoi(optarg); break;
+			case 'r': realtime = 1; break;
+			default:
+				fprintf(stderr, "usage: %s [-p port] [-r] capture.pcap ... (- for stdin)\n", argv[0]);
+				return 2;
+		}
+	}
+
+	if (optind == argc) {
+		fprintf(stderr, "usage: %s [-p port] [-r] capture.pcap ... (- for stdin)\n", argv[0]);
+		return 2;
+	}
+
+	for (; optind < argc; optind++)
+		ret |= read_capture(argv[optind]);
+
+	if (event_count == 0) {
+		fprintf(stderr, "no CoAP traffic on port %u found\n", server_port);
+		return 1;
+	}
+
+	qsort(events, event_count, sizeof(*events), event_cmp);
+
+	start = now_ns();
+	replay();
+	report((now_ns() - start) / 1e9);
+
+	return ret;
+}
@@ -0,0 +1,427 @@
+/*****************************************************************************
+*
+*  exosim.c - Deterministic network simulator for the Exosite library
+*  Copyright (C) 2015 Exosite LLC
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*    Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+*
+*    Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the
+*    distribution.
+*
+*    Neither the name of Texas Instruments Incorporated nor the names of
+*    its contributors may be used to endorse or promote products derived
+*    from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+*  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+*  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+*  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+*  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+*  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+*  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+*  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+*  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*****************************************************************************/
+
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "exosim.h"
+
+static uint32_t exosim_rand(exosim *sim)
+{
+	// xorshift32, the same sequence for the same seed everywhere
+	sim->rng ^= sim->rng << 13;
+	sim->rng ^= sim->rng >> 17;
+	sim->rng ^= sim->rng << 5;
+	return sim->rng;
+}
+
+static uint8_t exosim_roll(exosim *sim, uint16_t permille)
+{
+	return permille != 0 && exosim_rand(sim) % 1000 < permille;
+}
+
+static exosim_device *exosim_device_of(exopal_loopback *lb)
+{
+	return (exosim_device *)((char *)lb - offsetof(exosim_device, lb));
+}
+
+static uint64_t exosim_delay_of(exosim *sim, const exosim_link *link)
+{
+	// in (0, 1], so the logarithm and the root stay finite
+	double u = (exosim_rand(sim) + 1.0) / 4294967296.0;
+	double extra = 0;
+
+	switch (link->dist) {
+		case EXOSIM_DELAY_UNIFORM:
+			if (link->spread_us != 0)
+				extra = exosim_rand(sim) % link->spread_us;
+			break;
+		case EXOSIM_DELAY_EXPONENTIAL:
+			extra = -log(u) * link->spread_us;
+			break;
+		case EXOSIM_DELAY_PARETO:
+			// Lomax with shape 2, whose mean is its scale
+			extra = (1.0 / sqrt(u) - 1.0) * link->spread_us;
+			break;
+	}
+
+	if (extra > EXOSIM_MAX_DELAY_US)
+		extra = EXOSIM_MAX_DELAY_US;
+
+	return link->delay_us + (uint64_t)extra;
+}
+
+static void exosim_push(exosim *sim, uint8_t dir, uint16_t device, uint64_t due,
+                        const uint8_t *buf, size_t len)
+{
+	exosim_datagram *dg;
+
+	if (sim->in_flight == EXOSIM_IN_FLIGHT || len > EXOPAL_LOOPBACK_MTU) {
+		sim->stats.overflows++;
+		return;
+	}
+
+	dg = &sim->flight[sim->in_flight++];
+	dg->due = due;
+	dg->order = sim->order++;
+	dg->device = device;
+	dg->dir = dir;
+	dg->len = len;
+	memcpy(dg->buf, buf, len);
+}
+
+// puts a datagram on one direction of the link, applying its faults
+static void exosim_transmit(exosim *sim, uint8_t dir, uint16_t device,
+                            const uint8_t *buf, size_t len)
+{
+	const exosim_link *link = dir == 0 ? &sim->up : &sim->down;
+	uint64_t due;
+
+	sim->stats.sent[dir]++;
+
+	// two state loss model: a burst ends before each datagram with
+	// probability 1 / burst_len, so burst_len datagrams are lost on average
+	if (sim->burst[dir] && (link->burst_len <= 1 || exosim_rand(sim) % link->burst_len == 0))
+		sim->burst[dir] = 0;
+	if (!sim->burst[dir] && exosim_roll(sim, link->burst_permille))
+		sim->burst[dir] = 1;
+
+	if (sim->burst[dir] || exosim_roll(sim, link->loss_permille)) {
+		sim->stats.lost[dir]++;
+		return;
+	}
+
+	due = sim->now + exosim_delay_of(sim, link);
+	if (exosim_roll(sim, link->reorder_permille))
+		due += link->reorder_us;
+
+	exosim_push(sim, dir, device, due, buf, len);
+
+	if (exosim_roll(sim, link->duplicate_permille)) {
+		sim->stats.duplicated[dir]++;
+		exosim_push(sim, dir, device, due + exosim_delay_of(sim, link), buf, len);
+	}
+}
+
+// every datagram a device sends goes up the link
+static void exosim_uplink(exopal_loopback *lb, const uint8_t *buf, size_t len, void *peer_data)
+{
+	exosim *sim = peer_data;
+
+	exosim_transmit(sim, 0, exosim_device_of(lb) - sim->devices, buf, len);
+}
+
+// hands over the datagrams that have arrived, oldest first
+static void exosim_deliver(exosim *sim)
+{
+	exosim_datagram dg, *next;
+	exosim_device *d;
+	size_t i;
+
+	for (;;) {
+		next = NULL;
+		for (i = 0; i < sim->in_flight; i++) {
+			exosim_datagram *cand = &sim->flight[i];
+			if (cand->due > sim->now)
+				continue;
+			if (next == NULL || cand->due < next->due ||
+			    (cand->due == next->due && cand->order < next->order))
+				next = cand;
+		}
+
+		if (next == NULL)
+			return;
+
+		dg = *next;
+		*next = sim->flight[--sim->in_flight];
+
+		if (dg.dir == 0) {
+			exomock_receive(&sim->srv, dg.device, sim->now, dg.buf, dg.len);
+		} else {
+			d = &sim->devices[dg.device];
+			if (exopal_loopback_inject(&d->lb, dg.buf, dg.len) != 0)
+				sim->stats.overflows++;
+			d->kick = 1;
+		}
+	}
+}
+
+// whatever the server has to say goes down the link
+static void exosim_serve(exosim *sim)
+{
+	uint8_t buf[EXOMOCK_MTU];
+	uint32_t peer;
+	size_t len;
+
+	while (exomock_poll(&sim->srv, sim->now, &peer, buf, sizeof(buf), &len) == 0) {
+		if (peer < sim->device_count)
+			exosim_transmit(sim, 1, peer, buf, len);
+	}
+}
+
+static void exosim_workload(exosim *sim)
+{
+	exosim_device *d;
+	size_t i;
+
+	for (i = 0; i < sim->device_count; i++) {
+		d = &sim->devices[i];
+		if (d->ops[0].type == EXO_NULL && d->resubscribe_at <= sim->now) {
+			exo_subscribe(&d->ops[0], "cmd", d->cmd, sizeof(d->cmd));
+			d->kick = 1;
+		}
+	}
+
+	for (i = 0; i < sim->device_count && sim->write_interval_us != 0; i++) {
+		d = &sim->devices[i];
+
+		// spread the first writes over one interval
+		if (d->next_write == 0)
+			d->next_write = sim->now + 1 + exosim_rand(sim) % sim->write_interval_us;
+		if (d->next_write > sim->now)
+			continue;
+		d->next_write += sim->write_interval_us;
+
+		// still busy with the last one, skip this one
+		if (d->ops[1].type != EXO_NULL)
+			continue;
+
+		snprintf(d->uptime, sizeof(d->uptime), "%llu",
+		         (unsigned long long)(sim->now / 1000000));
+		exo_write(&d->ops[1], "uptime", d->uptime);
+		d->write_at = sim->now;
+		d->kick = 1;
+		sim->stats.writes++;
+	}
+
+	if (sim->command_interval_us == 0 || sim->device_count == 0)
+		return;
+
+	if (sim->next_command == 0)
+		sim->next_command = sim->now + sim->command_interval_us;
+	if (sim->next_command > sim->now)
+		return;
+	sim->next_command += sim->command_interval_us;
+
+	d = &sim->devices[0];
+	if (d->ops[2].type != EXO_NULL)
+		return;
+
+	snprintf(d->command, sizeof(d->command), "%u", (unsigned)sim->stats.commands);
+	exo_write(&d->ops[2], "cmd", d->command);
+	d->kick = 1;
+	sim->stats.commands++;
+}
+
+// runs one device at the current time and collects what it finished
+static void exosim_step(exosim *sim, exosim_device *d)
+{
+	exo_op *op;
+	int i;
+
+	d->lb.time = sim->now;
+	d->kick = 0;
+
+	for (i = 0; i < 8 && exo_operate(&d->ctx, d->ops, EXOSIM_OPS) == EXO_BUSY; i++)
+		;
+
+	op = &d->ops[0];
+	if (exo_is_op_success(op)) {
+		sim->stats.notifications++;
+		exo_op_done(op);
+	} else if (op->state == EXO_REQUEST_ERROR) {
+		sim->stats.subscribe_errors++;
+		exo_op_init(op);
+		d->resubscribe_at = sim->now + EXOSIM_RESUBSCRIBE_US;
+	}
+
+	op = &d->ops[1];
+	if (exo_is_op_finished(op)) {
+		if (exo_is_op_success(op)) {
+			sim->stats.writes_ok++;
+			exo_hist_record(&sim->stats.write_latency, sim->now - d->write_at);
+		} else {
+			sim->stats.writes_failed++;
+		}
+		exo_op_init(op);
+	}
+
+	op = &d->ops[2];
+	if (exo_is_op_finished(op))
+		exo_op_init(op);
+
+	d->next_due = UINT64_MAX;
+	for (i = -1; i < EXOSIM_OPS; i++) {
+		op = i < 0 ? &d->ctx.activation : &d->ops[i];
+		if ((op->state == EXO_REQUEST_PENDING || op->state == EXO_REQUEST_SUBSCRIBED) &&
+		    op->timeout < d->next_due)
+			d->next_due = op->timeout;
+	}
+
+	// a failed activation is retried once its timeout has passed
+	if (d->ctx.device_state != EXO_STATE_GOOD && d->ctx.activation.state != EXO_REQUEST_PENDING &&
+	    d->ctx.activation.timeout + 1 < d->next_due)
+		d->next_due = d->ctx.activation.timeout + 1;
+
+	if (d->next_due <= sim->now)
+		d->next_due = sim->now + 1000;
+}
+
+static uint64_t exosim_next(exosim *sim)
+{
+	uint64_t next = exomock_next_due(&sim->srv);
+	exosim_device *d;
+	size_t i;
+
+	for (i = 0; i < sim->in_flight; i++) {
+		if (sim->flight[i].due < next)
+			next = sim->flight[i].due;
+	}
+
+	for (i = 0; i < sim->device_count; i++) {
+		d = &sim->devices[i];
+		if (d->kick)
+			return sim->now;
+		if (d->next_due < next)
+			next = d->next_due;
+		if (sim->write_interval_us != 0 && d->next_write < next)
+			next = d->next_write;
+		if (d->ops[0].type == EXO_NULL && d->resubscribe_at < next)
+			next = d->resubscribe_at;
+	}
+
+	if (sim->command_interval_us != 0 && sim->next_command < next)
+		next = sim->next_command;
+
+	return next;
+}
+
+/*!
+ * \brief Sets up a simulation
+ *
+ * Initializes the devices, which you hold the memory for, and the server.
+ * Links start out perfect and without delay, and nothing is written.
+ *
+ * \param[out] sim      simulation to initialize
+ * \param[in]  devices  storage for the devices
+ * \param[in]  count    number of devices, at most EXOSIM_MAX_DEVICES
+ * \param[in]  seed     seed for everything random in the simulation
+ *
+ * \return EXO_OK, EXO_GENERAL_ERROR if there are too many devices
+ */
+exo_error exosim_init(exosim *sim, exosim_device *devices, size_t count, uint32_t seed)
+{
+	exosim_device *d;
+	size_t i;
+
+	if (count > EXOSIM_MAX_DEVICES)
+		return EXO_GENERAL_ERROR;
+
+	memset(sim, 0, sizeof(*sim));
+	sim->devices = devices;
+	sim->device_count = count;
+	sim->rng = seed != 0 ? seed : 1;
+
+	exomock_init(&sim->srv, exosim_rand(sim));
+	exomock_set_alias(&sim->srv, "cmd", "0", 1);
+	exomock_set_alias(&sim->srv, "uptime", "0", 1);
+
+	for (i = 0; i < count; i++) {
+		d = &devices[i];
+		memset(d, 0, sizeof(*d));
+		d->lb.peer = exosim_uplink;
+		d->lb.peer_data = sim;
+		snprintf(d->serial, sizeof(d->serial), "%05u", (unsigned)i);
+
+		if (exo_init(&d->ctx, &exopal_loopback_ops, &d->lb, "exosim", "sim", d->serial) != EXO_OK)
+			return EXO_GENERAL_ERROR;
+
+		// exo_init() seeds from the wall clock, runs must repeat exactly
+		d->ctx.rng = exosim_rand(sim) | 1;
+		d->ctx.message_id_counter = exosim_rand(sim);
+
+		exo_op_init(&d->ops[0]);
+		exo_op_init(&d->ops[1]);
+		exo_op_init(&d->ops[2]);
+		exo_subscribe(&d->ops[0], "cmd", d->cmd, sizeof(d->cmd));
+		d->kick = 1;
+	}
+
+	return EXO_OK;
+}
+
+/*!
+ * \brief Advances a simulation
+ *
+ * Jumps the virtual clock from event to event until `duration_us` has
+ * passed, so quiet stretches cost nothing. May be called again to carry on,
+ * with changed link settings if you like.
+ */
+void exosim_run(exosim *sim, uint64_t duration_us)
+{
+	uint64_t end = sim->now + duration_us, next;
+	exosim_device *d;
+	size_t i;
+
+	for (;;) {
+		exosim_deliver(sim);
+		exosim_workload(sim);
+
+		for (i = 0; i < sim->device_count; i++) {
+			d = &sim->devices[i];
+			if (d->kick || d->next_due <= sim->now)
+				exosim_step(sim, d);
+		}
+
+		exosim_serve(sim);
+
+		next = exosim_next(sim);
+		if (next > end)
+			break;
+		if (next > sim->now) {
+			sim->now = next;
+			sim->stats.events++;
+		}
+	}
+
+	sim->now = end;
+	sim->stats.device_us += duration_us * sim->device_count;
+
+	sim->stats.retransmits = 0;
+	for (i = 0; i < sim->device_count; i++)
+		sim->stats.retransmits += sim->devices[i].ctx.stats.retransmits;
+}
@@ -0,0 +1,161 @@
+/*****************************************************************************
+*
+*  exosim.h - Deterministic network simulator for the Exosite library
+*  Copyright (C) 2015 Exosite LLC
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*    Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+*
+*    Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the
+*    distribution.
+*
+*    Neither the name of Texas Instruments Incorporated nor the names of
+*    its contributors may be used to endorse or promote products derived
+*    from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+*  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+*  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+*  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+*  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+*  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+*  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+*  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+*  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*****************************************************************************/
+
+
+#ifndef EXOSIM_H
+#define EXOSIM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "exosite.h"
+#include "exosite_pal.h"
+#include "mockserver.h"
+
+// DEFINES
+#define EXOSIM_OPS                              3
+#define EXOSIM_VALUE_MAX                        32
+#define EXOSIM_IN_FLIGHT                        4096
+#define EXOSIM_MAX_DEVICES                      EXOMOCK_MAX_OBSERVERS
+#define EXOSIM_MAX_DELAY_US                     60000000
+
+// How long a device waits before subscribing again after an error.
+#define EXOSIM_RESUBSCRIBE_US                   10000000
+
+typedef enum exosim_delay
+{
+	EXOSIM_DELAY_UNIFORM,       // delay_us plus [0, spread_us)
+	EXOSIM_DELAY_EXPONENTIAL,   // delay_us plus exponential, mean spread_us
+	EXOSIM_DELAY_PARETO,        // delay_us plus heavy tailed, mean spread_us
+} exosim_delay;
+
+/*!
+ * One direction of the simulated link. Probabilities are in parts per
+ * thousand. A datagram that starts a loss burst is lost along with, on
+ * average, `burst_len` - 1 more after it. Random delays reorder datagrams
+ * by themselves, `reorder_permille` adds deliberate hold-backs on top.
+ */
+typedef struct exosim_link
+{
+	exosim_delay dist;
+	uint32_t delay_us;              // every datagram takes at least this long
+	uint32_t spread_us;             // width or mean of the random part
+	uint16_t loss_permille;         // lost on their own
+	uint16_t burst_permille;        // start a loss burst
+	uint16_t burst_len;             // mean datagrams lost per burst
+	uint16_t duplicate_permille;    // delivered twice
+	uint16_t reorder_permille;      // held back by reorder_us
+	uint32_t reorder_us;
+} exosim_link;
+
+typedef struct exosim_stats
+{
+	uint64_t device_us;             // simulated time summed over devices
+	uint64_t events;                // times the clock moved
+	uint32_t sent[2];               // datagrams offered, up and down
+	uint32_t lost[2];
+	uint32_t duplicated[2];
+	uint32_t overflows;             // link or device queue full
+	uint32_t writes;                // uptime writes queued
+	uint32_t writes_ok;
+	uint32_t writes_failed;
+	uint32_t commands;              // cmd writes by the controller
+	uint32_t notifications;         // cmd values subscribers got
+	uint32_t subscribe_errors;
+	uint32_t retransmits;           // from the devices' own stats
+	exo_hist write_latency;         // queued to acknowledged, microseconds
+} exosim_stats;
+
+/*!
+ * A simulated device: a context on the loopback PAL with a subscription to
+ * "cmd" and a periodic write to "uptime". Device 0 also writes "cmd" now and
+ * then, which the server pushes to every subscriber. Treat it as private.
+ */
+typedef struct exosim_device
+{
+	exo_context ctx;
+	exopal_loopback lb;
+	exo_op ops[EXOSIM_OPS];         // subscribe cmd, write uptime, write cmd
+	char cmd[EXOSIM_VALUE_MAX];
+	char uptime[EXOSIM_VALUE_MAX];
+	char command[EXOSIM_VALUE_MAX];
+	char serial[12];
+	uint64_t write_at;              // when the pending write was queued
+	uint64_t next_write;
+	uint64_t resubscribe_at;        // subscription failed, try again then
+	uint64_t next_due;              // earliest op timeout
+	uint8_t kick;                   // has datagrams or new ops waiting
+} exosim_device;
+
+typedef struct exosim_datagram
+{
+	uint64_t due;
+	uint32_t order;
+	uint16_t device;
+	uint8_t dir;                    // 0 up to the server, 1 down to the device
+	uint16_t len;
+	uint8_t buf[EXOPAL_LOOPBACK_MTU];
+} exosim_datagram;
+
+/*!
+ * A simulation: devices, a mock server and the link between them, all on
+ * one virtual clock that jumps straight to the next thing that happens.
+ * Everything random comes from the seed, so a run is reproduced exactly by
+ * running it again with the same seed and settings. Set `up`, `down` and
+ * the intervals after `exosim_init()` and before `exosim_run()`.
+ */
+typedef struct exosim
+{
+	exosim_link up;
+	exosim_link down;
+	uint64_t write_interval_us;     // every device writes uptime this often
+	uint64_t command_interval_us;   // device 0 writes cmd this often, 0 never
+	exosim_stats stats;
+	exomock_server srv;
+	exosim_device *devices;
+	size_t device_count;
+	uint64_t now;
+	uint64_t next_command;
+	uint32_t rng;
+	uint32_t order;
+	uint8_t burst[2];               // link direction is in a loss burst
+	size_t in_flight;
+	exosim_datagram flight[EXOSIM_IN_FLIGHT];
+} exosim;
+
+exo_error exosim_init(exosim *sim, exosim_device *devices, size_t count, uint32_t seed);
+void exosim_run(exosim *sim, uint64_t duration_us);
+
+#endif
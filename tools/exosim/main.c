@@ -0,0 +1,158 @@
+/*****************************************************************************
+*
+*  main.c - Command line front end for the Exosite network simulator
+*  Copyright (C) 2015 Exosite LLC
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*    Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+*
+*    Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the
+*    distribution.
+*
+*    Neither the name of Texas Instruments Incorporated nor the names of
+*    its contributors may be used to endorse or promote products derived
+*    from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+*  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+*  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+*  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+*  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+*  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+*  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+*  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+*  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*****************************************************************************/
+
+#include <stdio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "exosim.h"
+
+static exosim sim;
+static exosim_device devices[EXOSIM_MAX_DEVICES];
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+	        "usage: %s [options]\n"
+	        "  -s seed        random seed (1)\n"
+	        "  -n devices     simulated devices (16)\n"
+	        "  -H hours       simulated hours per device (24)\n"
+	        "  -w seconds     uptime write interval (60)\n"
+	        "  -c seconds     cmd write interval, 0 never (600)\n"
+	        "  -d ms          minimum one way delay (20)\n"
+	        "  -j ms          random part of the delay, width or mean (10)\n"
+	        "  -D dist        uniform, exp or pareto (uniform)\n"
+	        "  -l list        loss permille, comma separated for a sweep (0)\n"
+	        "  -b permille    loss burst starts (0)\n"
+	        "  -B datagrams   mean loss burst length (4)\n"
+	        "  -u permille    duplicated datagrams (0)\n"
+	        "  -r permille    reordered datagrams, held back 100 ms (0)\n",
+	        name);
+}
+
+static double elapsed(struct timespec *start)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec - start->tv_sec) + (ts.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t seed = 1;
+	size_t count = 16;
+	double hours = 24;
+	uint64_t write_interval = 60, command_interval = 600;
+	exosim_link link;
+	char *losses = "0", *loss;
+	int opt;
+
+	memset(&link, 0, sizeof(link));
+	link.delay_us = 20000;
+	link.spread_us = 10000;
+	link.burst_len = 4;
+	link.reorder_us = 100000;
+
+	while ((opt = getopt(argc, argv, "s:n:H:w:c:d:j:D:l:b:B:u:r:h")) != -1) {
+		switch (opt) {
+			case 's': seed = strtoul(optarg, NULL, 0); break;
+			case 'n': count = strtoul(optarg, NULL, 0); break;
+			case 'H': hours = atof(optarg); break;
+			case 'w': write_interval = strtoull(optarg, NULL, 0); break;
+			case 'c': command_interval = strtoull(optarg, NULL, 0); break;
+			case 'd': link.delay_us = atoi(optarg) * 1000; break;
+			case 'j': link.spread_us = atoi(optarg) * 1000; break;
+			case 'D':
+				if (strcmp(optarg, "uniform") == 0) {
+					link.dist = EXOSIM_DELAY_UNIFORM;
+				} else if (strcmp(optarg, "exp") == 0) {
+					link.dist = EXOSIM_DELAY_EXPONENTIAL;
+				} else if (strcmp(optarg, "pareto") == 0) {
+					link.dist = EXOSIM_DELAY_PARETO;
+				} else {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'l': losses = optarg; break;
+			case 'b': link.burst_permille = atoi(optarg); break;
+			case 'B': link.burst_len = atoi(optarg); break;
+			case 'u': link.duplicate_permille = atoi(optarg); break;
+			case 'r': link.reorder_permille = atoi(optarg); break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (count == 0 || count > EXOSIM_MAX_DEVICES) {
+		fprintf(stderr, "devices must be 1 to %d\n", EXOSIM_MAX_DEVICES);
+		return 1;
+	}
+
+	printf("loss_permille,device_hours,writes,writes_ok,goodput,p50_ms,p99_ms,retransmits,seconds\n");
+
+	for (loss = strtok(losses, ","); loss != NULL; loss = strtok(NULL, ",")) {
+		exosim_stats *s = &sim.stats;
+		struct timespec start;
+
+		if (exosim_init(&sim, devices, count, seed) != EXO_OK) {
+			fprintf(stderr, "exosim_init failed\n");
+			return 1;
+		}
+
+		link.loss_permille = atoi(loss);
+		sim.up = link;
+		sim.down = link;
+		sim.write_interval_us = write_interval * 1000000;
+		sim.command_interval_us = command_interval * 1000000;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		exosim_run(&sim, (uint64_t)(hours * 3600e6));
+
+		printf("%u,%.1f,%u,%u,%.4f,%.1f,%.1f,%u,%.2f\n",
+		       link.loss_permille, s->device_us / 3600e6, s->writes, s->writes_ok,
+		       s->writes != 0 ? (double)s->writes_ok / s->writes : 0,
+		       exo_hist_percentile(&s->write_latency, 50) / 1000.0,
+		       exo_hist_percentile(&s->write_latency, 99) / 1000.0,
+		       s->retransmits, elapsed(&start));
+		fflush(stdout);
+	}
+
+	return 0;
+}
@@ -0,0 +1,778 @@
+/*****************************************************************************
+*
+*  Copyright (C) 2015 Exosite LLC
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*    Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+*
+*    Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the
+*    distribution.
+*
+*    Neither the name of Texas Instruments Incorporated nor the names of
+*    its contributors may be used to endorse or promote products derived
+*    from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+*  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+*  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+*  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+*  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+*  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+*  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+*  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+*  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*****************************************************************************/
+
+/*
+ * exotrace - per-alias statistics from captured Exosite CoAP traffic
+ *
+ * Reads pcap captures (tcpdump, Wireshark saved as pcap, or `exo_dump_pcap()`
+ * output) one packet at a time and pairs requests with their responses by
+ * client address and MID, and notifications with their observe request by
+ * client address and token. Memory use depends on how many exchanges are in
+ * flight at once, not on the size of the capture, so captures of any length
+ * can be fed through, several files in a row or from stdin.
+ *
+ * Usage: exotrace [-p port] capture.pcap ...
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "exosite.h"
+#include "coap.h"
+
+#define MAX_ALIASES             1024
+#define ALIAS_NAME_MAX          64
+#define MAX_PACKET              65536
+#define TABLE_BITS              16
+
+// RFC7252 EXCHANGE_LIFETIME, a request unanswered after this is lost
+#define EXCHANGE_LIFETIME_US    247000000ULL
+// RFC7252 MAX_TRANSMIT_SPAN, an answered request isn't resent after this
+#define MAX_TRANSMIT_SPAN_US    45000000ULL
+// an observation with no traffic for this long is forgotten
+#define OBSERVE_IDLE_US         3600000000ULL
+// how often, in capture time, expired entries are swept out
+#define SWEEP_US                10000000ULL
+
+// pcap link types
+#define LINKTYPE_NULL           0
+#define LINKTYPE_ETHERNET       1
+#define LINKTYPE_RAW            101
+#define LINKTYPE_LINUX_SLL      113
+#define LINKTYPE_IPV4           228
+#define LINKTYPE_IPV6           229
+
+typedef struct alias_stats
+{
+	char name[ALIAS_NAME_MAX];
+	uint64_t requests;
+	uint64_t transmissions;
+	uint64_t answered;
+	uint64_t lost;
+	uint64_t errors;            // non 2.xx responses and RSTs
+	uint64_t notifications;
+	uint64_t duplicates;
+	uint64_t bytes;             // requests, including resends, and responses
+	exo_hist rtt;               // first transmission to response, us
+} alias_stats;
+
+enum { SLOT_EMPTY, SLOT_USED, SLOT_DELETED };
+
+// an exchange keyed by MID, or a separate response or observation keyed by token
+typedef struct entry
+{
+	uint64_t ep;                // client address and port
+	uint64_t id;
+	uint64_t first;
+	uint64_t last;
+	uint64_t token;
+	uint32_t alias;
+	uint32_t seq;               // last observe sequence number
+	uint16_t mid;               // last separate response or notification MID
+	uint8_t state;
+	uint8_t answered;
+	uint8_t observe;
+	uint8_t tkl;
+} entry;
+
+typedef struct table
+{
+	entry *slots;
+	size_t mask;
+	size_t used;                // live and deleted slots
+} table;
+
+typedef struct packet
+{
+	uint64_t time;
+	uint64_t client;
+	uint8_t from_client;
+	coap_pdu pdu;
+} packet;
+
+static alias_stats aliases[MAX_ALIASES];
+static uint32_t alias_count;
+static int32_t alias_index[MAX_ALIASES * 2];
+
+static table exchanges;
+static table separate;          // empty ACKed requests waiting for their response
+static table observations;
+
+static uint16_t server_port = 5683;
+
+static uint64_t first_time, last_time, next_sweep;
+static uint64_t total_packets, coap_packets, skipped;
+static uint64_t unmatched_responses, duplicate_responses, unmatched_notifications;
+
+//
+// Hashing and tables
+//
+
+static uint64_t fnv1a(uint64_t h, const uint8_t *p, size_t len)
+{
+	while (len--) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static uint64_t mix(uint64_t a, uint64_t b)
+{
+	a ^= b + 0x9e3779b97f4a7c15ULL + (a << 6) + (a >> 2);
+	a ^= a >> 33;
+	a *= 0xff51afd7ed558ccdULL;
+	a ^= a >> 33;
+	return a;
+}
+
+static void table_init(table *t, unsigned bits)
+{
+	t->slots = calloc((size_t)1 << bits, sizeof(entry));
+	if (t->slots == NULL) {
+		perror("calloc");
+		exit(2);
+	}
+	t->mask = ((size_t)1 << bits) - 1;
+	t->used = 0;
+}
+
+static entry *table_find(table *t, uint64_t ep, uint64_t id)
+{
+	size_t i = mix(ep, id) & t->mask;
+
+	while (t->slots[i].state != SLOT_EMPTY) {
+		if (t->slots[i].state == SLOT_USED && t->slots[i].ep == ep && t->slots[i].id == id)
+			return &t->slots[i];
+		i = (i + 1) & t->mask;
+	}
+
+	return NULL;
+}
+
+static entry *table_insert(table *t, uint64_t ep, uint64_t id)
+{
+	size_t i = mix(ep, id) & t->mask;
+
+	while (t->slots[i].state == SLOT_USED)
+		i = (i + 1) & t->mask;
+
+	if (t->slots[i].state == SLOT_EMPTY)
+		t->used++;
+
+	memset(&t->slots[i], 0, sizeof(entry));
+	t->slots[i].state = SLOT_USED;
+	t->slots[i].ep = ep;
+	t->slots[i].id = id;
+
+	return &t->slots[i];
+}
+
+// also expires separate entries, which are answered by their CON or NON
+static void exchange_expired(entry *e)
+{
+	if (!e->answered)
+		aliases[e->alias].lost++;
+}
+
+/*
+ * Rebuilds a table without its expired and deleted entries, growing it when
+ * it is still over half full afterwards.
+ */
+static void table_sweep(table *t, uint64_t now, uint64_t lifetime, void (*expired)(entry *))
+{
+	table old = *t;
+	size_t live = 0, i, bits = 0;
+	entry *e;
+
+	for (i = 0; i <= old.mask; i++) {
+		if (old.slots[i].state != SLOT_USED)
+			continue;
+		// answered exchanges only linger to spot resends
+		if (old.slots[i].last + (old.slots[i].answered ? MAX_TRANSMIT_SPAN_US : lifetime) <= now) {
+			if (expired != NULL)
+				expired(&old.slots[i]);
+			old.slots[i].state = SLOT_DELETED;
+		} else {
+			live++;
+		}
+	}
+
+	while (((size_t)1 << bits) <= old.mask)
+		bits++;
+	if (live * 2 > old.mask)
+		bits++;
+
+	table_init(t, bits);
+
+	for (i = 0; i <= old.mask; i++) {
+		if (old.slots[i].state != SLOT_USED)
+			continue;
+		e = table_insert(t, old.slots[i].ep, old.slots[i].id);
+		*e = old.slots[i];
+	}
+
+	free(old.slots);
+}
+
+static void table_make_room(table *t, uint64_t now, uint64_t lifetime, void (*expired)(entry *))
+{
+	if (t->used * 4 >= (t->mask + 1) * 3)
+		table_sweep(t, now, lifetime, expired);
+}
+
+//
+// Aliases
+//
+
+static uint32_t alias_lookup(const char *name)
+{
+	size_t len = strlen(name);
+	uint32_t i = fnv1a(0xcbf29ce484222325ULL, (const uint8_t *)name, len) % (MAX_ALIASES * 2);
+
+	while (alias_index[i] >= 0) {
+		if (strcmp(aliases[alias_index[i]].name, name) == 0)
+			return alias_index[i];
+		i = (i + 1) % (MAX_ALIASES * 2);
+	}
+
+	// everything past the table's capacity is lumped together
+	if (alias_count == MAX_ALIASES - 1)
+		name = "(other)";
+	else if (alias_count == MAX_ALIASES)
+		return MAX_ALIASES - 1;
+
+	alias_index[i] = alias_count;
+	snprintf(aliases[alias_count].name, ALIAS_NAME_MAX, "%s", name);
+
+	return alias_count++;
+}
+
+// names a request after its dataport alias, or its whole path if not /1a/<alias>
+static uint32_t alias_of(coap_pdu *pdu)
+{
+	char name[ALIAS_NAME_MAX];
+	size_t len = 0, n;
+	coap_option opt;
+	uint8_t i;
+
+	if (coap_get_code(pdu) == CC_EMPTY)
+		return alias_lookup("(ping)");
+
+	for (i = 0; ; i++) {
+		opt = coap_get_option_by_num(pdu, CON_URI_PATH, i);
+		if (opt.num == 0)
+			break;
+		if (i == 0 && opt.len == 2 && memcmp(opt.val, "1a", 2) == 0)
+			continue;
+		// activation carries vendor, model and serial number in its path
+		if (i == 2 && len == 18 && memcmp(name, "provision/activate", 18) == 0)
+			break;
+
+		if (len + 2 >= sizeof(name))
+			break;
+
+		n = opt.len;
+		if (len + n + 2 > sizeof(name))
+			n = sizeof(name) - len - 2;
+		if (len > 0)
+			name[len++] = '/';
+		memcpy(name + len, opt.val, n);
+		len += n;
+	}
+
+	name[len] = 0;
+
+	return alias_lookup(len > 0 ? name : "/");
+}
+
+//
+// CoAP
+//
+
+static uint32_t observe_seq(coap_pdu *pdu, uint8_t *present)
+{
+	coap_option opt = coap_get_option_by_num(pdu, CON_OBSERVE, 0);
+	uint32_t seq = 0;
+	int j;
+
+	*present = opt.num != 0;
+	for (j = 0; j < opt.len && j < 4; j++)
+		seq = (seq << 8) | opt.val[j];
+
+	return seq;
+}
+
+static void handle_request(packet *p)
+{
+	coap_pdu *pdu = &p->pdu;
+	entry *e = table_find(&exchanges, p->client, coap_get_mid(pdu));
+	alias_stats *a;
+
+	if (e != NULL) {
+		// resent, either the request or its response was lost
+		a = &aliases[e->alias];
+		a->transmissions++;
+		a->bytes += pdu->len;
+		e->last = p->time;
+		return;
+	}
+
+	table_make_room(&exchanges, p->time, EXCHANGE_LIFETIME_US, exchange_expired);
+
+	e = table_insert(&exchanges, p->client, coap_get_mid(pdu));
+	e->first = e->last = p->time;
+	e->alias = alias_of(pdu);
+	e->token = coap_get_token(pdu);
+	e->tkl = coap_get_tkl(pdu);
+	observe_seq(pdu, &e->observe);
+
+	a = &aliases[e->alias];
+	a->requests++;
+	a->transmissions++;
+	a->bytes += pdu->len;
+}
+
+// records a request's response, piggybacked or separate
+static void response_done(packet *p, entry *e)
+{
+	coap_pdu *pdu = &p->pdu;
+	alias_stats *a = &aliases[e->alias];
+	entry *o;
+	uint64_t rtt;
+	uint8_t has_seq;
+	uint32_t seq;
+
+	a->answered++;
+
+	rtt = p->time - e->first;
+	exo_hist_record(&a->rtt, rtt > UINT32_MAX ? UINT32_MAX : (uint32_t)rtt);
+
+	// pings are answered with a RST, anything else getting one failed
+	if (coap_get_type(pdu) == CT_RST ? strcmp(a->name, "(ping)") != 0 : coap_get_code_class(pdu) != 2) {
+		a->errors++;
+		return;
+	}
+
+	// a successful observe starts an observation under the request's token
+	seq = observe_seq(pdu, &has_seq);
+	if (!e->observe || !has_seq)
+		return;
+
+	table_make_room(&observations, p->time, OBSERVE_IDLE_US, NULL);
+
+	o = table_find(&observations, p->client, e->token);
+	if (o == NULL)
+		o = table_insert(&observations, p->client, e->token);
+
+	o->first = o->last = p->time;
+	o->alias = e->alias;
+	o->seq = seq;
+	o->mid = coap_get_mid(pdu);
+}
+
+static void handle_response(packet *p)
+{
+	coap_pdu *pdu = &p->pdu;
+	entry *e = table_find(&exchanges, p->client, coap_get_mid(pdu));
+	entry *s;
+	int empty = coap_get_code(pdu) == CC_EMPTY;
+
+	// only empty ACKs and RSTs carry no token, anything else answers the request's
+	if (e == NULL || (!empty && (coap_get_tkl(pdu) != e->tkl || coap_get_token(pdu) != e->token))) {
+		unmatched_responses++;
+		return;
+	}
+
+	aliases[e->alias].bytes += pdu->len;
+
+	if (e->answered) {
+		duplicate_responses++;
+		return;
+	}
+
+	e->answered = 1;
+
+	if (!empty || coap_get_type(pdu) == CT_RST) {
+		response_done(p, e);
+		return;
+	}
+
+	// acknowledged, the response follows in a CON or NON of its own
+	table_make_room(&separate, p->time, EXCHANGE_LIFETIME_US, exchange_expired);
+
+	s = table_find(&separate, p->client, e->token);
+	if (s == NULL)
+		s = table_insert(&separate, p->client, e->token);
+
+	s->first = e->first;
+	s->last = p->time;
+	s->alias = e->alias;
+	s->token = e->token;
+	s->tkl = e->tkl;
+	s->observe = e->observe;
+}
+
+// returns 0 when the CON or NON isn't a separate response
+static int handle_separate(packet *p)
+{
+	coap_pdu *pdu = &p->pdu;
+	entry *s = table_find(&separate, p->client, coap_get_token(pdu));
+
+	if (s == NULL || coap_get_tkl(pdu) != s->tkl)
+		return 0;
+
+	if (s->answered) {
+		// the server resending its CON, anything else is a notification
+		if (coap_get_mid(pdu) != s->mid)
+			return 0;
+		aliases[s->alias].bytes += pdu->len;
+		duplicate_responses++;
+		return 1;
+	}
+
+	aliases[s->alias].bytes += pdu->len;
+	s->answered = 1;
+	s->mid = coap_get_mid(pdu);
+	s->last = p->time;
+
+	response_done(p, s);
+	return 1;
+}
+
+static void handle_notification(packet *p)
+{
+	coap_pdu *pdu = &p->pdu;
+	entry *o = table_find(&observations, p->client, coap_get_token(pdu));
+	alias_stats *a;
+	uint8_t has_seq;
+	uint32_t seq;
+
+	if (o == NULL) {
+		unmatched_notifications++;
+		return;
+	}
+
+	a = &aliases[o->alias];
+	a->notifications++;
+	seq = observe_seq(pdu, &has_seq);
+
+	if (coap_get_mid(pdu) == o->mid || (has_seq && seq == o->seq))
+		a->duplicates++;
+
+	o->mid = coap_get_mid(pdu);
+	if (has_seq)
+		o->seq = seq;
+	o->last = p->time;
+}
+
+static void handle_coap(packet *p)
+{
+	coap_pdu *pdu = &p->pdu;
+	coap_type type;
+
+	if (pdu->len < 4 || coap_validate_pkt(pdu) != CE_NONE) {
+		skipped++;
+		return;
+	}
+
+	coap_packets++;
+	type = coap_get_type(pdu);
+
+	if (p->from_client) {
+		// requests and pings, ACKs and RSTs to notifications are ignored
+		if ((type == CT_CON || type == CT_NON) && coap_get_code_class(pdu) == 0)
+			handle_request(p);
+	} else {
+		if (type == CT_ACK || type == CT_RST)
+			handle_response(p);
+		else if (coap_get_code_class(pdu) != 0 && !handle_separate(p) && coap_get_code_class(pdu) == 2)
+			handle_notification(p);
+	}
+}
+
+//
+// Capture decoding
+//
+
+static void handle_udp(uint64_t time, const uint8_t *addr, size_t addr_len, const uint8_t *udp, size_t len)
+{
+	uint16_t sport, dport, ulen;
+	packet p;
+
+	if (len < 8)
+		return;
+
+	sport = (udp[0] << 8) | udp[1];
+	dport = (udp[2] << 8) | udp[3];
+	ulen = (udp[4] << 8) | udp[5];
+
+	if (ulen < 8 || ulen > len)
+		ulen = len;
+
+	if (dport == server_port) {
+		p.from_client = 1;
+		p.client = fnv1a(0xcbf29ce484222325ULL, addr, addr_len);  // source
+		p.client = fnv1a(p.client, udp, 2);
+	} else if (sport == server_port) {
+		p.from_client = 0;
+		p.client = fnv1a(0xcbf29ce484222325ULL, addr + addr_len, addr_len);  // destination
+		p.client = fnv1a(p.client, udp + 2, 2);
+	} else {
+		return;
+	}
+
+	p.time = time;
+	p.pdu.buf = (uint8_t *)udp + 8;
+	p.pdu.len = ulen - 8;
+	p.pdu.max = ulen - 8;
+
+	handle_coap(&p);
+}
+
+static void handle_ip(uint64_t time, const uint8_t *ip, size_t len)
+{
+	size_t hlen;
+
+	if (len < 1)
+		return;
+
+	if ((ip[0] >> 4) == 4) {
+		hlen = (ip[0] & 0x0F) * 4;
+		// fragments other than the first don't start with a UDP header
+		if (len < 20 || hlen < 20 || hlen > len || ip[9] != 17 || (((ip[6] & 0x1F) << 8) | ip[7]) != 0)
+			return;
+		handle_udp(time, ip + 12, 4, ip + hlen, len - hlen);
+	} else if ((ip[0] >> 4) == 6) {
+		// extension headers aren't followed
+		if (len < 40 || ip[6] != 17)
+			return;
+		handle_udp(time, ip + 8, 16, ip + 40, len - 40);
+	}
+}
+
+static void handle_frame(uint32_t linktype, uint64_t time, const uint8_t *buf, size_t len)
+{
+	size_t off = 0;
+	uint16_t ethertype;
+
+	switch (linktype) {
+		case LINKTYPE_NULL:
+			off = 4;
+			break;
+		case LINKTYPE_ETHERNET:
+			if (len < 14)
+				return;
+			off = 12;
+			ethertype = (buf[off] << 8) | buf[off + 1];
+			while ((ethertype == 0x8100 || ethertype == 0x88A8) && off + 6 <= len) {
+				off += 4;
+				ethertype = (buf[off] << 8) | buf[off + 1];
+			}
+			if (ethertype != 0x0800 && ethertype != 0x86DD)
+				return;
+			off += 2;
+			break;
+		case LINKTYPE_LINUX_SLL:
+			off = 16;
+			break;
+		case LINKTYPE_RAW:
+		case LINKTYPE_IPV4:
+		case LINKTYPE_IPV6:
+			break;
+		default:
+			return;
+	}
+
+	if (off < len)
+		handle_ip(time, buf + off, len - off);
+}
+
+static uint32_t swap32(uint32_t v)
+{
+	return (v >> 24) | ((v >> 8) & 0xFF00) | ((v << 8) & 0xFF0000) | (v << 24);
+}
+
+static int read_capture(const char *path)
+{
+	static uint8_t buf[MAX_PACKET];
+	FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+	uint32_t hdr[6], rec[4];
+	int swapped, nanos;
+	uint64_t time;
+	size_t i;
+
+	if (f == NULL) {
+		perror(path);
+		return 1;
+	}
+
+	setvbuf(f, NULL, _IOFBF, 1 << 20);
+
+	if (fread(hdr, sizeof(hdr), 1, f) != 1) {
+		fprintf(stderr, "%s: too short for a pcap file\n", path);
+		goto fail;
+	}
+
+	swapped = hdr[0] == 0xd4c3b2a1 || hdr[0] == 0x4d3cb2a1;
+	if (swapped)
+		for (i = 0; i < 6; i++)
+			hdr[i] = swap32(hdr[i]);
+
+	if (hdr[0] != 0xa1b2c3d4 && hdr[0] != 0xa1b23c4d) {
+		fprintf(stderr, "%s: not a pcap file (pcapng isn't supported, convert with editcap -F pcap)\n", path);
+		goto fail;
+	}
+	nanos = hdr[0] == 0xa1b23c4d;
+
+	while (fread(rec, sizeof(rec), 1, f) == 1) {
+		if (swapped)
+			for (i = 0; i < 4; i++)
+				rec[i] = swap32(rec[i]);
+
+		if (rec[2] > sizeof(buf)) {
+			fprintf(stderr, "%s: record of %u bytes, file is corrupt\n", path, rec[2]);
+			goto fail;
+		}
+		if (fread(buf, 1, rec[2], f) != rec[2])
+			break;
+
+		time = rec[0] * 1000000ULL + (nanos ? rec[1] / 1000 : rec[1]);
+		if (total_packets++ == 0) {
+			first_time = time;
+			next_sweep = time + SWEEP_US;
+		}
+		if (time > last_time)
+			last_time = time;
+
+		handle_frame(hdr[5] & 0x0FFFFFFF, time, buf, rec[2]);
+
+		if (time >= next_sweep) {
+			table_sweep(&exchanges, time, EXCHANGE_LIFETIME_US, exchange_expired);
+			table_sweep(&separate, time, EXCHANGE_LIFETIME_US, exchange_expired);
+			table_sweep(&observations, time, OBSERVE_IDLE_US, NULL);
+			next_sweep = time + SWEEP_US;
+		}
+	}
+
+	if (f != stdin)
+		fclose(f);
+	return 0;
+
+fail:
+	if (f != stdin)
+		fclose(f);
+	return 1;
+}
+
+//
+// Report
+//
+
+static void report(void)
+{
+	double duration = (last_time - first_time) / 1e6;
+	uint64_t requests = 0, transmissions = 0, lost = 0;
+	uint32_t i;
+
+	// whatever is still unanswered at the end of the capture counts as lost
+	table_sweep(&exchanges, UINT64_MAX, 0, exchange_expired);
+	table_sweep(&separate, UINT64_MAX, 0, exchange_expired);
+
+	printf("%" PRIu64 " packets, %" PRIu64 " CoAP, %" PRIu64 " skipped, %.1f s\n\n",
+	       total_packets, coap_packets, skipped, duration);
+
+	printf("%-24s %9s %9s %6s %7s %6s %8s %8s %8s %8s %7s %5s %7s\n",
+	       "alias", "requests", "req/s", "retx%", "lost", "errors",
+	       "p50 ms", "p90 ms", "p99 ms", "max ms", "notify", "dup", "B/req");
+
+	for (i = 0; i < alias_count; i++) {
+		alias_stats *a = &aliases[i];
+
+		printf("%-24s %9" PRIu64 " %9.2f %6.2f %7" PRIu64 " %6" PRIu64 " %8.1f %8.1f %8.1f %8.1f %7" PRIu64 " %5" PRIu64 " %7.1f\n",
+		       a->name, a->requests,
+		       duration > 0 ? a->requests / duration : 0.0,
+		       a->requests ? 100.0 * (a->transmissions - a->requests) / a->requests : 0.0,
+		       a->lost, a->errors,
+		       exo_hist_percentile(&a->rtt, 50) / 1e3,
+		       exo_hist_percentile(&a->rtt, 90) / 1e3,
+		       exo_hist_percentile(&a->rtt, 99) / 1e3,
+		       a->rtt.max / 1e3,
+		       a->notifications, a->duplicates,
+		       a->requests ? (double)a->bytes / a->requests : 0.0);
+
+		requests += a->requests;
+		transmissions += a->transmissions;
+		lost += a->lost;
+	}
+
+	printf("\n%" PRIu64 " requests, %" PRIu64 " retransmissions, %" PRIu64 " lost\n",
+	       requests, transmissions - requests, lost);
+	printf("%" PRIu64 " duplicate responses, %" PRIu64 " unmatched responses, %" PRIu64 " unmatched notifications\n",
+	       duplicate_responses, unmatched_responses, unmatched_notifications);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "p:h")) != -1) {
+		switch (opt) {
+			case 'p': server_port = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-p port] capture.pcap ... (- for stdin)\n", argv[0]);
+				return 2;
+		}
+	}
+
+	if (optind == argc) {
+		fprintf(stderr, "usage: %s [-p port] capture.pcap ... (- for stdin)\n", argv[0]);
+		return 2;
+	}
+
+	memset(alias_index, 0xFF, sizeof(alias_index));
+	table_init(&exchanges, TABLE_BITS);
+	table_init(&separate, TABLE_BITS);
+	table_init(&observations, TABLE_BITS);
+
+	for (; optind < argc; optind++)
+		ret |= read_capture(argv[optind]);
+
+	report();
+
+	return ret;
+}
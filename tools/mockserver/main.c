@@ -0,0 +1,250 @@
+/*****************************************************************************
+*
+*  Copyright (C) 2015 Exosite LLC
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*    Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+*
+*    Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the
+*    distribution.
+*
+*    Neither the name of Texas Instruments Incorporated nor the names of
+*    its contributors may be used to endorse or promote products derived
+*    from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+*  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+*  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+*  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+*  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+*  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+*  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+*  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+*  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "mockserver.h"
+
+// Peers are identified to the server by their index in this table.
+#define MAX_PEERS 4096
+
+static struct sockaddr_storage peers[MAX_PEERS];
+static socklen_t peer_lens[MAX_PEERS];
+static uint32_t peer_count;
+
+static exomock_server srv;
+static volatile sig_atomic_t running = 1;
+
+static void stop(int sig)
+{
+	running = 0;
+}
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * (uint64_t)1000000 + ts.tv_nsec / 1000;
+}
+
+static int peer_id(struct sockaddr_storage *addr, socklen_t len, uint32_t *id)
+{
+	uint32_t i;
+
+	for (i = 0; i < peer_count; i++) {
+		if (peer_lens[i] == len && memcmp(&peers[i], addr, len) == 0) {
+			*id = i;
+			return 0;
+		}
+	}
+
+	if (peer_count == MAX_PEERS)
+		return 1;
+
+	memcpy(&peers[peer_count], addr, len);
+	peer_lens[peer_count] = len;
+	*id = peer_count++;
+
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+	        "usage: %s [options]\n"
+	        "  -p port        UDP port to listen on (5683)\n"
+	        "  -c cik         CIK to hand out and require, '-' accepts any\n"
+	        "  -a alias=value create a dataport, may be repeated\n"
+	        "  -m max_age     Max-Age of observe responses in seconds (60)\n"
+	        "  -l ms          latency added to every response\n"
+	        "  -j ms          uniform random jitter added to every response\n"
+	        "  -L permille    loss, inbound and outbound\n"
+	        "  -d permille    duplicated responses\n"
+	        "  -r permille    reordered responses\n"
+	        "  -R ms          extra delay of reordered responses (100)\n"
+	        "  -u permille    dataport requests answered with 4.01\n"
+	        "  -n permille    dataport requests answered with 4.04\n"
+	        "  -s seed        random seed (1)\n",
+	        name);
+}
+
+static void print_counters(void)
+{
+	exomock_counters *c = &srv.counters;
+
+	printf("received %u sent %u invalid %u dropped %u duplicated %u reordered %u\n",
+	       c->received, c->sent, c->invalid, c->dropped, c->duplicated, c->reordered);
+	printf("activations %u reads %u writes %u observes %u notifications %u\n",
+	       c->activations, c->reads, c->writes, c->observes, c->notifications);
+	printf("injected errors %u queue overflows %u peers %u\n",
+	       c->injected_errors, c->overflows, peer_count);
+}
+
+int main(int argc, char **argv)
+{
+	int port = 5683, opt, sock;
+	uint32_t seed = 1;
+	struct sockaddr_in6 addr;
+	uint8_t buf[EXOMOCK_MTU];
+	char *aliases[EXOMOCK_MAX_ALIASES];
+	int alias_count = 0;
+	const char *cik = NULL;
+	exomock_faults faults;
+	int max_age = 60;
+
+	memset(&faults, 0, sizeof(faults));
+	faults.reorder_delay_us = 100000;
+
+	while ((opt = getopt(argc, argv, "p:c:a:m:l:j:L:d:r:R:u:n:s:h")) != -1) {
+		switch (opt) {
+			case 'p': port = atoi(optarg); break;
+			case 'c': cik = optarg; break;
+			case 'a':
+				if (alias_count < EXOMOCK_MAX_ALIASES)
+					aliases[alias_count++] = optarg;
+				break;
+			case 'm': max_age = atoi(optarg); break;
+			case 'l': faults.latency_us = atoi(optarg) * 1000; break;
+			case 'j': faults.jitter_us = atoi(optarg) * 1000; break;
+			case 'L': faults.loss_permille = atoi(optarg); break;
+			case 'd': faults.duplicate_permille = atoi(optarg); break;
+			case 'r': faults.reorder_permille = atoi(optarg); break;
+			case 'R': faults.reorder_delay_us = atoi(optarg) * 1000; break;
+			case 'u': faults.unauthorized_permille = atoi(optarg); break;
+			case 'n': faults.not_found_permille = atoi(optarg); break;
+			case 's': seed = strtoul(optarg, NULL, 0); break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	exomock_init(&srv, seed);
+	srv.faults = faults;
+	srv.max_age = max_age > 255 ? 255 : max_age;
+
+	if (cik != NULL) {
+		if (strcmp(cik, "-") == 0) {
+			srv.cik[0] = 0;
+		} else if (strlen(cik) == EXOMOCK_CIK_LENGTH) {
+			memcpy(srv.cik, cik, EXOMOCK_CIK_LENGTH);
+		} else {
+			fprintf(stderr, "CIK must be %d characters\n", EXOMOCK_CIK_LENGTH);
+			return 1;
+		}
+	}
+
+	for (int i = 0; i < alias_count; i++) {
+		char *eq = strchr(aliases[i], '=');
+		const char *value = "";
+
+		if (eq != NULL) {
+			*eq = 0;
+			value = eq + 1;
+		}
+
+		exomock_set_alias(&srv, aliases[i], value, strlen(value));
+	}
+
+	if ((sock = socket(AF_INET6, SOCK_DGRAM, 0)) == -1) {
+		perror("socket");
+		return 1;
+	}
+
+	// accept IPv4 too
+	opt = 0;
+	setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin6_family = AF_INET6;
+	addr.sin6_addr = in6addr_any;
+	addr.sin6_port = htons(port);
+
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		perror("bind");
+		return 1;
+	}
+
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+
+	printf("mock server listening on port %d\n", port);
+	fflush(stdout);
+
+	while (running) {
+		struct pollfd pfd = {sock, POLLIN, 0};
+		uint64_t now = now_us(), due = exomock_next_due(&srv);
+		int timeout = 1000;
+		uint32_t peer;
+		size_t len;
+
+		if (due <= now)
+			timeout = 0;
+		else if (due - now < 1000000)
+			timeout = (due - now + 999) / 1000;
+
+		if (poll(&pfd, 1, timeout) > 0) {
+			struct sockaddr_storage from;
+			socklen_t from_len = sizeof(from);
+			ssize_t n;
+
+			while ((n = recvfrom(sock, buf, sizeof(buf), MSG_DONTWAIT,
+			                     (struct sockaddr *)&from, &from_len)) >= 0) {
+				if (peer_id(&from, from_len, &peer) == 0)
+					exomock_receive(&srv, peer, now_us(), buf, n);
+				from_len = sizeof(from);
+			}
+		}
+
+		now = now_us();
+		while (exomock_poll(&srv, now, &peer, buf, sizeof(buf), &len) == 0) {
+			sendto(sock, buf, len, 0, (struct sockaddr *)&peers[peer], peer_lens[peer]);
+		}
+	}
+
+	print_counters();
+	close(sock);
+
+	return 0;
+}
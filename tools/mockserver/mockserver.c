@@ -0,0 +1,553 @@
+/*****************************************************************************
+*
+*  mockserver.c - Mock Exosite One Platform CoAP server
+*  Copyright (C) 2015 Exosite LLC
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*    Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+*
+*    Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the
+*    distribution.
+*
+*    Neither the name of Texas Instruments Incorporated nor the names of
+*    its contributors may be used to endorse or promote products derived
+*    from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+*  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+*  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+*  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+*  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+*  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+*  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+*  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+*  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*****************************************************************************/
+
+#include <string.h>
+
+#include "mockserver.h"
+#include "coap.h"
+
+#define EXOMOCK_MAX_PATH                        6
+
+typedef struct exomock_request
+{
+	uint8_t *path[EXOMOCK_MAX_PATH];
+	size_t path_len[EXOMOCK_MAX_PATH];
+	uint8_t path_count;
+	uint8_t *query;
+	size_t query_len;
+	uint8_t has_observe;
+	uint32_t observe;
+	coap_payload payload;
+} exomock_request;
+
+// Internal Functions
+
+static uint32_t exomock_rand(exomock_server *srv)
+{
+	// xorshift32, deterministic for a given seed
+	srv->rng ^= srv->rng << 13;
+	srv->rng ^= srv->rng >> 17;
+	srv->rng ^= srv->rng << 5;
+	return srv->rng;
+}
+
+static uint8_t exomock_roll(exomock_server *srv, uint16_t permille)
+{
+	return permille != 0 && exomock_rand(srv) % 1000 < permille;
+}
+
+static void exomock_push(exomock_server *srv, uint32_t peer, uint64_t due,
+                         const uint8_t *buf, size_t len)
+{
+	exomock_datagram *dg;
+
+	if (srv->pending_count == EXOMOCK_MAX_PENDING) {
+		srv->counters.overflows++;
+		return;
+	}
+
+	dg = &srv->pending[srv->pending_count++];
+	dg->due = due;
+	dg->order = srv->order++;
+	dg->peer = peer;
+	dg->len = len;
+	memcpy(dg->buf, buf, len);
+}
+
+// queue a datagram for a peer, applying the outbound faults
+static void exomock_queue(exomock_server *srv, uint32_t peer, uint64_t now, coap_pdu *pdu)
+{
+	exomock_faults *f = &srv->faults;
+	uint64_t due = now + f->latency_us;
+
+	if (exomock_roll(srv, f->loss_permille)) {
+		srv->counters.dropped++;
+		return;
+	}
+
+	if (f->jitter_us != 0)
+		due += exomock_rand(srv) % f->jitter_us;
+
+	if (exomock_roll(srv, f->reorder_permille)) {
+		srv->counters.reordered++;
+		due += f->reorder_delay_us;
+	}
+
+	exomock_push(srv, peer, due, pdu->buf, pdu->len);
+
+	if (exomock_roll(srv, f->duplicate_permille)) {
+		srv->counters.duplicated++;
+		exomock_push(srv, peer, due + f->jitter_us / 2, pdu->buf, pdu->len);
+	}
+}
+
+static coap_error exomock_add_uint_option(coap_pdu *pdu, coap_option_number num, uint32_t val)
+{
+	uint8_t bytes[4];
+	uint8_t len = 0;
+
+	// shortest big endian encoding, zero is a zero length option
+	while (val >> (8 * len) != 0 && len < 4)
+		len++;
+
+	for (int i = 0; i < len; i++)
+		bytes[i] = val >> (8 * (len - 1 - i));
+
+	return coap_add_option(pdu, num, bytes, len);
+}
+
+static void exomock_respond(exomock_server *srv, uint32_t peer, uint64_t now,
+                            coap_pdu *req, coap_code code,
+                            const exomock_alias *alias, uint8_t observe)
+{
+	uint8_t buf[EXOMOCK_MTU];
+	coap_pdu rsp = {buf, 0, sizeof(buf)};
+	coap_error ret;
+
+	coap_init_pdu(&rsp);
+	ret = coap_set_version(&rsp, COAP_V1);
+	if (coap_get_type(req) == CT_CON) {
+		ret |= coap_set_type(&rsp, CT_ACK);
+		ret |= coap_set_mid(&rsp, coap_get_mid(req));
+	} else {
+		ret |= coap_set_type(&rsp, CT_NON);
+		ret |= coap_set_mid(&rsp, srv->mid++);
+	}
+	ret |= coap_set_code(&rsp, code);
+	ret |= coap_set_token(&rsp, coap_get_token(req), coap_get_tkl(req));
+
+	if (observe)
+		ret |= exomock_add_uint_option(&rsp, CON_OBSERVE, alias->seq);
+
+	if (alias != NULL) {
+		ret |= exomock_add_uint_option(&rsp, CON_MAX_AGE, srv->max_age);
+		if (alias->len > 0)
+			ret |= coap_set_payload(&rsp, (uint8_t *)alias->value, alias->len);
+	}
+
+	if (ret != CE_NONE)
+		return;
+
+	exomock_queue(srv, peer, now, &rsp);
+}
+
+static void exomock_respond_payload(exomock_server *srv, uint32_t peer, uint64_t now,
+                                    coap_pdu *req, coap_code code,
+                                    const uint8_t *payload, size_t len)
+{
+	exomock_alias tmp;
+
+	tmp.seq = 0;
+	tmp.len = len < sizeof(tmp.value) ? len : sizeof(tmp.value);
+	memcpy(tmp.value, payload, tmp.len);
+
+	exomock_respond(srv, peer, now, req, code, &tmp, 0);
+}
+
+static int exomock_find_alias(exomock_server *srv, const uint8_t *name, size_t len)
+{
+	for (int i = 0; i < srv->alias_count; i++) {
+		if (strlen(srv->aliases[i].name) == len && memcmp(srv->aliases[i].name, name, len) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+static void exomock_notify(exomock_server *srv, uint64_t now, uint8_t alias_idx)
+{
+	uint8_t buf[EXOMOCK_MTU];
+	coap_pdu pdu = {buf, 0, sizeof(buf)};
+	exomock_alias *alias = &srv->aliases[alias_idx];
+	exomock_observer *obs;
+	coap_error ret;
+
+	for (int i = 0; i < EXOMOCK_MAX_OBSERVERS; i++) {
+		obs = &srv->observers[i];
+		if (!obs->active || obs->alias != alias_idx)
+			continue;
+
+		obs->last_mid = srv->mid++;
+
+		coap_init_pdu(&pdu);
+		ret = coap_set_version(&pdu, COAP_V1);
+		ret |= coap_set_type(&pdu, CT_CON);
+		ret |= coap_set_code(&pdu, CC_CONTENT);
+		ret |= coap_set_mid(&pdu, obs->last_mid);
+		ret |= coap_set_token(&pdu, obs->token, obs->tkl);
+		ret |= exomock_add_uint_option(&pdu, CON_OBSERVE, alias->seq);
+		ret |= exomock_add_uint_option(&pdu, CON_MAX_AGE, srv->max_age);
+		if (alias->len > 0)
+			ret |= coap_set_payload(&pdu, (uint8_t *)alias->value, alias->len);
+
+		if (ret != CE_NONE)
+			continue;
+
+		srv->counters.notifications++;
+		exomock_queue(srv, obs->peer, now, &pdu);
+	}
+}
+
+static exomock_observer *exomock_find_observer(exomock_server *srv, uint32_t peer, uint64_t token)
+{
+	for (int i = 0; i < EXOMOCK_MAX_OBSERVERS; i++) {
+		if (srv->observers[i].active && srv->observers[i].peer == peer &&
+		    srv->observers[i].token == token)
+			return &srv->observers[i];
+	}
+
+	return NULL;
+}
+
+static uint8_t exomock_observe(exomock_server *srv, uint32_t peer, coap_pdu *req, uint8_t alias_idx)
+{
+	exomock_observer *obs = exomock_find_observer(srv, peer, coap_get_token(req));
+
+	// a client refreshing with a new token replaces its old registration
+	for (int i = 0; obs == NULL && i < EXOMOCK_MAX_OBSERVERS; i++) {
+		if (srv->observers[i].active && srv->observers[i].peer == peer &&
+		    srv->observers[i].alias == alias_idx)
+			obs = &srv->observers[i];
+	}
+
+	for (int i = 0; obs == NULL && i < EXOMOCK_MAX_OBSERVERS; i++) {
+		if (!srv->observers[i].active)
+			obs = &srv->observers[i];
+	}
+
+	if (obs == NULL)
+		return 1;
+
+	obs->active = 1;
+	obs->peer = peer;
+	obs->token = coap_get_token(req);
+	obs->tkl = coap_get_tkl(req);
+	obs->alias = alias_idx;
+	obs->last_mid = coap_get_mid(req);
+
+	return 0;
+}
+
+static void exomock_parse(coap_pdu *pdu, exomock_request *req)
+{
+	coap_option opt;
+
+	memset(req, 0, sizeof(*req));
+
+	opt.num = 0;
+	do {
+		opt = coap_get_option(pdu, &opt);
+
+		if (opt.num == CON_URI_PATH && req->path_count < EXOMOCK_MAX_PATH) {
+			req->path[req->path_count] = opt.val;
+			req->path_len[req->path_count] = opt.len;
+			req->path_count++;
+		} else if (opt.num == CON_URI_QUERY) {
+			req->query = opt.val;
+			req->query_len = opt.len;
+		} else if (opt.num == CON_OBSERVE) {
+			req->has_observe = 1;
+			for (size_t i = 0; i < opt.len; i++)
+				req->observe = (req->observe << 8) | opt.val[i];
+		}
+	} while (opt.num != 0);
+
+	req->payload = coap_get_payload(pdu);
+}
+
+static uint8_t exomock_path_is(exomock_request *req, uint8_t idx, const char *seg)
+{
+	return idx < req->path_count && req->path_len[idx] == strlen(seg) &&
+	       memcmp(req->path[idx], seg, req->path_len[idx]) == 0;
+}
+
+static void exomock_handle_dataport(exomock_server *srv, uint32_t peer, uint64_t now,
+                                    coap_pdu *pdu, exomock_request *req)
+{
+	int idx;
+
+	if (srv->cik[0] != 0 &&
+	    (req->query_len != EXOMOCK_CIK_LENGTH || memcmp(req->query, srv->cik, EXOMOCK_CIK_LENGTH) != 0)) {
+		exomock_respond(srv, peer, now, pdu, CC_UNAUTHORIZED, NULL, 0);
+		return;
+	}
+
+	if (exomock_roll(srv, srv->faults.unauthorized_permille)) {
+		srv->counters.injected_errors++;
+		exomock_respond(srv, peer, now, pdu, CC_UNAUTHORIZED, NULL, 0);
+		return;
+	}
+
+	if (exomock_roll(srv, srv->faults.not_found_permille)) {
+		srv->counters.injected_errors++;
+		exomock_respond(srv, peer, now, pdu, CC_NOT_FOUND, NULL, 0);
+		return;
+	}
+
+	idx = exomock_find_alias(srv, req->path[1], req->path_len[1]);
+
+	switch (coap_get_code(pdu)) {
+		case CC_GET:
+			if (idx < 0) {
+				exomock_respond(srv, peer, now, pdu, CC_NOT_FOUND, NULL, 0);
+				break;
+			}
+
+			if (req->has_observe && req->observe == 0) {
+				srv->counters.observes++;
+				if (exomock_observe(srv, peer, pdu, idx) != 0) {
+					exomock_respond(srv, peer, now, pdu, CC_SERVICE_UNAVAILABLE, NULL, 0);
+					break;
+				}
+				exomock_respond(srv, peer, now, pdu, CC_CONTENT, &srv->aliases[idx], 1);
+				break;
+			}
+
+			if (req->has_observe) {
+				exomock_observer *obs = exomock_find_observer(srv, peer, coap_get_token(pdu));
+				if (obs != NULL)
+					obs->active = 0;
+			}
+
+			srv->counters.reads++;
+			exomock_respond(srv, peer, now, pdu, CC_CONTENT, &srv->aliases[idx], 0);
+			break;
+		case CC_POST:
+		case CC_PUT:
+			srv->counters.writes++;
+			idx = exomock_set_alias(srv, (const char *)req->path[1], (const char *)req->payload.val,
+			                        req->payload.len);
+			if (idx < 0) {
+				exomock_respond(srv, peer, now, pdu, CC_REQUEST_ENTITY_TOO_LARGE, NULL, 0);
+				break;
+			}
+
+			exomock_respond(srv, peer, now, pdu, CC_CHANGED, NULL, 0);
+			exomock_notify(srv, now, idx);
+			break;
+		default:
+			exomock_respond(srv, peer, now, pdu, CC_METHOD_NOT_ALLOWED, NULL, 0);
+			break;
+	}
+}
+
+// Public Functions
+
+/*!
+ * \brief Initializes a mock server
+ *
+ * Clears all state. The CIK handed out on activation (and required on every
+ * dataport request) defaults to a fixed value, set `cik` afterwards to change
+ * it, or clear it to accept any CIK.
+ *
+ * \param[out] srv   server to initialize
+ * \param[in]  seed  seed for the fault injection random numbers
+ */
+void exomock_init(exomock_server *srv, uint32_t seed)
+{
+	memset(srv, 0, sizeof(*srv));
+	memcpy(srv->cik, "a32c85ba9dda45823be416246cf8b433baa068d7", EXOMOCK_CIK_LENGTH);
+	srv->max_age = 60;
+	srv->rng = seed != 0 ? seed : 1;
+	srv->mid = seed;
+}
+
+/*!
+ * \brief Creates or updates a dataport
+ *
+ * Only the first EXOMOCK_ALIAS_MAX characters of `alias` are used.
+ *
+ * \return index of the alias, or -1 if out of space or value too large
+ */
+int exomock_set_alias(exomock_server *srv, const char *alias, const char *value, size_t len)
+{
+	size_t alias_len = 0;
+	int idx;
+
+	while (alias_len < EXOMOCK_ALIAS_MAX && alias[alias_len] != 0)
+		alias_len++;
+
+	if (len > EXOMOCK_VALUE_MAX)
+		return -1;
+
+	idx = exomock_find_alias(srv, (const uint8_t *)alias, alias_len);
+	if (idx < 0) {
+		if (srv->alias_count == EXOMOCK_MAX_ALIASES)
+			return -1;
+
+		idx = srv->alias_count++;
+		memcpy(srv->aliases[idx].name, alias, alias_len);
+		srv->aliases[idx].name[alias_len] = 0;
+	}
+
+	memcpy(srv->aliases[idx].value, value, len);
+	srv->aliases[idx].len = len;
+	srv->aliases[idx].seq++;
+
+	return idx;
+}
+
+/*!
+ * \brief Handles one datagram from a peer
+ *
+ * Any responses or notifications it causes are queued until they are due.
+ *
+ * \param[in] peer  caller chosen number identifying the sender
+ * \param[in] now   current time in microseconds
+ */
+void exomock_receive(exomock_server *srv, uint32_t peer, uint64_t now,
+                     const uint8_t *buf, size_t len)
+{
+	uint8_t pkt[EXOMOCK_MTU];
+	coap_pdu pdu = {pkt, len, sizeof(pkt)};
+	exomock_request req;
+
+	srv->counters.received++;
+
+	if (len > sizeof(pkt)) {
+		srv->counters.invalid++;
+		return;
+	}
+
+	memcpy(pkt, buf, len);
+
+	if (coap_validate_pkt(&pdu) != CE_NONE) {
+		srv->counters.invalid++;
+		return;
+	}
+
+	if (exomock_roll(srv, srv->faults.loss_permille)) {
+		srv->counters.dropped++;
+		return;
+	}
+
+	switch (coap_get_type(&pdu)) {
+		case CT_ACK:
+			return;
+		case CT_RST:
+			// peer doesn't want the notification, forget it
+			for (int i = 0; i < EXOMOCK_MAX_OBSERVERS; i++) {
+				if (srv->observers[i].active && srv->observers[i].peer == peer &&
+				    srv->observers[i].last_mid == coap_get_mid(&pdu))
+					srv->observers[i].active = 0;
+			}
+			return;
+		case CT_CON:
+		case CT_NON:
+			break;
+	}
+
+	if (coap_get_code(&pdu) == CC_EMPTY) {
+		// CoAP ping, answer with RST
+		coap_set_type(&pdu, CT_RST);
+		exomock_queue(srv, peer, now, &pdu);
+		return;
+	}
+
+	exomock_parse(&pdu, &req);
+
+	if (req.path_count == 5 && exomock_path_is(&req, 0, "provision") &&
+	    exomock_path_is(&req, 1, "activate") && coap_get_code(&pdu) == CC_POST) {
+		srv->counters.activations++;
+		exomock_respond_payload(srv, peer, now, &pdu, CC_CONTENT,
+		                        (const uint8_t *)srv->cik, strlen(srv->cik));
+	} else if (req.path_count == 2 && exomock_path_is(&req, 0, "1a") &&
+	           req.path_len[1] <= EXOMOCK_ALIAS_MAX) {
+		// make the alias a C string for exomock_set_alias()
+		char alias[EXOMOCK_ALIAS_MAX + 1];
+		memcpy(alias, req.path[1], req.path_len[1]);
+		alias[req.path_len[1]] = 0;
+		req.path[1] = (uint8_t *)alias;
+
+		exomock_handle_dataport(srv, peer, now, &pdu, &req);
+	} else {
+		exomock_respond(srv, peer, now, &pdu, CC_NOT_FOUND, NULL, 0);
+	}
+}
+
+/*!
+ * \brief Takes the next datagram that is due
+ *
+ * \param[in]  now   current time in microseconds
+ * \param[out] peer  who the datagram is for
+ *
+ * \return 0 if a datagram was returned, 1 if none are due yet
+ */
+uint8_t exomock_poll(exomock_server *srv, uint64_t now, uint32_t *peer,
+                     uint8_t *buf, size_t size, size_t *len)
+{
+	exomock_datagram *dg = NULL;
+	uint16_t i;
+
+	for (i = 0; i < srv->pending_count; i++) {
+		exomock_datagram *cand = &srv->pending[i];
+		if (cand->due > now)
+			continue;
+		if (dg == NULL || cand->due < dg->due ||
+		    (cand->due == dg->due && cand->order < dg->order))
+			dg = cand;
+	}
+
+	if (dg == NULL)
+		return 1;
+
+	*peer = dg->peer;
+	*len = dg->len < size ? dg->len : size;
+	memcpy(buf, dg->buf, *len);
+
+	srv->counters.sent++;
+
+	// swap the last one into the hole, order is kept by `due` and `order`
+	srv->pending_count--;
+	if (dg != &srv->pending[srv->pending_count])
+		*dg = srv->pending[srv->pending_count];
+
+	return 0;
+}
+
+/*!
+ * \return time the next queued datagram is due, UINT64_MAX if none are queued
+ */
+uint64_t exomock_next_due(exomock_server *srv)
+{
+	uint64_t due = UINT64_MAX;
+
+	for (uint16_t i = 0; i < srv->pending_count; i++) {
+		if (srv->pending[i].due < due)
+			due = srv->pending[i].due;
+	}
+
+	return due;
+}
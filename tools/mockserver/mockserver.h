@@ -0,0 +1,148 @@
+/*****************************************************************************
+*
+*  mockserver.h - Mock Exosite One Platform CoAP server
+*  Copyright (C) 2015 Exosite LLC
+*
+*  Redistribution and use in source and binary forms, with or without
+*  modification, are permitted provided that the following conditions
+*  are met:
+*
+*    Redistributions of source code must retain the above copyright
+*    notice, this list of conditions and the following disclaimer.
+*
+*    Redistributions in binary form must reproduce the above copyright
+*    notice, this list of conditions and the following disclaimer in the
+*    documentation and/or other materials provided with the
+*    distribution.
+*
+*    Neither the name of Texas Instruments Incorporated nor the names of
+*    its contributors may be used to endorse or promote products derived
+*    from this software without specific prior written permission.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+*  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+*  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+*  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+*  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+*  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+*  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+*  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+*  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+*  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+*  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*
+*****************************************************************************/
+
+#ifndef EXOMOCK_H
+#define EXOMOCK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// DEFINES
+#define EXOMOCK_CIK_LENGTH                      40
+#define EXOMOCK_MTU                             576
+#define EXOMOCK_ALIAS_MAX                       32
+#define EXOMOCK_VALUE_MAX                       256
+#define EXOMOCK_MAX_ALIASES                     64
+
+// Enough for a few thousand devices each observing something, as exoload
+// and exosim drive it.
+#ifndef EXOMOCK_MAX_OBSERVERS
+#define EXOMOCK_MAX_OBSERVERS                   4096
+#endif
+#ifndef EXOMOCK_MAX_PENDING
+#define EXOMOCK_MAX_PENDING                     4096
+#endif
+
+/*!
+ * Fault injection settings. Probabilities are in parts per thousand and are
+ * rolled independently for every datagram.
+ */
+typedef struct exomock_faults
+{
+	uint32_t latency_us;            // added to every outbound datagram
+	uint32_t jitter_us;             // uniform extra delay, [0, jitter_us)
+	uint32_t reorder_delay_us;      // extra delay for reordered datagrams
+	uint16_t loss_permille;         // inbound and outbound drop chance
+	uint16_t duplicate_permille;    // outbound datagram is sent twice
+	uint16_t reorder_permille;      // outbound datagram is held back
+	uint16_t unauthorized_permille; // /1a request answered with 4.01
+	uint16_t not_found_permille;    // /1a request answered with 4.04
+} exomock_faults;
+
+typedef struct exomock_counters
+{
+	uint32_t received;
+	uint32_t sent;
+	uint32_t invalid;
+	uint32_t dropped;
+	uint32_t duplicated;
+	uint32_t reordered;
+	uint32_t injected_errors;
+	uint32_t activations;
+	uint32_t reads;
+	uint32_t writes;
+	uint32_t observes;
+	uint32_t notifications;
+	uint32_t overflows;
+} exomock_counters;
+
+typedef struct exomock_alias
+{
+	char name[EXOMOCK_ALIAS_MAX + 1];
+	char value[EXOMOCK_VALUE_MAX];
+	size_t len;
+	uint32_t seq;
+} exomock_alias;
+
+typedef struct exomock_observer
+{
+	uint32_t peer;
+	uint64_t token;
+	uint8_t tkl;
+	uint8_t active;
+	uint8_t alias;
+	uint16_t last_mid;
+} exomock_observer;
+
+typedef struct exomock_datagram
+{
+	uint64_t due;
+	uint32_t order;
+	uint32_t peer;
+	size_t len;
+	uint8_t buf[EXOMOCK_MTU];
+} exomock_datagram;
+
+/*!
+ * A mock server. It doesn't own a socket, datagrams are handed to
+ * `exomock_receive()` tagged with a caller chosen peer number and responses
+ * are collected with `exomock_poll()` once they're due. That way it can sit
+ * behind a UDP socket or be driven in-process.
+ */
+typedef struct exomock_server
+{
+	exomock_faults faults;
+	exomock_counters counters;
+	char cik[EXOMOCK_CIK_LENGTH + 1];
+	uint8_t max_age;
+	uint8_t alias_count;
+	uint16_t mid;
+	uint32_t rng;
+	uint32_t order;
+	uint16_t pending_count;
+	exomock_alias aliases[EXOMOCK_MAX_ALIASES];
+	exomock_observer observers[EXOMOCK_MAX_OBSERVERS];
+	exomock_datagram pending[EXOMOCK_MAX_PENDING];
+} exomock_server;
+
+void exomock_init(exomock_server *srv, uint32_t seed);
+int exomock_set_alias(exomock_server *srv, const char *alias, const char *value, size_t len);
+void exomock_receive(exomock_server *srv, uint32_t peer, uint64_t now,
+                     const uint8_t *buf, size_t len);
+uint8_t exomock_poll(exomock_server *srv, uint64_t now, uint32_t *peer,
+                     uint8_t *buf, size_t size, size_t *len);
+uint64_t exomock_next_due(exomock_server *srv);
+
+#endif